@@ -12,27 +12,112 @@ Apod::Apod(Stream &s) {
   ApodSerial = &s;
 }
 
-void Apod::HandShakeBpod() {
-  // Handshake with Bpod
+int Apod::HandShakeBpod(unsigned long Timeout) {
+  // Handshake with Bpod, then read its capabilities into bpod_caps.
+  // '6' is re-sent at growing intervals (1 ms, doubling up to 256 ms) until Bpod answers '5',
+  // so a running Bpod connects within milliseconds and a rebooting one as soon as it is up.
+  // Timeout in ms (0 = keep trying). Returns 0 when connected, -1 on timeout.
+  unsigned long StartTime = millis();
+  unsigned long LastMessageTime = StartTime;
+  unsigned long Interval = 1000; // us
   int isHandshake = 0;
+  SerialReadAll();
   while (!isHandshake) {
     ApodSerial->write('6'); // handshake with Bpod
-    delay(100);
-    while (!ApodSerial->available()) {
-      SerialUSB.println("Error: Handshake failed. Tyring again...");
-      delay(5000);
-      ApodSerial->write('6');
-      delay(100);
-    }
-    if (ApodSerial->read() != '5') {
-      while (ApodSerial->available()) {
-        ApodSerial->read();
+    unsigned long SentTime = micros();
+    while (!isHandshake && (micros() - SentTime < Interval)) {
+      if (ApodSerial->available() && ApodSerial->read() == '5') {
+        isHandshake = 1;
+      }
+    }
+    if (!isHandshake) {
+      if ((Timeout > 0) && (millis() - StartTime >= Timeout)) {
+        SerialUSB.println("Error: Handshake failed (timeout).");
+        return -1;
+      }
+      if (millis() - LastMessageTime >= 5000) {
+        SerialUSB.println("Error: Handshake failed. Tyring again...");
+        LastMessageTime = millis();
+      }
+      if (Interval < 256000) {
+        Interval *= 2;
       }
-    } else {
-      SerialUSB.println("Handshake with Bpod successfully.");
-      isHandshake = 1;
     }
   }
+  ReadCapabilities();
+  SerialUSB.println("Handshake with Bpod successfully.");
+  return 0;
+}
+
+void Apod::ReadCapabilities() {
+  // Capabilities record: 'K', length, then the BpodCapabilities fields from FirmwareBuild on (little-endian).
+  // Fields are only ever appended, so longer records from newer firmware are read in part.
+  // Firmware without 'K' does not answer; its build number is read with 'F' and no optional features are assumed:
+  // Features is 0 and matrices are sent without the wave columns (17 output columns).
+  bpod_caps = BpodCapabilities();
+  ApodSerial->write('K');
+  int Reply;
+  do {
+    Reply = SerialReadByteTimeout(250);
+  } while (Reply == '5'); // Answers to repeated '6'
+  if (Reply == 'K') {
+    byte Record[32] = {0};
+    int Length = SerialReadByteTimeout(250);
+    for (int i = 0; i < Length; i++) {
+      int b = SerialReadByteTimeout(250);
+      if (b < 0) {
+        Length = i;
+        break;
+      }
+      if (i < 32) {
+        Record[i] = b;
+      }
+    }
+    if (Length >= 23) {
+      bpod_caps.Known = 1;
+      bpod_caps.FirmwareBuild = Record[0];
+      bpod_caps.Features = (unsigned long)Record[1] | ((unsigned long)Record[2] << 8) | ((unsigned long)Record[3] << 16) | ((unsigned long)Record[4] << 24);
+      bpod_caps.MaxStates = Record[5];
+      bpod_caps.nGlobalTimers = Record[6];
+      bpod_caps.nGlobalCounters = Record[7];
+      bpod_caps.nOutputColumns = Record[8];
+      bpod_caps.TickPeriod = Record[9] | (Record[10] << 8);
+      bpod_caps.MaxEvents = Record[11] | (Record[12] << 8);
+      bpod_caps.MaxTransitions = Record[13] | (Record[14] << 8);
+      bpod_caps.MaxSequenceSteps = Record[15];
+      bpod_caps.MaxWaves = Record[16];
+      bpod_caps.MaxWaveSamples = Record[17] | (Record[18] << 8);
+      bpod_caps.BlockMatrixPoolSize = Record[19] | (Record[20] << 8);
+      bpod_caps.BlockScheduleSize = Record[21] | (Record[22] << 8);
+      if (Length >= 25) {
+        bpod_caps.VirtualEventQueueSize = Record[23];
+        bpod_caps.VirtualEventBudget = Record[24];
+      }
+      if (Length >= 27) {
+        bpod_caps.AnalogRingSize = Record[25] | (Record[26] << 8);
+      }
+      if (Length >= 28) {
+        bpod_caps.ForwardQueueSize = Record[27];
+      }
+      return;
+    }
+  }
+  SerialReadAll();
+  ApodSerial->write('F');
+  do {
+    Reply = SerialReadByteTimeout(250);
+  } while (Reply == '5');
+  bpod_caps.FirmwareBuild = (Reply < 0) ? 0 : Reply;
+  bpod_caps.Features = 0;
+  bpod_caps.nOutputColumns = 17;
+}
+
+bool Apod::FirmwareSupports(unsigned long Feature) {
+  if (bpod_caps.Features & Feature) {
+    return true;
+  }
+  SerialUSB.println("Error: Not supported by the Bpod firmware.");
+  return false;
 }
 
 States Apod::CreateState(String Name,                  // State Name
@@ -115,10 +200,13 @@ int Apod::AddState(States *state)
     _sma.GlobalTimerMatrix[CurrentState][i] = CurrentState;
     _sma.GlobalCounterMatrix[CurrentState][i] = CurrentState;
   }
+  for (int i = 0; i < 16; i++) {
+    _sma.AnalogMatrix[CurrentState][i] = CurrentState;
+  }
 
   // Add state transitions.
   for (int i = 0; i < state->nStateChange; i++) {
-    int CandidateEventCode = find_idx(EventNames, 50, state->StateChangeCondition[i].StateChangeTrigger);
+    int CandidateEventCode = find_idx(EventNames, 66, state->StateChangeCondition[i].StateChangeTrigger);
     if (CandidateEventCode < 0) {
       _sma.nStates--;
       return -1;
@@ -131,7 +219,10 @@ int Apod::AddState(States *state)
       TargetStateNumber = find_idx(_sma.StateNames, _sma.nStates, TargetState);
     }
 
-    if (CandidateEventCode > 39) {
+    if (CandidateEventCode >= 50) {
+      _sma.AnalogMatrix[CurrentState][CandidateEventCode - 50] = TargetStateNumber;
+      _sma.AnalogUsed = 1;
+    } else if (CandidateEventCode > 39) {
       String CandidateEventName = state->StateChangeCondition[i].StateChangeTrigger;
       if (CandidateEventName.length() > 4) {
         if (CandidateEventName.endsWith("_End")) {
@@ -162,7 +253,7 @@ int Apod::AddState(States *state)
 
 
   // Add output actions.
-  for (int i = 0; i < 17; i++) {
+  for (int i = 0; i < 19; i++) {
     _sma.OutputMatrix[CurrentState][i] = 0;
   }
   for (int i = 0; i < state->nOutput; i++) {
@@ -183,7 +274,7 @@ int Apod::AddState(States *state)
           break;
       }
     } else {
-      int TargetEventCode = find_idx(OutputActionNames, 17, state->Output[i].OutputType);
+      int TargetEventCode = find_idx(OutputActionNames, 19, state->Output[i].OutputType);
       if (TargetEventCode >= 0) {
         int Value = state->Output[i].Value;
         _sma.OutputMatrix[CurrentState][TargetEventCode] = Value;
@@ -215,126 +306,219 @@ void Apod::SetGlobalCounter(byte CounterNumber, String TargetEventName, unsigned
   // TargetEventName: The name of the event to count (a string; see Input Event Codes)
   // Threshold: The number of event instances to count. (an integer).
   _sma.GlobalCounterThresholds[CounterNumber - 1] = Threshold;
-  byte TargetEventCode = find_idx(EventNames, 50, TargetEventName);
+  byte TargetEventCode = find_idx(EventNames, 66, TargetEventName);
   _sma.GlobalCounterEvents[CounterNumber - 1] = TargetEventCode;
   _sma.GlobalCounterSet[CounterNumber - 1] = 1;
 }
 
+int Apod::SetEventRecording(String EventName, bool Record) {
+  // Choose whether the Bpod stores and sends an event (e.g. "Port1Out") or a whole class (e.g. "Wire", see EventClassNames).
+  // Events that are not recorded still trigger state changes and global counters; the Bpod reports how many it
+  // skipped in trial_res.DroppedEvents. Part of the state matrix: cleared by EmptyMatrix.
+  int First = find_idx(EventNames, 66, EventName);
+  int Last = First;
+  if (First >= 50) {
+    SerialUSB.println("Error: Analog events are always recorded.");
+    return -1;
+  }
+  if (First < 0) {
+    int Class = find_idx(EventClassNames, 7, EventName);
+    if (Class < 0) {
+      SerialUSB.println("Error: Unknown event name.");
+      return -1;
+    }
+    First = EventClassStart[Class];
+    Last = EventClassStart[Class + 1] - 1;
+  }
+  for (int i = First; i <= Last; i++) {
+    if (Record) {
+      _sma.EventMask[i / 8] &= ~(1 << (i % 8));
+    } else {
+      _sma.EventMask[i / 8] |= (1 << (i % 8));
+    }
+  }
+  return 0;
+}
+
 int Apod::SendStateMatrix() {
+  ProfileMark(PhaseBuild);
   // clear serial
-  while (ApodSerial->available()) {
-    ApodSerial->read(); // clear ApodSerial dirty data
-  }
+  FlushBpod(); // clear ApodSerial dirty data
 
   //SerialUSB.println("Start Sending.");
   byte stateNum = _sma.nStates;
+  if (stateNum > bpod_caps.MaxStates) {
+    SerialUSB.println("Error: Too many states for the Bpod firmware.");
+    return -1;
+  }
   if (stateNum > 0) {
-    byte output[stateNum * 71 + 59];
-    int index = 0;
-    byte FourthByte;
-    byte ThirdByte;
-    byte SecondByte;
-    byte LowByte;
-
-    output[index++] = 'P';
-
-    output[index++] = stateNum;
+    byte output[stateNum * 73 + 66];
+    int index = BuildStateMatrix(output);
+    ProfileMark(PhaseSerialize);
 
-    for (int i = 0; i < stateNum; i++) {
-      for (int j = 0; j < 40; j++) {
-        output[index++] = _sma.InputMatrix[i][j];
-      }
+    for (int i = 0; i < index; i++) {
+      ApodSerial->write(output[i]);
     }
-
-    for (int i = 0; i < stateNum; i++) {
-      for (int j = 0; j < 17; j++) {
-        output[index++] = _sma.OutputMatrix[i][j];
-      }
+    if (RecordStream) {
+      RecordHeader('M', index);
+      RecordStream->write(output, index);
     }
+    ProfileMark(PhaseTransmit, index);
 
-    for (int i = 0; i < stateNum; i++) {
-      for (int j = 0; j < 5; j++) {
-        output[index++] = _sma.GlobalTimerMatrix[i][j];
-      }
+    byte returnVal = ReadReply();
+    ProfileMark(PhaseAck, 1);
+    if (returnVal != 1) {
+      SerialUSB.println("Error: Sending State Machine failed (invalid op code).");
+      return -1;
     }
-
-    for (int i = 0; i < stateNum; i++) {
-      for (int j = 0; j < 5; j++) {
-        output[index++] = _sma.GlobalCounterMatrix[i][j];
-      }
+    if (_sma.AnalogUsed) {
+      return SendAnalogMatrix();
     }
+    return 0;
+  } else {
+    SerialUSB.println("Error: Sending Empty Matrix.");
+    return -1;
+  }
+}
 
-    for (int i = 0; i < 5; i++) {
-      output[index++] = _sma.GlobalCounterEvents[i];
-    }
+int Apod::BuildStateMatrix(byte* output) {
+  // Serialize the state matrix (op code + payload) into output, which must hold nStates * 73 + 66 bytes.
+  // Returns the number of bytes written.
+  // Rows are sent dense ('P') or, when that is shorter and the firmware supports it, sparse ('C'): per row, the number of entries that differ
+  // from the row default (the state itself for transitions, 0 for outputs), then (column, value) pairs.
+  // Everything after the rows is identical for both op codes. The event mask (7 bytes) is only sent to firmware that supports it,
+  // and the wave columns (WaveTrig, WaveCancel) only to firmware with waves.
+  byte stateNum = _sma.nStates;
+  byte OutputColumns = (bpod_caps.Features & FeatureWaves) ? 19 : 17;
+  int index = 0;
+  byte FourthByte;
+  byte ThirdByte;
+  byte SecondByte;
+  byte LowByte;
 
-    for (int i = 0; i < 8; i++) {
-      output[index++] = PortInputsEnabled[i];
-    }
+  int SparseLength = BuildMatrixRows(0, &_sma.InputMatrix[0][0], 40, true, true);
+  SparseLength += BuildMatrixRows(0, &_sma.OutputMatrix[0][0], 19, false, true, OutputColumns);
+  SparseLength += BuildMatrixRows(0, &_sma.GlobalTimerMatrix[0][0], 5, true, true);
+  SparseLength += BuildMatrixRows(0, &_sma.GlobalCounterMatrix[0][0], 5, true, true);
+  bool Sparse = (bpod_caps.Features & FeatureSparseMatrix) && (SparseLength < stateNum * (50 + OutputColumns));
 
-    for (int i = 0; i < 4; i++) {
-      output[index++] = WireInputsEnabled[i];
-    }
+  output[index++] = Sparse ? 'C' : 'P';
 
-    for (int i = 0; i < stateNum; i++) {
-      unsigned long ConvertedTimer = _sma.StateTimers[i] * TimerScaleFactor;
-      FourthByte = (ConvertedTimer & 0xff000000UL) >> 24;
-      ThirdByte = (ConvertedTimer & 0x00ff0000UL) >> 16;
-      SecondByte = (ConvertedTimer & 0x0000ff00UL) >> 8;
-      LowByte = (ConvertedTimer & 0x000000ffUL);
-      output[index++] = LowByte;
-      output[index++] = SecondByte;
-      output[index++] = ThirdByte;
-      output[index++] = FourthByte;
-    }
+  output[index++] = stateNum;
 
-    for (int i = 0; i < 5; i++) {
-      unsigned long ConvertedTimer = _sma.GlobalTimers[i] * TimerScaleFactor;
-      FourthByte = (ConvertedTimer & 0xff000000UL) >> 24;
-      ThirdByte = (ConvertedTimer & 0x00ff0000UL) >> 16;
-      SecondByte = (ConvertedTimer & 0x0000ff00UL) >> 8;
-      LowByte = (ConvertedTimer & 0x000000ffUL);
-      output[index++] = LowByte;
-      output[index++] = SecondByte;
-      output[index++] = ThirdByte;
-      output[index++] = FourthByte;
-    }
+  index += BuildMatrixRows(output + index, &_sma.InputMatrix[0][0], 40, true, Sparse);
+  index += BuildMatrixRows(output + index, &_sma.OutputMatrix[0][0], 19, false, Sparse, OutputColumns);
+  index += BuildMatrixRows(output + index, &_sma.GlobalTimerMatrix[0][0], 5, true, Sparse);
+  index += BuildMatrixRows(output + index, &_sma.GlobalCounterMatrix[0][0], 5, true, Sparse);
 
-    for (int i = 0; i < 5; i++) {
-      FourthByte = (_sma.GlobalCounterThresholds[i] & 0xff000000UL) >> 24;
-      ThirdByte = (_sma.GlobalCounterThresholds[i] & 0x00ff0000UL) >> 16;
-      SecondByte = (_sma.GlobalCounterThresholds[i] & 0x0000ff00UL) >> 8;
-      LowByte = (_sma.GlobalCounterThresholds[i] & 0x000000ffUL);
-      output[index++] = LowByte;
-      output[index++] = SecondByte;
-      output[index++] = ThirdByte;
-      output[index++] = FourthByte;
-    }
+  for (int i = 0; i < 5; i++) {
+    output[index++] = _sma.GlobalCounterEvents[i];
+  }
 
-    for (int i = 0; i < index; i++) {
-      ApodSerial->write(output[i]);
+  for (int i = 0; i < 8; i++) {
+    output[index++] = PortInputsEnabled[i];
+  }
+
+  for (int i = 0; i < 4; i++) {
+    output[index++] = WireInputsEnabled[i];
+  }
+
+  for (int i = 0; i < stateNum; i++) {
+    unsigned long ConvertedTimer = _sma.StateTimers[i] * TimerScaleFactor;
+    FourthByte = (ConvertedTimer & 0xff000000UL) >> 24;
+    ThirdByte = (ConvertedTimer & 0x00ff0000UL) >> 16;
+    SecondByte = (ConvertedTimer & 0x0000ff00UL) >> 8;
+    LowByte = (ConvertedTimer & 0x000000ffUL);
+    output[index++] = LowByte;
+    output[index++] = SecondByte;
+    output[index++] = ThirdByte;
+    output[index++] = FourthByte;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    unsigned long ConvertedTimer = _sma.GlobalTimers[i] * TimerScaleFactor;
+    FourthByte = (ConvertedTimer & 0xff000000UL) >> 24;
+    ThirdByte = (ConvertedTimer & 0x00ff0000UL) >> 16;
+    SecondByte = (ConvertedTimer & 0x0000ff00UL) >> 8;
+    LowByte = (ConvertedTimer & 0x000000ffUL);
+    output[index++] = LowByte;
+    output[index++] = SecondByte;
+    output[index++] = ThirdByte;
+    output[index++] = FourthByte;
+  }
+
+  for (int i = 0; i < 5; i++) {
+    FourthByte = (_sma.GlobalCounterThresholds[i] & 0xff000000UL) >> 24;
+    ThirdByte = (_sma.GlobalCounterThresholds[i] & 0x00ff0000UL) >> 16;
+    SecondByte = (_sma.GlobalCounterThresholds[i] & 0x0000ff00UL) >> 8;
+    LowByte = (_sma.GlobalCounterThresholds[i] & 0x000000ffUL);
+    output[index++] = LowByte;
+    output[index++] = SecondByte;
+    output[index++] = ThirdByte;
+    output[index++] = FourthByte;
+  }
+
+  if (bpod_caps.Features & FeatureEventMask) {
+    for (int i = 0; i < 7; i++) {
+      output[index++] = _sma.EventMask[i];
     }
+  }
+  return index;
+}
 
-    byte returnVal = SerialReadByte();
-    if (returnVal != 1) {
-      SerialUSB.println("Error: Sending State Machine failed (invalid op code).");
-      return -1;
+int Apod::BuildMatrixRows(byte* output, byte* Matrix, byte nColumns, bool SelfDefault, bool Sparse, byte nSent) {
+  // Write the first nStates rows of Matrix (nColumns wide), dense or sparse. With output = 0, only count the bytes.
+  // nSent: columns sent from each row, the first ones (0 = all).
+  int index = 0;
+  byte nRowColumns = nColumns;
+  if ((nSent > 0) && (nSent < nColumns)) {
+    nColumns = nSent;
+  }
+  for (int i = 0; i < _sma.nStates; i++) {
+    byte* Row = Matrix + i * nRowColumns;
+    if (!Sparse) {
+      for (int j = 0; j < nColumns; j++) {
+        if (output) {
+          output[index] = Row[j];
+        }
+        index++;
+      }
+      continue;
+    }
+    byte Default = SelfDefault ? i : 0;
+    int CountIndex = index++;
+    byte nPairs = 0;
+    for (int j = 0; j < nColumns; j++) {
+      if (Row[j] != Default) {
+        if (output) {
+          output[index] = j;
+          output[index + 1] = Row[j];
+        }
+        index += 2;
+        nPairs++;
+      }
+    }
+    if (output) {
+      output[CountIndex] = nPairs;
     }
-    return 0;
-  } else {
-    SerialUSB.println("Error: Sending Empty Matrix.");
-    return -1;
   }
+  return index;
 }
 
 int Apod::RunStateMatrix() {
-  // clear serial
-  while (ApodSerial->available()) {
-    ApodSerial->read(); // clear ApodSerial dirty data
+  if (BlockRunning) {
+    SerialUSB.println("Error: Cannot run a state matrix while a block runs.");
+    return -1;
   }
+  // clear serial
+  FlushBpod(); // clear ApodSerial dirty data
   // Sending indicator 'R'
   ApodSerial->write('R');
-  byte returnVal = SerialReadByte();
+  if (RecordStream) {
+    RecordHeader('R', 0);
+  }
+  byte returnVal = ReadReply();
+  ProfileMark(PhaseRun, 2);
   if (returnVal != 1) {
     SerialUSB.println("Error: Fail to run state matrix (retrunVal != 1)");
     return -1;
@@ -342,21 +526,51 @@ int Apod::RunStateMatrix() {
   return 0;
 }
 
+int Apod::SendAnalogMatrix() {
+  // Transitions for analog threshold events, sent after the matrix they belong to ('A' 'M' + rows as (column, value) pairs)
+  if (!FirmwareSupports(FeatureAnalogInput)) {
+    return -1;
+  }
+  byte output[_sma.nStates * 33 + 2];
+  output[0] = 'A';
+  output[1] = 'M';
+  int index = 2 + BuildMatrixRows(output + 2, &_sma.AnalogMatrix[0][0], 16, true, true);
+  ProfileMark(PhaseSerialize);
+  for (int i = 0; i < index; i++) {
+    ApodSerial->write(output[i]);
+  }
+  if (RecordStream) {
+    RecordHeader('A', index - 1);
+    RecordStream->write(output + 1, index - 1);
+  }
+  ProfileMark(PhaseTransmit, index);
+  byte returnVal = ReadReply();
+  ProfileMark(PhaseAck, 1);
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Sending analog transitions failed (invalid op code).");
+    return -1;
+  }
+  return 0;
+}
+
 int Apod::ReceiveBpodData() {
-  byte opCode = SerialReadByte();
-  trial_res = TrialResult(); // clear trial_res
+  if (TrialPending) { // Already read by ReadAnalogSamples
+    TrialPending = false;
+    ProfileMark(PhaseIdle);
+    ProfileEndCycle();
+    return 0;
+  }
+  byte opCode = ReadReply();
+  ProfileMark(PhaseTrial, 1);
   if (opCode == 1) {
-    trial_res.nEvents = SerialReadShort(); // read number of events in last trial
-    for (int i = 0; i < trial_res.nEvents; i++) {
-      trial_res.Events[i] = SerialReadByte();          // read event ID
-      trial_res.eventTimeStamps[i] = SerialReadLong(); // read event time stamp
-    }
-    trial_res.nTransition = SerialReadShort();         // read number of state transitions
-    for (int i = 0; i < trial_res.nTransition; i++) {
-      trial_res.state_visited[i] = SerialReadByte();    // read stated visited in last trial
-    }
+    ReadTrialData();
+    ProfileEndCycle();
     return 0;
   } else { // error reading Bpod data...
+    if (Profile) {
+      Profile->DropCycle();
+    }
+    trial_res = TrialResult(); // clear trial_res
     SerialUSB.println("Error: Receiving Bpod Data Error...");
     delay(1000);
     SerialReadAll(); // clear serial dirty data
@@ -366,7 +580,56 @@ int Apod::ReceiveBpodData() {
   }
 }
 
+int Apod::ReadTrialData() {
+  // Trial data following op code 1
+  trial_res = TrialResult(); // clear trial_res
+  trial_res.nEvents = SerialReadShort(); // read number of events in last trial
+  for (int i = 0; i < trial_res.nEvents; i++) {
+    trial_res.Events[i] = SerialReadByte();          // read event ID
+    trial_res.eventTimeStamps[i] = SerialReadLong(); // read event time stamp
+  }
+  trial_res.nTransition = SerialReadShort();         // read number of state transitions
+  for (int i = 0; i < trial_res.nTransition; i++) {
+    trial_res.state_visited[i] = SerialReadByte();    // read stated visited in last trial
+  }
+  if (bpod_caps.Features & FeatureEventMask) {
+    for (int i = 0; i < 7; i++) {
+      trial_res.DroppedEvents[i] = SerialReadShort();  // read masked event counts
+    }
+  }
+  if (bpod_caps.Features & FeatureEventQueue) {
+    trial_res.VirtualEventOverflows = SerialReadShort(); // read virtual events lost on the Bpod
+  }
+  if (bpod_caps.Features & FeatureEventForwarding) {
+    trial_res.ForwardOverflows = SerialReadShort(); // read forwarded events lost on the Bpod
+  }
+  if (RecordStream) { // same layout as the Bpod data, with every counter (0 when the firmware lacks the feature)
+    RecordHeader('T', 4 + trial_res.nEvents * 5 + trial_res.nTransition + 18);
+    RecordStream->write((byte)trial_res.nEvents);
+    RecordStream->write((byte)(trial_res.nEvents >> 8));
+    for (int i = 0; i < trial_res.nEvents; i++) {
+      RecordStream->write(trial_res.Events[i]);
+      RecordLong(trial_res.eventTimeStamps[i]);
+    }
+    RecordStream->write((byte)trial_res.nTransition);
+    RecordStream->write((byte)(trial_res.nTransition >> 8));
+    RecordStream->write(trial_res.state_visited, trial_res.nTransition);
+    for (int i = 0; i < 7; i++) {
+      RecordShort(trial_res.DroppedEvents[i]);
+    }
+    RecordShort(trial_res.VirtualEventOverflows);
+    RecordShort(trial_res.ForwardOverflows);
+  }
+  if (ExportStream) {
+    ExportTrial();
+  }
+  ProfileMark(PhaseReceive, 4 + trial_res.nEvents * 5 + trial_res.nTransition + ((bpod_caps.Features & FeatureEventMask) ? 14 : 0) +
+              ((bpod_caps.Features & FeatureEventQueue) ? 2 : 0) + ((bpod_caps.Features & FeatureEventForwarding) ? 2 : 0));
+  return 0;
+}
+
 void Apod::EmptyMatrix() {
+  ProfileMark(PhaseIdle);
   _sma = StateMatrix();
 }
 
@@ -382,6 +645,12 @@ void Apod::setWireInputsEnabled(byte* WireEnabled) {
 }
 
 void Apod::ManualOverride(byte Command1, byte Command2, byte Data) {
+  if (RecordStream) {
+    RecordHeader('O', 3);
+    RecordStream->write(Command1);
+    RecordStream->write(Command2);
+    RecordStream->write(Data);
+  }
   ApodSerial->write(Command1);
   /*
      'O':  // Override hardware state
@@ -399,6 +668,769 @@ void Apod::ManualOverride(byte Command1, byte Command2, byte Data) {
   ApodSerial->write(Data);
 }
 
+void Apod::StartRecording(Stream &s) {
+  // Append-only binary session log. File header: "APOD" + format version (1 byte).
+  // Each record: type (1 byte), payload length (4 bytes), micros() timestamp (4 bytes), payload.
+  //   'M': state matrix as sent to the Bpod ('P' or 'C' op code + payload)
+  //   'R': run command (no payload)
+  //   'T': trial result: nEvents (2 bytes), nEvents x (event code, 4-byte time stamp), nTransition (2 bytes), states visited,
+  //        events not recorded because of the event mask per class (7 x 2 bytes, EventClassNames), virtual event and
+  //        forwarded event overflows (2 bytes each). Version 1 recordings end after the states visited.
+  //   'O': manual override (Command1, Command2, Data)
+  //   'A': analog threshold transitions for the last matrix ('M' + rows as (column, value) pairs)
+  //   'P': trial cycle timing, while profiling (StartProfiling): per phase (ApodPhase order), microseconds (4 bytes)
+  //        then serial bytes (4 bytes)
+  //   'B': block mode matrix (AddBlockMatrix): trial type, then the matrix as for 'M'
+  //   'Q': sequence (UploadSequence): nSteps, nSteps x (4-byte tick, command, target, data)
+  //   'W': wave (SendWave): index (0-3), target code, repeats (2 bytes), even and odd sample hold times (4 bytes each),
+  //        nSamples (2 bytes), samples
+  // All integers are little-endian, as on the Bpod serial link.
+  RecordStream = &s;
+  RecordStream->write('A');
+  RecordStream->write('P');
+  RecordStream->write('O');
+  RecordStream->write('D');
+  RecordStream->write(2);
+}
+
+void Apod::StopRecording() {
+  if (RecordStream) {
+    RecordStream->flush();
+  }
+  RecordStream = 0;
+}
+
+int Apod::WriteStateMatrix(Stream &s) {
+  // Write the current state matrix exactly as SendStateMatrix would send it, e.g. to an SD file for
+  // the host tools in extras/ApodHost. Returns the number of bytes written.
+  byte stateNum = _sma.nStates;
+  if (stateNum == 0) {
+    SerialUSB.println("Error: Writing Empty Matrix.");
+    return -1;
+  }
+  byte output[stateNum * 73 + 66];
+  int index = BuildStateMatrix(output);
+  s.write(output, index);
+  return index;
+}
+
+void Apod::RecordHeader(byte Type, unsigned long Length) {
+  RecordStream->write(Type);
+  RecordLong(Length);
+  RecordLong(micros());
+}
+
+void Apod::RecordShort(uint16_t num) {
+  RecordStream->write((byte)num);
+  RecordStream->write((byte)(num >> 8));
+}
+
+void Apod::RecordLong(unsigned long num) {
+  RecordStream->write((byte)num);
+  RecordStream->write((byte)(num >> 8));
+  RecordStream->write((byte)(num >> 16));
+  RecordStream->write((byte)(num >> 24));
+}
+
+void Apod::StartExport(Stream &s, uint16_t TrialsPerChunk) {
+  // Columnar trial export for offline analysis (reader: extras/ApodHost/ApodExport.h). Every trial received with
+  // ReceiveBpodData is appended. File header: "APDX" + format version (1 byte). Then chunks of up to TrialsPerChunk trials:
+  //   'C', number of the first trial in the chunk (4 bytes, from 0)
+  //   per trial: 'T', nEvents (2 bytes), nTransition (2 bytes), size of the time stamp column (4 bytes),
+  //              event codes (nEvents bytes), time stamp deltas (LEB128 varints, 0.1 ms ticks, the first one from
+  //              trial start), states visited (nTransition bytes)
+  //   footer: 'F', offset of each trial from the 'C' byte (4 bytes each), number of trials (2 bytes),
+  //           chunk length from 'C' to the end of the footer (4 bytes), "APDF"
+  // All integers are little-endian. The footer lets a reader walk the chunks back from the end of the file.
+  StopExport();
+  ExportStream = &s;
+  ExportChunkTrials = constrain(TrialsPerChunk, 1, MaxExportChunkTrials);
+  ExportTrialsInChunk = 0;
+  ExportTrialCount = 0;
+  ExportStream->write('A');
+  ExportStream->write('P');
+  ExportStream->write('D');
+  ExportStream->write('X');
+  ExportStream->write(1);
+}
+
+void Apod::StopExport() {
+  // Close the open chunk so the file ends with a footer.
+  if (ExportStream) {
+    ExportCloseChunk();
+    ExportStream->flush();
+  }
+  ExportStream = 0;
+}
+
+void Apod::ExportTrial() {
+  if (ExportTrialsInChunk == 0) {
+    ExportChunkBytes = 0;
+    ExportWrite('C');
+    ExportLong(ExportTrialCount);
+  }
+  ExportOffsets[ExportTrialsInChunk++] = ExportChunkBytes;
+  ExportTrialCount++;
+
+  unsigned long DeltaBytes = 0;
+  unsigned long LastTime = 0;
+  for (int i = 0; i < trial_res.nEvents; i++) {
+    DeltaBytes += VarLongBytes(trial_res.eventTimeStamps[i] - LastTime);
+    LastTime = trial_res.eventTimeStamps[i];
+  }
+  ExportWrite('T');
+  ExportShort(trial_res.nEvents);
+  ExportShort(trial_res.nTransition);
+  ExportLong(DeltaBytes);
+  ExportStream->write(trial_res.Events, trial_res.nEvents);
+  ExportChunkBytes += trial_res.nEvents;
+  LastTime = 0;
+  for (int i = 0; i < trial_res.nEvents; i++) {
+    ExportVarLong(trial_res.eventTimeStamps[i] - LastTime);
+    LastTime = trial_res.eventTimeStamps[i];
+  }
+  ExportStream->write(trial_res.state_visited, trial_res.nTransition);
+  ExportChunkBytes += trial_res.nTransition;
+
+  if (ExportTrialsInChunk >= ExportChunkTrials) {
+    ExportCloseChunk();
+  }
+}
+
+void Apod::ExportCloseChunk() {
+  if (ExportTrialsInChunk == 0) {
+    return;
+  }
+  ExportWrite('F');
+  for (int i = 0; i < ExportTrialsInChunk; i++) {
+    ExportLong(ExportOffsets[i]);
+  }
+  ExportShort(ExportTrialsInChunk);
+  ExportLong(ExportChunkBytes + 8); // Length field and magic included
+  ExportStream->write('A');
+  ExportStream->write('P');
+  ExportStream->write('D');
+  ExportStream->write('F');
+  ExportTrialsInChunk = 0;
+}
+
+void Apod::ExportWrite(byte b) {
+  ExportStream->write(b);
+  ExportChunkBytes++;
+}
+
+void Apod::ExportShort(uint16_t num) {
+  ExportWrite((byte)num);
+  ExportWrite((byte)(num >> 8));
+}
+
+void Apod::ExportLong(unsigned long num) {
+  ExportWrite((byte)num);
+  ExportWrite((byte)(num >> 8));
+  ExportWrite((byte)(num >> 16));
+  ExportWrite((byte)(num >> 24));
+}
+
+void Apod::ExportVarLong(unsigned long num) {
+  // LEB128: 7 bits per byte, high bit set on all but the last byte
+  while (num >= 0x80) {
+    ExportWrite((byte)(num | 0x80));
+    num >>= 7;
+  }
+  ExportWrite((byte)num);
+}
+
+byte Apod::VarLongBytes(unsigned long num) {
+  byte n = 1;
+  while (num >= 0x80) {
+    num >>= 7;
+    n++;
+  }
+  return n;
+}
+
+int Apod::ClearBlock() {
+  // Remove all block matrices and scheduled trials from the Bpod.
+  if (!FirmwareSupports(FeatureBlocks)) {
+    return -1;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('B');
+  ApodSerial->write('C');
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Clearing block failed (invalid op code).");
+    return -1;
+  }
+  return 0;
+}
+
+int Apod::AddBlockMatrix(byte TrialType) {
+  // Store the current state matrix on the Bpod as the matrix for TrialType (0-7), replacing any earlier one.
+  // Call before StartBlock.
+  byte stateNum = _sma.nStates;
+  if (stateNum == 0 || TrialType >= MaxBlockTrialTypes) {
+    SerialUSB.println("Error: Invalid block matrix.");
+    return -1;
+  }
+  if (!FirmwareSupports(FeatureBlocks)) {
+    return -1;
+  }
+  if (_sma.AnalogUsed) {
+    SerialUSB.println("Error: Analog threshold transitions are not available in block mode.");
+    return -1;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  byte output[stateNum * 73 + 66];
+  int index = BuildStateMatrix(output);
+  ApodSerial->write('B');
+  ApodSerial->write('M');
+  ApodSerial->write(TrialType);
+  SerialWriteShort(index);
+  for (int i = 0; i < index; i++) {
+    ApodSerial->write(output[i]);
+  }
+  if (RecordStream) {
+    RecordHeader('B', 1 + index);
+    RecordStream->write(TrialType);
+    RecordStream->write(output, index);
+  }
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Storing block matrix failed (Bpod matrix memory full?).");
+    return -1;
+  }
+  return 0;
+}
+
+int Apod::AppendBlockTrials(byte* TrialTypes, uint16_t nTrials) {
+  // Append trials to the block schedule; may be called while the block runs. The Bpod appends all of them, or none
+  // if a type has no matrix (AddBlockMatrix) or the schedule is full. While the block runs the answer comes with
+  // the trial summaries: ReceiveBlockSummary reports a rejection.
+  for (int i = 0; i < nTrials; i++) {
+    if (TrialTypes[i] >= MaxBlockTrialTypes) {
+      SerialUSB.println("Error: Invalid block trial type.");
+      return -1;
+    }
+  }
+  ApodSerial->write('B');
+  ApodSerial->write('T');
+  SerialWriteShort(nTrials);
+  for (int i = 0; i < nTrials; i++) {
+    ApodSerial->write(TrialTypes[i]);
+  }
+  return BlockRunning ? 0 : ReadScheduleReply();
+}
+
+int Apod::AppendRandomBlockTrials(unsigned long Seed, uint16_t nTrials, byte nTypes, byte MaxRepeat) {
+  // Append nTrials pseudo-random trial types (0 to nTypes - 1), generated on the Bpod from Seed.
+  // MaxRepeat: Maximum number of consecutive trials of the same type (0 = no limit).
+  // Every type needs a matrix; rejected as AppendBlockTrials.
+  if (nTypes < 1 || nTypes > MaxBlockTrialTypes) {
+    SerialUSB.println("Error: Invalid number of block trial types.");
+    return -1;
+  }
+  ApodSerial->write('B');
+  ApodSerial->write('N');
+  SerialWriteLong(Seed);
+  SerialWriteShort(nTrials);
+  ApodSerial->write(nTypes);
+  ApodSerial->write(MaxRepeat);
+  return BlockRunning ? 0 : ReadScheduleReply();
+}
+
+int Apod::ReadScheduleReply() {
+  // Op code 6, then 1 if the trials were appended to the block schedule
+  byte opCode = ReadReply();
+  if (opCode != 6) {
+    SerialUSB.println("Error: Appending block trials failed (invalid op code).");
+    return -1;
+  }
+  if (SerialReadByte() != 1) {
+    SerialUSB.println("Error: Block trials rejected (trial type without a matrix, or schedule full).");
+    return -1;
+  }
+  return 0;
+}
+
+void Apod::StartBlock(float ITI) {
+  // Run the scheduled trials back-to-back, ITI seconds apart. Results arrive through ReceiveBlockSummary.
+  ApodSerial->write('B');
+  ApodSerial->write('G');
+  SerialWriteLong(ITI * TimerScaleFactor);
+  BlockRunning = true;
+}
+
+void Apod::AbortBlock() {
+  // Stop the running trial (if any) and end the block; the Bpod still sends the trial summary and block end.
+  ApodSerial->write('B');
+  ApodSerial->write('A');
+}
+
+int Apod::ReceiveBlockSummary() {
+  // Returns 0 when a trial summary was stored in block_res, 1 when the block ended, -1 on error.
+  byte opCode = ReadReply();
+  while (opCode == 6) { // Answer to trials appended during the block
+    if (SerialReadByte() != 1) {
+      SerialUSB.println("Error: Block trials rejected (trial type without a matrix, or schedule full).");
+    }
+    opCode = ReadReply();
+  }
+  if (opCode == 3) {
+    block_res.TrialNumber = SerialReadShort();
+    block_res.TrialType = SerialReadByte();
+    block_res.nEvents = SerialReadShort();
+    block_res.nTransition = SerialReadShort();
+    block_res.FinalState = SerialReadByte();
+    block_res.Duration = SerialReadLong();
+    return 0;
+  } else if (opCode == 4) {
+    block_res.TrialNumber = SerialReadShort(); // number of trials run
+    BlockRunning = false;
+    return 1;
+  } else {
+    SerialUSB.println("Error: Receiving Block Summary Error...");
+    delay(1000);
+    SerialReadAll(); // clear serial dirty data
+    return -1;
+  }
+}
+
+int Apod::UploadSequence(SequenceStep* Steps, byte nSteps) {
+  // Upload a timed sequence of virtual events / output overrides; replayed by the Bpod timer handler.
+  // Upload between trials: the Bpod acknowledges with one byte.
+  if (nSteps > MaxSequenceSteps) {
+    SerialUSB.println("Error: Too many sequence steps.");
+    return -1;
+  }
+  for (int i = 0; i < nSteps; i++) {
+    // The Bpod stops at the first step not yet due, and indexes its input lines with Data
+    if ((i > 0) && (Steps[i].Tick < Steps[i - 1].Tick)) {
+      SerialUSB.println("Error: Sequence steps are not in tick order.");
+      return -1;
+    }
+    bool Valid = false;
+    if (Steps[i].Command == 'V') {
+      switch (Steps[i].Target) {
+        case 'P': Valid = (Steps[i].Data < 8); break;
+        case 'B': Valid = (Steps[i].Data < 2); break;
+        case 'W': Valid = (Steps[i].Data < 4); break;
+        case 'S': Valid = (Steps[i].Data >= 1) && (Steps[i].Data <= 10); break;
+      }
+    } else if (Steps[i].Command == 'O') {
+      Valid = (Steps[i].Target == 'V') || (Steps[i].Target == 'B') || (Steps[i].Target == 'W') || (Steps[i].Target == 'T');
+    }
+    if (!Valid) {
+      SerialUSB.println("Error: Invalid sequence step (unknown command/target or line out of range).");
+      return -1;
+    }
+  }
+  if (!FirmwareSupports(FeatureSequences)) {
+    return -1;
+  }
+  // clear serial
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('Q');
+  ApodSerial->write('L');
+  ApodSerial->write(nSteps);
+  for (int i = 0; i < nSteps; i++) {
+    SerialWriteLong(Steps[i].Tick);
+    ApodSerial->write(Steps[i].Command);
+    ApodSerial->write(Steps[i].Target);
+    ApodSerial->write(Steps[i].Data);
+  }
+  if (RecordStream) {
+    RecordHeader('Q', 1 + 7 * nSteps);
+    RecordStream->write(nSteps);
+    for (int i = 0; i < nSteps; i++) {
+      RecordLong(Steps[i].Tick);
+      RecordStream->write(Steps[i].Command);
+      RecordStream->write(Steps[i].Target);
+      RecordStream->write(Steps[i].Data);
+    }
+  }
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Uploading sequence failed (invalid op code).");
+    return -1;
+  }
+  return 0;
+}
+
+void Apod::StartSequence() {
+  // Step offsets count from now if a trial is running, otherwise from the start of the next trial.
+  ApodSerial->write('Q');
+  ApodSerial->write('G');
+}
+
+void Apod::CancelSequence() {
+  ApodSerial->write('Q');
+  ApodSerial->write('C');
+}
+
+int Apod::LoadWaveform(byte WaveNumber, String Target, byte* Samples, uint16_t nSamples, float SamplePeriod, uint16_t Repeats) {
+  // WaveNumber: The number of the wave (an integer, 1-4); triggered with the "WaveTrig" output action.
+  // Target: The output driven by the wave (see WaveTargetNames). BNC lines are high for non-zero samples.
+  // Samples: PWM duty cycles (0-255), each held for SamplePeriod seconds.
+  // Repeats: Number of passes through the table (0 = until cancelled with "WaveCancel" or the trial ends).
+  // When a finite wave ends, its output returns to the level the current state sets. Load waves between trials.
+  if (SamplePeriod * TimerScaleFactor < 1) {
+    SerialUSB.println("Error: Wave sample period shorter than one Bpod cycle.");
+    return -1;
+  }
+  unsigned long HoldTime = SamplePeriod * TimerScaleFactor;
+  return SendWave(WaveNumber, Target, Samples, nSamples, HoldTime, HoldTime, Repeats);
+}
+
+int Apod::LoadPulseTrain(byte WaveNumber, String Target, byte Value, float PulseWidth, float PulseInterval, uint16_t nPulses) {
+  // Value: PWM duty cycle (0-255) of each pulse.
+  // PulseWidth: Duration of each pulse; PulseInterval: Onset-to-onset interval (seconds).
+  // nPulses: Number of pulses (0 = until cancelled with "WaveCancel" or the trial ends).
+  unsigned long HighTime = PulseWidth * TimerScaleFactor;
+  unsigned long Period = PulseInterval * TimerScaleFactor;
+  if (HighTime < 1 || Period <= HighTime) {
+    SerialUSB.println("Error: Invalid pulse train timing.");
+    return -1;
+  }
+  byte Samples[2] = {Value, 0};
+  return SendWave(WaveNumber, Target, Samples, 2, HighTime, Period - HighTime, nPulses);
+}
+
+int Apod::SendWave(byte WaveNumber, String Target, byte* Samples, uint16_t nSamples, unsigned long EvenHoldTime, unsigned long OddHoldTime, uint16_t Repeats) {
+  int TargetCode = find_idx(WaveTargetNames, 10, Target);
+  if (WaveNumber < 1 || WaveNumber > MaxWaves || TargetCode < 0 || nSamples < 1 || nSamples > MaxWaveSamples) {
+    SerialUSB.println("Error: Invalid wave.");
+    return -1;
+  }
+  if (!FirmwareSupports(FeatureWaves)) {
+    return -1;
+  }
+  // clear serial
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('W');
+  ApodSerial->write('L');
+  ApodSerial->write(WaveNumber - 1);
+  ApodSerial->write(TargetCode + 1);
+  SerialWriteShort(Repeats);
+  SerialWriteLong(EvenHoldTime);
+  SerialWriteLong(OddHoldTime);
+  SerialWriteShort(nSamples);
+  for (int i = 0; i < nSamples; i++) {
+    ApodSerial->write(Samples[i]);
+  }
+  if (RecordStream) {
+    RecordHeader('W', 14 + nSamples);
+    RecordStream->write(WaveNumber - 1);
+    RecordStream->write(TargetCode + 1);
+    RecordStream->write((byte)Repeats);
+    RecordStream->write((byte)(Repeats >> 8));
+    RecordLong(EvenHoldTime);
+    RecordLong(OddHoldTime);
+    RecordStream->write((byte)nSamples);
+    RecordStream->write((byte)(nSamples >> 8));
+    RecordStream->write(Samples, nSamples);
+  }
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Loading wave failed (rejected by Bpod, or trial running).");
+    return -1;
+  }
+  return 0;
+}
+
+int Apod::ClearWaves() {
+  if (!FirmwareSupports(FeatureWaves)) {
+    return -1;
+  }
+  // clear serial
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('W');
+  ApodSerial->write('C');
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Clearing waves failed (trial running?).");
+    return -1;
+  }
+  return 0;
+}
+
+unsigned long Apod::GetWaveEngineCost() {
+  // Longest per-cycle wave engine update on the Bpod since the last call, in CPU cycles (84 cycles = 1 us).
+  if (!FirmwareSupports(FeatureWaves)) {
+    return 0;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('W');
+  ApodSerial->write('M');
+  if (ReadReply() != 'M') {
+    SerialUSB.println("Error: Reading the wave engine cost failed (invalid op code).");
+    return 0;
+  }
+  return SerialReadLong();
+}
+
+unsigned long Apod::GetTransitionLatency(unsigned long* StateEntries, unsigned long* OutputWrites) {
+  // Longest state transition on the Bpod since the last call, from timer handler entry to the
+  // last output written, in CPU cycles (84 cycles = 1 us). Optionally also returns the state entries
+  // and the outputs written on them (valves, each BNC/wire line, PWM channel and serial module write).
+  if (!FirmwareSupports(FeatureTransitionLatency)) {
+    return 0;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('L');
+  ApodSerial->write('R');
+  if (ReadReply() != 'L') {
+    SerialUSB.println("Error: Reading the transition latency failed (invalid op code).");
+    return 0;
+  }
+  unsigned long Cycles = SerialReadLong();
+  unsigned long Entries = SerialReadLong();
+  unsigned long Writes = SerialReadLong();
+  if (StateEntries) {
+    *StateEntries = Entries;
+  }
+  if (OutputWrites) {
+    *OutputWrites = Writes;
+  }
+  return Cycles;
+}
+
+int Apod::SetFullOutputWrites(boolean Full) {
+  // Have the Bpod rewrite every output on each state entry, as before output plans (true), or only
+  // the changed ones (false, default), to compare both with GetTransitionLatency. Call between trials.
+  if (!FirmwareSupports(FeatureTransitionLatency)) {
+    return -1;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('L');
+  ApodSerial->write('F');
+  ApodSerial->write(Full ? 1 : 0);
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Output write mode not changed (trial running?).");
+    return -1;
+  }
+  return 0;
+}
+
+int Apod::StartAnalogInput(byte Channels, float SamplePeriod) {
+  // Sample the port analog lines in Channels (bit 0 = line 1) while trials run. Each stored sample is the mean
+  // of the 0.1 ms readings over SamplePeriod (seconds); read them with ReadAnalogSamples. Call between trials.
+  // Stored samples of a previous configuration are dropped.
+  unsigned long Period = SamplePeriod * TimerScaleFactor + 0.5;
+  if (Period < 1 || Period > 65535) {
+    SerialUSB.println("Error: Invalid analog sample period.");
+    return -1;
+  }
+  return SendAnalogCommand('C', Channels, 0, Period, 0);
+}
+
+int Apod::StopAnalogInput() {
+  return SendAnalogCommand('C', 0, 0, 1, 0);
+}
+
+int Apod::SetAnalogThreshold(byte Channel, uint16_t High, uint16_t Low) {
+  // Channel (1-8) gives event AnalogNHigh when its reading rises to High, and AnalogNLow when it falls
+  // back to Low (12-bit ADC units, Low < High). The line must be sampled (StartAnalogInput). Call between trials.
+  if (Channel < 1 || Channel > 8 || Low >= High) {
+    SerialUSB.println("Error: Invalid analog threshold.");
+    return -1;
+  }
+  return SendAnalogCommand('T', Channel - 1, 1, High, Low);
+}
+
+int Apod::ClearAnalogThreshold(byte Channel) {
+  if (Channel < 1 || Channel > 8) {
+    SerialUSB.println("Error: Invalid analog channel.");
+    return -1;
+  }
+  return SendAnalogCommand('T', Channel - 1, 0, 0, 0);
+}
+
+int Apod::SendAnalogCommand(byte Command, byte Data1, byte Data2, uint16_t Value1, uint16_t Value2) {
+  if (!FirmwareSupports(FeatureAnalogInput)) {
+    return -1;
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('A');
+  ApodSerial->write(Command);
+  ApodSerial->write(Data1);
+  if (Command == 'T') {
+    ApodSerial->write(Data2);
+    SerialWriteShort(Value1);
+    SerialWriteShort(Value2);
+  } else {
+    SerialWriteShort(Value1);
+  }
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Analog input command failed (trial running?).");
+    return -1;
+  }
+  if (Command == 'C') {
+    AnalogFramesLost = 0;
+  }
+  return 0;
+}
+
+int Apod::ReadAnalogSamples(uint16_t* Samples, uint16_t MaxSamples) {
+  // Move up to MaxSamples stored samples from the Bpod into Samples, in frames of one sample per sampled line
+  // (lowest line first). A frame of AnalogTrialStart values marks the start of each trial; the k-th frame after
+  // it covers trial time (k - 1) * SamplePeriod to k * SamplePeriod. Returns the number of samples, or -1.
+  // Safe while a trial runs: a trial that ends meanwhile is kept for the next ReceiveBpodData. Not in block mode, where
+  // the reply could be a block summary: read the samples after ReceiveBlockSummary has returned the block end.
+  if (!FirmwareSupports(FeatureAnalogInput)) {
+    return -1;
+  }
+  if (BlockRunning) {
+    SerialUSB.println("Error: Cannot read analog samples while a block runs.");
+    return -1;
+  }
+  ApodSerial->write('A');
+  ApodSerial->write('R');
+  SerialWriteShort(MaxSamples);
+  byte Reply = ReadReply();
+  if ((Reply == 1) && !TrialPending) { // The trial ended before the Bpod read the request: its data comes first
+    ProfileMark(PhaseTrial, 1);
+    ReadTrialData();
+    TrialPending = true;
+    Reply = ReadReply();
+  }
+  if (Reply != 'A') {
+    SerialUSB.println("Error: Reading analog samples failed (invalid op code).");
+    return -1;
+  }
+  uint16_t nSamples = SerialReadShort();
+  AnalogFramesLost = SerialReadShort();
+  for (int i = 0; i < nSamples; i++) {
+    Samples[i] = SerialReadShort();
+  }
+  return nSamples;
+}
+
+int Apod::SetEventHandler(String EventName, ApodEventHandler Handler) {
+  // Have the Bpod send EventName the cycle it happens (op code 5 + event code, about 0.2 ms at 115200 baud), and call
+  // Handler(apod, code) for it from PollBpod. Handler = 0 stops forwarding. Handlers can answer with ManualOverride('V', ...)
+  // but must not wait for the Bpod. The event is still recorded as usual. Call between trials.
+  int i = find_idx(EventNames, 66, EventName);
+  if (i < 0) {
+    SerialUSB.println("Error: Unknown event name.");
+    return -1;
+  }
+  if (!FirmwareSupports(FeatureEventForwarding)) {
+    return -1;
+  }
+  EventHandlers[i] = Handler;
+  if (Handler) {
+    ForwardMask[i / 8] |= (1 << (i % 8));
+  } else {
+    ForwardMask[i / 8] &= ~(1 << (i % 8));
+  }
+  FlushBpod(); // clear ApodSerial dirty data
+  ApodSerial->write('E');
+  ApodSerial->write(ForwardMask, 9);
+  byte returnVal = ReadReply();
+  if (returnVal != 1) {
+    SerialUSB.println("Error: Setting event forwarding failed (invalid op code).");
+    return -1;
+  }
+  return 0;
+}
+
+void Apod::SetSoftCodeHandler(ApodEventHandler Handler) {
+  // Call Handler(apod, code) from PollBpod for every soft code a state sends (output action "SoftCode").
+  // Without a handler, soft codes are read and dropped.
+  SoftCodeHandler = Handler;
+}
+
+int Apod::PollBpod() {
+  // Dispatch the soft codes (op code 2) and forwarded events (op code 5) that have arrived, without waiting.
+  // Anything else (trial data, replies) is left unread. Also done by DataReceived, ReceiveBpodData and
+  // ReceiveBlockSummary. Returns the number of messages dispatched.
+  int nDispatched = 0;
+  while (ApodSerial->available() >= 2) {
+    int OpCode = ApodSerial->peek();
+    if ((OpCode != 2) && (OpCode != 5)) {
+      break;
+    }
+    ApodSerial->read();
+    Dispatch(OpCode, ApodSerial->read());
+    nDispatched++;
+  }
+  return nDispatched;
+}
+
+void Apod::FlushBpod() {
+  // Drop stale bytes before a command, dispatching the soft codes and forwarded events among them. The Bpod
+  // writes each as one pair, so the second byte is at most a few bytes' time behind.
+  while (ApodSerial->available()) {
+    int OpCode = ApodSerial->read();
+    if ((OpCode == 2) || (OpCode == 5)) {
+      int Code = SerialReadByteTimeout(5);
+      if (Code >= 0) {
+        Dispatch(OpCode, Code);
+      }
+    }
+  }
+}
+
+byte Apod::ReadReply() {
+  // Next op code from the Bpod, dispatching soft codes and forwarded events that come before it
+  byte OpCode = SerialReadByte();
+  while ((OpCode == 2) || (OpCode == 5)) {
+    Dispatch(OpCode, SerialReadByte());
+    OpCode = SerialReadByte();
+  }
+  return OpCode;
+}
+
+void Apod::Dispatch(byte OpCode, byte Code) {
+  if (OpCode == 2) {
+    if (SoftCodeHandler) {
+      SoftCodeHandler(*this, Code);
+    }
+  } else if ((Code < 66) && EventHandlers[Code]) {
+    EventHandlers[Code](*this, Code);
+  }
+}
+
+void Apod::StartProfiling(ApodProfile &p) {
+  // Time the phases of every trial cycle (ApodProfile.h) into p, which is cleared. A cycle ends when its trial
+  // data has been received; cycles whose trial data could not be read are dropped. Phases are split at the
+  // calls to EmptyMatrix, SendStateMatrix, RunStateMatrix and ReceiveBpodData, so a loop that does not call
+  // EmptyMatrix counts its inter-trial code as Build. While recording, each cycle is also written as a 'P' record.
+  Profile = &p;
+  Profile->Clear(micros());
+}
+
+void Apod::StopProfiling() {
+  Profile = 0;
+}
+
+void Apod::PrintProfile(Stream &s, const ApodProfile &p) {
+  // One line per phase: trials, min / mean / max us, mean serial bytes, then the non-empty log2 histogram
+  // bins as bin:count (bin k: 2^k to 2^(k+1) us). extras/ApodHost/apod_profile prints the same from a recording.
+  char Line[320];
+  for (int Row = -1; Row < ApodProfileRows; Row++) {
+    p.FormatLine(Row, Line, sizeof(Line));
+    s.println(Line);
+  }
+}
+
+void Apod::ProfileEndCycle() {
+  if (!Profile) {
+    return;
+  }
+  if (RecordStream) {
+    RecordHeader('P', ApodPhases * 8);
+    for (int i = 0; i < ApodPhases; i++) {
+      RecordLong(Profile->Micros[i]);
+      RecordLong(Profile->Bytes[i]);
+    }
+  }
+  Profile->EndCycle();
+}
+
 int Apod::find_idx(const String * str_array, int array_length, String target) {
   for (int i = 0; i < array_length; i++) {
     if (target.compareTo(str_array[i]) == 0) {
@@ -435,7 +1467,33 @@ unsigned long Apod::SerialReadLong() {
   return LongInt;
 }
 unsigned int Apod::DataReceived() {
-  return ApodSerial->available();
+  // Non-zero when trial data (or a block summary) is waiting. Soft codes and forwarded events are dispatched first.
+  PollBpod();
+  int Next = ApodSerial->peek();
+  if ((Next == 2) || (Next == 5)) { // Rest of the message not arrived yet
+    return TrialPending;
+  }
+  return ApodSerial->available() + TrialPending;
+}
+void Apod::SerialWriteShort(uint16_t num) {
+  ApodSerial->write((byte)num);
+  ApodSerial->write((byte)(num >> 8));
+}
+void Apod::SerialWriteLong(unsigned long num) {
+  ApodSerial->write((byte)num);
+  ApodSerial->write((byte)(num >> 8));
+  ApodSerial->write((byte)(num >> 16));
+  ApodSerial->write((byte)(num >> 24));
+}
+int Apod::SerialReadByteTimeout(unsigned long Timeout) {
+  // Returns the next byte, or -1 if none arrives within Timeout ms
+  unsigned long StartTime = millis();
+  while (ApodSerial->available() == 0) {
+    if (millis() - StartTime >= Timeout) {
+      return -1;
+    }
+  }
+  return ApodSerial->read();
 }
 void Apod::SerialReadAll() {
   while (ApodSerial->available()) {
@@ -464,7 +1522,7 @@ void Apod::PrintMatrix() {
   }
   SerialUSB.println("OutputMatrix: ");
   for (int i = 0; i < _sma.nStates; i++) {
-    for (int j = 0; j < 17; j++) {
+    for (int j = 0; j < 19; j++) {
       SerialUSB.print(_sma.OutputMatrix[i][j]);
     }
     SerialUSB.println();
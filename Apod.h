@@ -10,9 +10,10 @@
 
 #include "Arduino.h"
 #include "String.h"
+#include "ApodProfile.h"
 
 // Constant variables
-const PROGMEM String EventNames[50] = { // Event codes list.
+const PROGMEM String EventNames[66] = { // Event codes list.
   "Port1In", "Port1Out", "Port2In", "Port2Out", "Port3In", "Port3Out", "Port4In", "Port4Out", "Port5In", "Port5Out", "Port6In", "Port6Out", "Port7In", "Port7Out", "Port8In", "Port8Out",
   "BNC1High", "BNC1Low", "BNC2High", "BNC2Low",
   "Wire1High", "Wire1Low", "Wire2High", "Wire2Low", "Wire3High", "Wire3Low", "Wire4High", "Wire4Low",
@@ -20,15 +21,40 @@ const PROGMEM String EventNames[50] = { // Event codes list.
   "UnUsed",
   "Tup",
   "GlobalTimer1_End", "GlobalTimer2_End", "GlobalTimer3_End", "GlobalTimer4_End", "GlobalTimer5_End",
-  "GlobalCounter1_End", "GlobalCounter2_End", "GlobalCounter3_End", "GlobalCounter4_End", "GlobalCounter5_End"
+  "GlobalCounter1_End", "GlobalCounter2_End", "GlobalCounter3_End", "GlobalCounter4_End", "GlobalCounter5_End",
+  "Analog1High", "Analog1Low", "Analog2High", "Analog2Low", "Analog3High", "Analog3Low", "Analog4High", "Analog4Low",
+  "Analog5High", "Analog5Low", "Analog6High", "Analog6Low", "Analog7High", "Analog7Low", "Analog8High", "Analog8Low"
 };
-const PROGMEM String OutputActionNames[17] = { // Output action name list.
+const PROGMEM String OutputActionNames[19] = { // Output action name list.
   "ValveState", "BNCState", "WireState",
   "Serial1Code", "SerialUSBCode", "SoftCode", "GlobalTimerTrig", "GlobalTimerCancel", "GlobalCounterReset",
-  "PWM1", "PWM2", "PWM3", "PWM4", "PWM5", "PWM6", "PWM7", "PWM8"
+  "PWM1", "PWM2", "PWM3", "PWM4", "PWM5", "PWM6", "PWM7", "PWM8",
+  "WaveTrig", "WaveCancel"
 };
+const PROGMEM String WaveTargetNames[10] = { // Outputs a scheduled wave can drive.
+  "PWM1", "PWM2", "PWM3", "PWM4", "PWM5", "PWM6", "PWM7", "PWM8", "BNC1", "BNC2"
+};
+const PROGMEM String EventClassNames[7] = { // Event classes for SetEventRecording and TrialResult.DroppedEvents.
+  "Port", "BNC", "Wire", "SoftCode", "Tup", "GlobalTimer", "GlobalCounter"
+};
+const PROGMEM byte EventClassStart[8] = {0, 16, 20, 28, 39, 40, 45, 50}; // First event code of each class (and end of the last)
 const PROGMEM String MetaActions[4] = {"Placeholder", "Valve", "LED", "LEDState"}; // Meta action name list.
 const PROGMEM int TimerScaleFactor = 10000; // Bpod: 0.1 ms resolution
+const PROGMEM int MaxSequenceSteps = 128; // Maximum number of steps in a scripted virtual event sequence
+const PROGMEM int MaxWaves = 4; // Maximum number of scheduled waves
+const PROGMEM int MaxWaveSamples = 256; // Maximum number of samples per wave
+const PROGMEM int MaxBlockTrialTypes = 8; // Maximum number of matrices stored for block mode
+const PROGMEM int MaxExportChunkTrials = 64; // Maximum number of trials per columnar export chunk
+const PROGMEM unsigned long FeatureSequences = 1;    // Optional firmware features (BpodCapabilities.Features bits)
+const PROGMEM unsigned long FeatureWaves = 2;
+const PROGMEM unsigned long FeatureBlocks = 4;
+const PROGMEM unsigned long FeatureSparseMatrix = 8;
+const PROGMEM unsigned long FeatureEventMask = 16;
+const PROGMEM unsigned long FeatureEventQueue = 32;
+const PROGMEM unsigned long FeatureTransitionLatency = 64;
+const PROGMEM unsigned long FeatureAnalogInput = 128;
+const PROGMEM unsigned long FeatureEventForwarding = 256;
+const PROGMEM uint16_t AnalogTrialStart = 0xFFFF; // Value of every sample in the frame the Bpod stores when a trial starts (ReadAnalogSamples)
 
 // important structures
 struct OutputAction {
@@ -53,7 +79,7 @@ struct StateMatrix {
   // String Manifest = {}; // State names in the order they were added by user
   String StateNames[128]                   = {"Placeholder"}; //State names in the order they were added
   byte InputMatrix[128][40]                = {};
-  byte OutputMatrix[128][17]               = {};
+  byte OutputMatrix[128][19]               = {};
   byte GlobalTimerMatrix[128][5]           = {};
   float GlobalTimers[5]                    = {};
   byte GlobalTimerSet[5]                   = {0, 0, 0, 0, 0}; //Changed to 1 when the timer is given a duration with SetGlobalTimer
@@ -63,6 +89,45 @@ struct StateMatrix {
   byte GlobalCounterSet[5]                 = {0, 0, 0, 0, 0}; //Changed to 1 when the counter event is identified and given a threshold with SetGlobalCounter
   float StateTimers[128]                   = {};
   byte StatesDefined[128]                  = {};              //Referenced states are set to 0. Defined states are set to 1. Both occur with AddState
+  byte EventMask[7]                        = {};              //Events not recorded by the Bpod (bit per event code). Set with SetEventRecording
+  byte AnalogMatrix[128][16]               = {};              //State transitions for analog threshold events (Analog1High ... Analog8Low)
+  byte AnalogUsed                          = 0;               //Changed to 1 when a state changes on an analog threshold event
+};
+struct SequenceStep {
+  unsigned long Tick; // Offset from sequence start, in Bpod timer ticks (0.1 ms)
+  byte Command;       // 'V': virtual event; 'O': output override
+  byte Target;        // 'P', 'B', 'W', 'S' for 'V'; 'V', 'B', 'W', 'T' for 'O' (see ManualOverride)
+  byte Data;
+};
+struct BlockTrialSummary {
+  uint16_t TrialNumber;  // 1 = first trial of the block
+  byte TrialType;
+  uint16_t nEvents;
+  uint16_t nTransition;
+  byte FinalState;       // Last state before exit
+  unsigned long Duration; // in Bpod timer ticks (0.1 ms)
+};
+struct BpodCapabilities { // Read from the firmware by HandShakeBpod; the defaults match Bpod_Firmware_0_5_modified
+                           // and hold until then (e.g. for WriteStateMatrix without a Bpod)
+  byte Known = 0;                    // 1 if the firmware sent a capabilities record ('K')
+  byte FirmwareBuild = 0;
+  unsigned long Features = FeatureSequences | FeatureWaves | FeatureBlocks | FeatureSparseMatrix | FeatureEventMask | FeatureEventQueue | FeatureTransitionLatency | FeatureAnalogInput | FeatureEventForwarding; // Set to 0 by HandShakeBpod for firmware without 'K'
+  byte MaxStates = 128;
+  byte nGlobalTimers = 5;
+  byte nGlobalCounters = 5;
+  byte nOutputColumns = 19;          // 17 (no wave columns) for firmware without 'K'
+  uint16_t TickPeriod = 100;         // Timer period in us
+  uint16_t MaxEvents = 10000;        // Events stored per trial
+  uint16_t MaxTransitions = 1024;    // States stored per trial
+  byte MaxSequenceSteps = 128;
+  byte MaxWaves = 4;
+  uint16_t MaxWaveSamples = 256;
+  uint16_t BlockMatrixPoolSize = 9410; // Bytes for block mode matrix images (one dense 128-state image)
+  uint16_t BlockScheduleSize = 1024;   // Trial types held in the block schedule
+  byte VirtualEventQueueSize = 64;     // Virtual events (ManualOverride 'V') waiting to be applied
+  byte VirtualEventBudget = 4;         // Virtual events applied per timer cycle
+  uint16_t AnalogRingSize = 2048;      // Analog samples held on the Bpod between ReadAnalogSamples calls
+  byte ForwardQueueSize = 64;          // Soft codes and forwarded events waiting to be sent by the Bpod
 };
 struct TrialResult {
   uint16_t nEvents;
@@ -71,8 +136,15 @@ struct TrialResult {
 
   uint16_t nTransition;
   byte state_visited[1024] = {};
+
+  uint16_t DroppedEvents[7] = {}; // Events not recorded because of the event mask, per class (EventClassNames)
+  uint16_t VirtualEventOverflows;  // Virtual events lost because the Bpod's queue was full
+  uint16_t ForwardOverflows;       // Soft codes and forwarded events lost because the Bpod's queue was full
 };
 
+class Apod;
+typedef void (*ApodEventHandler)(Apod &apod, byte Code); // Closed-loop handler (SetEventHandler, SetSoftCodeHandler)
+
 // main class
 class Apod {
   public:
@@ -81,14 +153,18 @@ class Apod {
 
     // public variable
     TrialResult trial_res;
+    BlockTrialSummary block_res;
+    BpodCapabilities bpod_caps;
+    uint16_t AnalogFramesLost = 0; // Analog frames dropped on the Bpod (sample ring full) since StartAnalogInput
 
     // important functions
-    void HandShakeBpod();
+    int HandShakeBpod(unsigned long Timeout = 0);
     States CreateState(String Name, float TimeOut, int nStateChange, StateChange* StateChangeCondition, int nOutput, OutputAction* Output);
     int AddBlankState(String statename);
     int AddState(States *state);
     void SetGlobalTimer(byte TimerNumber, float TimerDuration);
     void SetGlobalCounter(byte CounterNumber, String TargetEventName, unsigned long Threshold);
+    int SetEventRecording(String EventName, bool Record);
     int SendStateMatrix();
     int RunStateMatrix();
     int ReceiveBpodData();
@@ -96,6 +172,38 @@ class Apod {
     void setPortInputsEnabled(byte* PortEnabled);
     void setWireInputsEnabled(byte* WireEnabled);
     void ManualOverride(byte Command1, byte Command2, byte Data);
+    void StartRecording(Stream &s);
+    void StopRecording();
+    int WriteStateMatrix(Stream &s);
+    void StartExport(Stream &s, uint16_t TrialsPerChunk = 32);
+    void StopExport();
+    int UploadSequence(SequenceStep* Steps, byte nSteps);
+    void StartSequence();
+    void CancelSequence();
+    int ClearBlock();
+    int AddBlockMatrix(byte TrialType);
+    int AppendBlockTrials(byte* TrialTypes, uint16_t nTrials);
+    int AppendRandomBlockTrials(unsigned long Seed, uint16_t nTrials, byte nTypes, byte MaxRepeat);
+    void StartBlock(float ITI);
+    void AbortBlock();
+    int ReceiveBlockSummary();
+    int LoadWaveform(byte WaveNumber, String Target, byte* Samples, uint16_t nSamples, float SamplePeriod, uint16_t Repeats);
+    int LoadPulseTrain(byte WaveNumber, String Target, byte Value, float PulseWidth, float PulseInterval, uint16_t nPulses);
+    int ClearWaves();
+    unsigned long GetWaveEngineCost();
+    unsigned long GetTransitionLatency(unsigned long* StateEntries = 0, unsigned long* OutputWrites = 0);
+    int SetFullOutputWrites(boolean Full);
+    int StartAnalogInput(byte Channels, float SamplePeriod);
+    int StopAnalogInput();
+    int SetAnalogThreshold(byte Channel, uint16_t High, uint16_t Low);
+    int ClearAnalogThreshold(byte Channel);
+    int ReadAnalogSamples(uint16_t* Samples, uint16_t MaxSamples);
+    int SetEventHandler(String EventName, ApodEventHandler Handler);
+    void SetSoftCodeHandler(ApodEventHandler Handler);
+    int PollBpod();
+    void StartProfiling(ApodProfile &p);
+    void StopProfiling();
+    void PrintProfile(Stream &s, const ApodProfile &p);
 
     // Serial related functions
     byte SerialReadByte();
@@ -103,6 +211,9 @@ class Apod {
     unsigned long SerialReadLong();
     unsigned int DataReceived();
     void SerialReadAll();
+    int SerialReadByteTimeout(unsigned long Timeout);
+    void SerialWriteShort(uint16_t num);
+    void SerialWriteLong(unsigned long num);
 
     // other function
     int  find_idx(const String * str_array, int array_length, String target);
@@ -111,6 +222,47 @@ class Apod {
   private:
     StateMatrix _sma;
     Stream* ApodSerial; // Stores the interface (Serial, Serial1, SerialUSB, etc.)
+    Stream* RecordStream = 0; // Session recording destination (SD card, USB, etc.); 0 when not recording
+    void RecordHeader(byte Type, unsigned long Length);
+    void RecordShort(uint16_t num);
+    void RecordLong(unsigned long num);
+    Stream* ExportStream = 0; // Columnar trial export destination; 0 when not exporting
+    uint16_t ExportChunkTrials;
+    uint16_t ExportTrialsInChunk;
+    unsigned long ExportTrialCount;
+    unsigned long ExportChunkBytes;
+    unsigned long ExportOffsets[MaxExportChunkTrials];
+    void ExportTrial();
+    void ExportCloseChunk();
+    void ExportWrite(byte b);
+    void ExportShort(uint16_t num);
+    void ExportLong(unsigned long num);
+    void ExportVarLong(unsigned long num);
+    byte VarLongBytes(unsigned long num);
+    ApodProfile* Profile = 0; // Trial cycle timing (StartProfiling); 0 when not profiling
+    void ProfileMark(byte Phase, unsigned long Bytes = 0) { // Inline so that it costs one test when not profiling
+      if (Profile) {
+        Profile->Mark(Phase, micros(), Bytes);
+      }
+    }
+    void ProfileEndCycle();
+    ApodEventHandler EventHandlers[66] = {}; // Called for forwarded events (op code 5), by event code
+    ApodEventHandler SoftCodeHandler = 0;     // Called for soft codes (op code 2)
+    byte ForwardMask[9] = {};                 // Events the Bpod forwards (bit per event code)
+    byte ReadReply();
+    void FlushBpod();
+    void Dispatch(byte OpCode, byte Code);
+    bool TrialPending = false; // Trial data already read by ReadAnalogSamples, returned by the next ReceiveBpodData
+    bool BlockRunning = false; // From StartBlock until ReceiveBlockSummary reads the block end
+    int ReadScheduleReply();
+    int ReadTrialData();
+    int SendAnalogMatrix();
+    int SendAnalogCommand(byte Command, byte Data1, byte Data2, uint16_t Value1, uint16_t Value2);
+    void ReadCapabilities();
+    bool FirmwareSupports(unsigned long Feature);
+    int BuildStateMatrix(byte* output);
+    int BuildMatrixRows(byte* output, byte* Matrix, byte nColumns, bool SelfDefault, bool Sparse, byte nSent = 0);
+    int SendWave(byte WaveNumber, String Target, byte* Samples, uint16_t nSamples, unsigned long EvenHoldTime, unsigned long OddHoldTime, uint16_t Repeats);
     // enable variables
     byte PortInputsEnabled[8] = {1, 1, 1, 1, 1, 1, 1, 1};
     byte WireInputsEnabled[4] = {1, 1, 1, 1};
@@ -0,0 +1,130 @@
+/*
+   ApodProfile.h - Per-phase timing of the Apod trial cycle (Apod::StartProfiling).
+   A cycle runs from the end of one ReceiveBpodData to the end of the next and is split into phases at the
+   calls Apod makes; each phase's microseconds and serial bytes are summed over the cycle and, when the trial
+   data has been received, added to the session statistics (count, min, mean, max, log2 histogram).
+   Plain C++: also built on the host by extras/ApodHost/apod_profile.cpp, which prints the same report
+   from the 'P' records of a session recording.
+   Released into the public domain.
+*/
+
+#ifndef ApodProfile_h
+#define ApodProfile_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+const int ApodPhases = 8;         // Phases of a trial cycle, in order
+const int ApodProfileRows = 9;    // Phases, then the inter-trial total
+const int ApodHistogramBins = 24; // Bin k: [2^k, 2^(k+1)) us (bin 0 also holds 0 us, the last bin everything longer)
+
+enum ApodPhase {
+  PhaseIdle,       // End of the previous trial's data to EmptyMatrix (user code between trials)
+  PhaseBuild,      // EmptyMatrix to SendStateMatrix (CreateState / AddState / SetGlobalTimer ...)
+  PhaseSerialize,  // Building the matrix image
+  PhaseTransmit,   // Queueing the image on the serial port (and recording it)
+  PhaseAck,        // Waiting for the Bpod to acknowledge the matrix (includes draining the serial transmit buffer)
+  PhaseRun,        // Matrix acknowledged to run acknowledged ('R')
+  PhaseTrial,      // Run acknowledged to the first byte of trial data (the trial itself)
+  PhaseReceive,    // Reading the trial data
+  PhaseInterTrial  // All phases but Trial (report only)
+};
+
+const char* const ApodPhaseNames[ApodProfileRows] = {
+  "Idle", "Build", "Serialize", "Transmit", "Ack", "Run", "Trial", "Receive", "InterTrial"
+};
+
+struct ApodPhaseStats {
+  uint32_t Count;
+  uint32_t Min;    // us
+  uint32_t Max;    // us
+  uint64_t Sum;    // us
+  uint64_t Bytes;  // Serial bytes moved in this phase, all cycles
+  uint16_t Histogram[ApodHistogramBins]; // Saturating counts
+
+  void Add(uint32_t Micros, uint32_t nBytes) {
+    if (Count == 0 || Micros < Min) {
+      Min = Micros;
+    }
+    if (Micros > Max) {
+      Max = Micros;
+    }
+    Count++;
+    Sum += Micros;
+    Bytes += nBytes;
+    int Bin = 0;
+    while (Bin < ApodHistogramBins - 1 && (Micros >> (Bin + 1)) != 0) {
+      Bin++;
+    }
+    if (Histogram[Bin] < 0xFFFF) {
+      Histogram[Bin]++;
+    }
+  }
+};
+
+struct ApodProfile {
+  ApodPhaseStats Stats[ApodProfileRows];
+  uint32_t Micros[ApodPhases];  // Current cycle so far
+  uint32_t Bytes[ApodPhases];
+  uint32_t LastMark;            // Time of the last phase boundary (micros())
+
+  void Clear(uint32_t Now) {
+    for (int p = 0; p < ApodProfileRows; p++) {
+      Stats[p] = ApodPhaseStats();
+    }
+    DropCycle();
+    LastMark = Now;
+  }
+
+  // Phase boundary: the time since the last boundary belongs to Phase
+  void Mark(int Phase, uint32_t Now, uint32_t nBytes) {
+    Micros[Phase] += Now - LastMark;
+    Bytes[Phase] += nBytes;
+    LastMark = Now;
+  }
+
+  // Add one whole cycle to the statistics
+  void AddCycle(const uint32_t* CycleMicros, const uint32_t* CycleBytes) {
+    uint32_t InterTrialMicros = 0, InterTrialBytes = 0;
+    for (int p = 0; p < ApodPhases; p++) {
+      Stats[p].Add(CycleMicros[p], CycleBytes[p]);
+      if (p != PhaseTrial) {
+        InterTrialMicros += CycleMicros[p];
+        InterTrialBytes += CycleBytes[p];
+      }
+    }
+    Stats[PhaseInterTrial].Add(InterTrialMicros, InterTrialBytes);
+  }
+
+  void EndCycle() {
+    AddCycle(Micros, Bytes);
+    DropCycle();
+  }
+
+  void DropCycle() {
+    for (int p = 0; p < ApodPhases; p++) {
+      Micros[p] = 0;
+      Bytes[p] = 0;
+    }
+  }
+
+  // One line of the report (Row -1: column titles), without line end. Returns the length written.
+  int FormatLine(int Row, char* Line, int Size) const {
+    if (Row < 0) {
+      return snprintf(Line, Size, "%-10s %7s %9s %9s %9s %7s  log2(us):count", "phase", "trials", "min_us", "mean_us", "max_us", "bytes");
+    }
+    const ApodPhaseStats& s = Stats[Row];
+    unsigned long Mean = s.Count ? (unsigned long)(s.Sum / s.Count) : 0;
+    unsigned long MeanBytes = s.Count ? (unsigned long)(s.Bytes / s.Count) : 0;
+    int n = snprintf(Line, Size, "%-10s %7lu %9lu %9lu %9lu %7lu ", ApodPhaseNames[Row], (unsigned long)s.Count,
+                     (unsigned long)s.Min, Mean, (unsigned long)s.Max, MeanBytes);
+    for (int b = 0; b < ApodHistogramBins && n > 0 && n < Size; b++) {
+      if (s.Histogram[b]) {
+        n += snprintf(Line + n, Size - n, " %d:%u", b, (unsigned)s.Histogram[b]);
+      }
+    }
+    return (n < Size) ? n : Size - 1;
+  }
+};
+
+#endif
@@ -0,0 +1,154 @@
+/*
+   AnalogInput.h - Sampling of the port analog lines from the timer handler.
+   Each timer cycle the handler passes the latest free-running ADC conversion of every line. Selected lines
+   are checked against their thresholds on every cycle (Schmitt trigger: an event when the reading rises to
+   High, another when it falls back to Low) and averaged over SamplePeriod cycles into one stored sample.
+   Stored samples go into a single-producer/single-consumer ring (producer: timer handler, consumer: loop()),
+   in frames of one sample per selected line, which loop() sends to Apod in blocks.
+   Plain C++: also built on the host by extras/ApodHost/apod_analog_sim.cpp.
+   Released into the public domain.
+*/
+
+#ifndef AnalogInput_h
+#define AnalogInput_h
+
+#include <stdint.h>
+
+const uint16_t AnalogTrialStart = 0xFFFF; // Value of every sample in the marker frame stored when a trial starts (readings are 12-bit)
+
+template <int Size> // Samples held; power of 2, at most 32768
+class AnalogSampler {
+  public:
+    volatile uint16_t Head;      // Next slot to fill (producer)
+    volatile uint16_t Tail;      // Next sample to send (consumer)
+    volatile uint16_t Overflows; // Frames dropped because the ring was full, since Configure (producer, saturates)
+    uint8_t Channels;            // Lines sampled (bit per line)
+    uint8_t nChannels;           // Samples per frame
+    uint16_t SamplePeriod;       // Timer cycles averaged into each stored sample
+    uint8_t Thresholds;          // Lines with threshold events (bit per line)
+    uint16_t High[8];            // Rising to High or above: event 2 * line ("AnalogNHigh")
+    uint16_t Low[8];             // Falling to Low or below: event 2 * line + 1 ("AnalogNLow")
+
+    AnalogSampler() : Head(0), Tail(0), Overflows(0), Channels(0), nChannels(0), SamplePeriod(1), Thresholds(0),
+      Armed(0), Above(0), Cycle(0) {}
+
+    // Select lines and sample period, and drop stored samples; only while the producer is stopped
+    void Configure(uint8_t NewChannels, uint16_t NewSamplePeriod) {
+      Channels = NewChannels;
+      nChannels = 0;
+      for (int x = 0; x < 8; x++) {
+        nChannels += (Channels >> x) & 1;
+      }
+      SamplePeriod = (NewSamplePeriod > 0) ? NewSamplePeriod : 1;
+      Tail = Head;
+      Overflows = 0;
+      Restart();
+    }
+
+    // Threshold events of one line; the line is re-armed from its next reading, so no event fires on setup
+    void SetThreshold(uint8_t Line, bool Enabled, uint16_t NewHigh, uint16_t NewLow) {
+      High[Line] = NewHigh;
+      Low[Line] = NewLow;
+      Armed &= ~(1 << Line);
+      if (Enabled) {
+        Thresholds |= (1 << Line);
+      } else {
+        Thresholds &= ~(1 << Line);
+      }
+    }
+
+    // Start of a trial (producer stopped): restart the sample period, re-arm thresholds, store a marker frame
+    void Restart() {
+      Cycle = 0;
+      Armed = 0;
+      for (int x = 0; x < 8; x++) {
+        Sums[x] = 0;
+      }
+      if (nChannels > 0) {
+        uint16_t Marker[8] = {AnalogTrialStart, AnalogTrialStart, AnalogTrialStart, AnalogTrialStart,
+                              AnalogTrialStart, AnalogTrialStart, AnalogTrialStart, AnalogTrialStart};
+        PushFrame(Marker);
+      }
+    }
+
+    // One timer cycle (producer). Readings holds the latest conversion of each of the 8 lines.
+    // Writes the threshold events of this cycle (0-15, line order) to Events and returns their number.
+    uint8_t Tick(const uint16_t* Readings, uint8_t* Events) {
+      uint8_t nEvents = 0;
+      for (int x = 0; x < 8; x++) {
+        if (!((Channels >> x) & 1)) {
+          continue;
+        }
+        uint16_t Reading = Readings[x];
+        Sums[x] += Reading;
+        if ((Thresholds >> x) & 1) {
+          uint8_t Bit = 1 << x;
+          if (!(Armed & Bit)) {
+            Armed |= Bit;
+            Above = (Reading >= High[x]) ? (Above | Bit) : (Above & ~Bit);
+          } else if (!(Above & Bit) && (Reading >= High[x])) {
+            Above |= Bit;
+            Events[nEvents++] = 2 * x;
+          } else if ((Above & Bit) && (Reading <= Low[x])) {
+            Above &= ~Bit;
+            Events[nEvents++] = 2 * x + 1;
+          }
+        }
+      }
+      Cycle++;
+      if (Cycle >= SamplePeriod) {
+        uint16_t Frame[8];
+        uint8_t n = 0;
+        for (int x = 0; x < 8; x++) {
+          if ((Channels >> x) & 1) {
+            Frame[n++] = Sums[x] / SamplePeriod;
+            Sums[x] = 0;
+          }
+        }
+        PushFrame(Frame);
+        Cycle = 0;
+      }
+      return nEvents;
+    }
+
+    // Consumer side: samples waiting (always whole frames)
+    uint16_t Available() {
+      return (uint16_t)(Head - Tail);
+    }
+
+    // Consumer side: the i-th waiting sample (i < Available())
+    uint16_t Sample(uint16_t i) {
+      __sync_synchronize(); // Head is read before the samples
+      return Samples[(uint16_t)(Tail + i) & (Size - 1)];
+    }
+
+    // Consumer side: release the first n waiting samples
+    void Release(uint16_t n) {
+      __sync_synchronize(); // Samples are read before their slots are released
+      Tail = Tail + n;
+    }
+
+  private:
+    uint8_t Armed;     // Lines whose threshold state is known (bit per line)
+    uint8_t Above;     // Lines last seen above High (bit per line)
+    uint16_t Cycle;    // Timer cycles into the current sample period
+    uint32_t Sums[8];  // Readings summed over the current sample period
+    uint16_t Samples[Size];
+
+    void PushFrame(const uint16_t* Frame) {
+      uint16_t h = Head;
+      if ((uint16_t)(h - Tail) + nChannels > Size) {
+        if (Overflows < 0xFFFF) {
+          Overflows++;
+        }
+        return;
+      }
+      for (int x = 0; x < nChannels; x++) {
+        Samples[(uint16_t)(h + x) & (Size - 1)] = Frame[x];
+      }
+      __sync_synchronize(); // Frame is written before it is published
+      Head = h + nChannels;
+    }
+};
+
+#endif
@@ -32,7 +32,12 @@
 // https://github.com/ivanseidel/DueTimer
 #include <DueTimer.h>
 #include <SPI.h>
+#include "VirtualEventQueue.h"
+#include "AnalogInput.h"
+#include "EventSequence.h"
+#include "VirtualEventLines.h"
 byte FirmwareBuildVersion = 6;
+unsigned long FirmwareFeatures = 511; // Optional protocol features (bits): 1 = 'Q' sequences, 2 = 'W' waves, 4 = 'B' block mode, 8 = 'C' sparse matrix upload, 16 = event recording mask, 32 = virtual event queue, 64 = 'L' transition latency, 128 = 'A' analog input, 256 = 'E' event forwarding
 //////////////////////////////
 // Hardware mapping:         /
 //////////////////////////////
@@ -75,7 +80,7 @@ boolean BNCInputLineValue[2] = {0}; // Direct reads of BNC input lines
 boolean BNCInputLineOverride[2] = {0}; // Set to 1 if user created a virtual BNC high event, to prevent hardware reads until user returns low
 boolean BNCInputLineLastKnownStatus[2] = {0}; // Last known status of BNC input lines
 boolean WireInputLineValue[4] = {0}; // Direct reads of Wire terminal input lines
-boolean WireInputLineOverride[2] = {0}; // Set to 1 if user created a virtual wire high event, to prevent hardware reads until user returns low
+boolean WireInputLineOverride[4] = {0}; // Set to 1 if user created a virtual wire high event, to prevent hardware reads until user returns low
 boolean WireInputLineLastKnownStatus[4] = {0}; // Last known status of Wire terminal input lines
 boolean MatrixFinished = false; // Has the system exited the matrix (final state)?
 boolean MatrixAborted = false; // Has the user aborted the matrix before the final state?
@@ -87,10 +92,31 @@ byte state_visited[1024] = {}; // new
 uint16_t nTransition = 0; // new
 byte Events[10000] = {0}; // new
 
-byte CurrentEvent[10] = {0}; // What event code just happened and needs to be handled. Up to 10 can be acquired per 30us loop.
+byte CurrentEvent[34] = {0}; // What event code just happened and needs to be handled. Up to 34 per cycle: one per port (8), BNC (2) and wire (4) line, a soft event, one per analog channel (8), 5 global timers, 5 global counters and the state timer.
 byte nCurrentEvents = 0; // Index of current event
 byte SoftEvent = 0; // What soft event code just happened
 
+const int MaxSequenceSteps = 128; // Maximum number of steps in a scripted sequence
+EventSequence<MaxSequenceSteps> Sequence; // Scripted sequence of virtual events and output overrides (offsets in timer cycles)
+
+const int MaxStates = 128; // Size of the state matrix arrays
+const int BlockMatrixImageMax = MaxStates * 73 + 66; // Largest matrix image: 'P', nStates, dense rows, fixed fields, event mask
+byte BlockMatrixPool[BlockMatrixImageMax] = {0}; // Matrix images ('P'/'C' op code + payload) for block mode, stored back to back
+uint16_t BlockMatrixOffset[8] = {0}; // Start of each trial type's matrix image in the pool
+uint16_t BlockMatrixLength[8] = {0}; // Length of each trial type's matrix image
+byte BlockMatrixLoaded[8] = {0}; // 1 if a matrix image was uploaded for trial type x
+uint16_t BlockPoolUsed = 0; // Bytes of the pool in use
+byte BlockTrialTypes[1024] = {0}; // Ring buffer of scheduled trial types
+uint16_t BlockTrialsScheduled = 0; // Trials appended to the schedule since the block was cleared
+uint16_t BlockTrialIndex = 0; // Trials started so far
+byte BlockLastType = 255; // Last scheduled trial type (for repeat constraints)
+uint16_t BlockRepeatCount = 0; // Consecutive scheduled trials of BlockLastType (saturates)
+boolean BlockRunning = false; // Is the firmware running trials back-to-back?
+boolean BlockAborted = false; // Was the block aborted during a trial?
+unsigned long BlockITI = 0; // Inter-trial interval (units = microseconds)
+unsigned long BlockNextTrialTime = 0; // micros() at which the next block trial may start
+byte *MatrixReadPointer = 0; // When set, loadStateMatrix() reads from memory instead of Serial1
+
 
 //////////////////////////////////
 // Initialize general use vars:  /
@@ -99,6 +125,16 @@ byte SoftEvent = 0; // What soft event code just happened
 byte CommandByte = 0;  // Op code to specify handling of an incoming USB serial message
 byte VirtualEventTarget = 0; // Op code to specify which virtual event type (Port, BNC, etc)
 byte VirtualEventData = 0; // State of target
+VirtualEventQueue<64> VirtualEvents; // Virtual events from loop() to the timer handler
+VirtualEventQueue<64> ForwardedEvents; // Soft codes and subscribed events from the timer handler to loop() (Target = op code 2 or 5, Data = code)
+byte ForwardMask[9] = {0}; // Events sent to the client as they happen (bit per event code, set with 'E')
+AnalogSampler<2048> AnalogInput; // Port analog line samples from the timer handler to loop(), and threshold detection
+byte AnalogADCChannel[8] = {0}; // ADC channel of each port analog line
+uint16_t AnalogReadings[8] = {0}; // Latest conversion of each sampled line
+byte AnalogEvents[16] = {0}; // Threshold events found on this cycle (0-15 = event codes 50-65)
+byte AnalogStateMatrix[128][16] = {0}; // State transitions for analog threshold events (Analog1High, Analog1Low, ... Analog8Low)
+byte VirtualEventBudget = 4; // Maximum number of queued virtual events applied per timer cycle
+VirtualEventLines VirtualLines; // Input lines changed by a virtual event this cycle, sequence steps included
 int nWaves = 0; // number of scheduled waves registered
 byte CurrentWave = 0; // Scheduled wave currently in use
 byte LowByte = 0; // LowByte through FourthByte are used for reading bytes that will be combined to 16 and 32 bit integers
@@ -113,9 +149,9 @@ byte LEDBrightness = 0;
 byte InputStateMatrix[128][40] = {0}; // Matrix containing all of Bpod's inputs and corresponding state transitions
 // Cols: 0-15 = IR beam in...out... 16-19 = BNC1 high...low 20-27 = wire1high...low 28-37=SoftEvents 38=Unused  39=Tup
 
-byte OutputStateMatrix[128][17] = {0}; // Matrix containing all of Bpod's output actions for each Input state
-// Cols: 0=Valves 1=BNC 2=Wire 3=Hardware serial 1 (UART) 4=Hardware Serial 2 (UART) 5 = SoftCode 5=GlobalTimerTrig 6=GlobalTimerCancel
-// 7 = GlobalCounterReset 8-15=PWM values (LED channel on port interface board)
+byte OutputStateMatrix[128][19] = {0}; // Matrix containing all of Bpod's output actions for each Input state
+// Cols: 0=Valves 1=BNC 2=Wire 3=Hardware serial 1 (UART) 4=Hardware Serial 2 (UART) 5 = SoftCode 6=GlobalTimerTrig 7=GlobalTimerCancel
+// 8 = GlobalCounterReset 9-16=PWM values (LED channel on port interface board) 17=WaveTrig 18=WaveCancel
 
 byte GlobalTimerMatrix[128][5] = {0}; // Matrix contatining state transitions for global timer elapse events
 byte GlobalCounterMatrix[128][5] = {0}; // Matrix contatining state transitions for global counter threshold events
@@ -125,8 +161,42 @@ unsigned long GlobalTimers[5] = {0}; // Timers independent of states
 unsigned long GlobalCounterCounts[5] = {0}; // Event counters
 byte GlobalCounterAttachedEvents[5] = {254}; // Event each event counter is attached to
 unsigned long GlobalCounterThresholds[5] = {0}; // Event counter thresholds (trigger events if crossed)
+byte WaveTarget[4] = {0}; // Output driven by each wave: 1-8 = port PWM channel, 9-10 = BNC output line
+byte WaveSamples[4][256] = {0}; // Sample table of each wave (PWM duty cycle, or 0/1 for BNC lines)
+uint16_t WaveSampleCount[4] = {0}; // Number of samples in each table
+unsigned long WaveHoldTime[4][2] = {0}; // Timer cycles to hold even/odd samples (equal for sample tables, high/low times for pulse trains)
+uint16_t WaveRepeats[4] = {0}; // Number of passes through the table (0 = until cancelled)
+boolean WaveActive[4] = {0}; // 1 if wave x is playing
+uint16_t WavePosition[4] = {0}; // Next sample to output
+uint16_t WavePasses[4] = {0}; // Completed passes through the table
+unsigned long WaveNextUpdate[4] = {0}; // Time of next sample update
+uint16_t WaveOutputs = 0; // Outputs owned by active waves (bits 0-7 = PWM channels, bits 8-9 = BNC lines)
+int MaxWaves = 4; // Maximum number of waves
+int MaxWaveSamples = 256; // Maximum number of samples per wave
+unsigned long WaveCyclesMax = 0; // Longest wave engine update measured (units = CPU cycles)
+Pio* OutputPorts[4]; // PIO controllers driving the BNC and wire output lines
+byte nOutputPorts = 0;
+byte OutputPortLines[4] = {0}; // Output lines on each controller (bits 0-1 = BNC, bits 2-5 = wire)
+byte OutputLinePort[6] = {0}; // Controller index of BNC 1-2 and wire 1-4 output lines
+uint32_t OutputLineMask[6] = {0}; // PIO bit of BNC 1-2 and wire 1-4 output lines
+byte PlanLines[128] = {0}; // Output plan of each state: BNC (bits 0-1) and wire (bits 2-5) levels, compiled when the matrix is loaded
+uint32_t PlanSetMask[128][4] = {0}; // Output plan of each state: lines to drive high on each controller
+uint32_t PlanClearMask[128][4] = {0}; // Output plan of each state: lines to drive low on each controller
+byte OutputValves = 0; // Valve byte last written (state outputs only write what differs)
+byte OutputLines = 0; // BNC (bits 0-1) and wire (bits 2-5) levels last written
+byte OutputPWM[8] = {0}; // PWM duty cycles last written
+uint16_t OutputChanges = 0; // Outputs written on the last state entry: bit 0 = valves, 1-2 = BNC, 3-6 = wire, 7-14 = PWM, 15 = serial module
+unsigned long HandlerStartCycles = 0; // CPU cycle count when the timer handler was entered
+unsigned long TransitionCyclesMax = 0; // Longest time from handler entry to the last output written on a state transition (units = CPU cycles)
+unsigned long StateOutputCalls = 0; // Calls to setStateOutputs since the last 'L' 'R'
+unsigned long OutputWriteCount = 0; // Outputs written by setStateOutputs since the last 'L' 'R' (one per bit of OutputChanges)
+boolean FullOutputWrites = false; // Write every output on each state entry, as before output plans ('L' 'F'), to compare latencies
 unsigned long TimeStamps[10000] = {0}; // TimeStamps for events on this trial
 int MaxTimestamps = 10000; // Maximum number of timestamps (to check when to start event-dropping)
+byte EventMask[7] = {0}; // Events not stored or sent (bit per event code, uploaded with the matrix); they still drive transitions and counters
+byte EventClass[50] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+                       3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 4, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6}; // Class of each event code (index to DroppedEvents)
+uint16_t DroppedEvents[7] = {0}; // Masked events this trial: ports, BNC, wire, soft codes, Tup, global timers, global counters
 int CurrentColumn = 0; // Used when re-mapping event codes to columns of global timer and counter matrices
 unsigned long StateTimers[128] = {0}; // Timers for each state
 unsigned long StartTime = 0; // System Start Time
@@ -169,6 +239,12 @@ void setup() {
   SetBNCOutputLines(0);
   updateStatusLED(0);
   ValveRegWrite(0);
+  initOutputPorts();
+  for (int x = 0; x < 8; x++) {
+    AnalogADCChannel[x] = g_APinDescription[PortAnalogInputLines[x] + A0].ulADCChannelNumber;
+  }
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; // Enable the cycle counter used to measure the wave engine and transitions
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
   Timer3.attachInterrupt(handler);
   Timer3.setPeriod(100); // Runs every 100us
   //Timer3.start(100); // Runs every 100us
@@ -178,6 +254,7 @@ void loop() {
   if (connectionState == 0) {
     updateStatusLED(1);
   }
+  sendForwardedEvents();
   if (Serial1.available() > 0) {
     CommandByte = Serial1.read();  // P for Program, R for Run, O for Override, 6 for Device ID
     switch (CommandByte) {
@@ -185,7 +262,6 @@ void loop() {
         connectionState = 1;
         updateStatusLED(2);
         Serial1.print(5);
-        delayMicroseconds(100000);
         Serial1.flush();
         SessionStartTime = millis();
         break;
@@ -193,6 +269,59 @@ void loop() {
         Serial1.write(FirmwareBuildVersion);
         ConnectedToClient = 1;
         break;
+      case 'K':  // Return capabilities record: 'K', length, fields (append new fields at the end)
+        Serial1.write('K');
+        Serial1.write(28);
+        Serial1.write(FirmwareBuildVersion);
+        SerialWriteLong(FirmwareFeatures);
+        Serial1.write(128); // Max states
+        Serial1.write(5); // Global timers
+        Serial1.write(5); // Global counters
+        Serial1.write(19); // Output matrix columns
+        SerialWriteShort(100); // Timer period (us)
+        SerialWriteShort(sizeof(Events)); // Events stored per trial
+        SerialWriteShort(sizeof(state_visited)); // States stored per trial
+        Serial1.write(MaxSequenceSteps);
+        Serial1.write(MaxWaves);
+        SerialWriteShort(MaxWaveSamples);
+        SerialWriteShort(sizeof(BlockMatrixPool));
+        SerialWriteShort(sizeof(BlockTrialTypes));
+        Serial1.write(64); // Virtual event queue size
+        Serial1.write(VirtualEventBudget);
+        SerialWriteShort(2048); // Analog sample ring size
+        Serial1.write(64); // Forwarded event queue size
+        ConnectedToClient = 1;
+        break;
+      case 'E': // Forward events: subscription mask (9 bytes, bit per event code), applied from the next timer cycle
+        for (int x = 0; x < 9; x++) {
+          ForwardMask[x] = SerialReadByte();
+        }
+        Serial1.write(1);
+        break;
+      case 'L': // State output timing
+        Byte1 = SerialReadByte();
+        switch (Byte1) {
+          case 'R': // Return and reset the longest state transition latency (CPU cycles from handler entry to last
+                    // output written), the setStateOutputs calls and the outputs they wrote, after 'L'
+            Serial1.write('L');
+            SerialWriteLong(TransitionCyclesMax);
+            SerialWriteLong(StateOutputCalls);
+            SerialWriteLong(OutputWriteCount);
+            TransitionCyclesMax = 0;
+            StateOutputCalls = 0;
+            OutputWriteCount = 0;
+            break;
+          case 'F': // Write every output on state entry (1) or only the changed ones (0); not while a trial runs
+            Byte2 = SerialReadByte();
+            if (RunningStateMatrix) {
+              Serial1.write(0);
+            } else {
+              FullOutputWrites = (Byte2 > 0);
+              Serial1.write(1);
+            }
+            break;
+        }
+        break;
       case 'O':  // Override hardware state
         manualOverrideOutputs();
         break;
@@ -234,158 +363,260 @@ void loop() {
       case 'V': // Manual override: execute virtual event
         VirtualEventTarget = SerialReadByte();
         VirtualEventData = SerialReadByte();
-        if (RunningStateMatrix) {
-          switch (VirtualEventTarget) {
-            case 'P': // Virtual poke PortInputLineLastKnownStatus
-              if (PortInputLineLastKnownStatus[VirtualEventData] == LOW) {
-                PortInputLineValue[VirtualEventData] = HIGH;
-                PortInputLineOverride[VirtualEventData] = true;
-              } else {
-                PortInputLineValue[VirtualEventData] = LOW;
-                PortInputLineOverride[VirtualEventData] = false;
+        if (RunningStateMatrix && (VirtualEventLine(VirtualEventTarget, VirtualEventData) != VirtualEventInvalid)) {
+          VirtualEvents.Push(VirtualEventTarget, VirtualEventData); // Applied by the timer handler
+        } break;
+      case 'Q': // Scripted sequence of virtual events and output overrides
+        Byte1 = SerialReadByte();
+        switch (Byte1) {
+          case 'L': // Load sequence; rejected as a whole (0) if a step is out of tick order or invalid
+            Sequence.Clear();
+            Byte2 = SerialReadByte(); // Number of steps
+            Byte3 = 1; // Return value
+            for (int x = 0; x < Byte2; x++) {
+              LongInt = SerialReadLong();
+              Byte4 = SerialReadByte();
+              VirtualEventTarget = SerialReadByte();
+              VirtualEventData = SerialReadByte();
+              if (!Sequence.Add(LongInt, Byte4, VirtualEventTarget, VirtualEventData)) {
+                Byte3 = 0;
+              }
+            }
+            if (Byte3 == 0) {
+              Sequence.Clear();
+            }
+            Serial1.write(Byte3);
+            break;
+          case 'G': // Start sequence (offsets relative to now, or to trial start if no trial is running)
+            Sequence.Start(CurrentTime);
+            break;
+          case 'C': // Cancel sequence
+            Sequence.Running = false;
+            break;
+        }
+        break;
+      case 'W': // Scheduled waves (sample tables and pulse trains)
+        Byte1 = SerialReadByte();
+        switch (Byte1) {
+          case 'L': { // Load wave: index, target, repeats, even/odd sample hold times, sample table
+            // A rejected wave (0) is read and discarded; no slot changes until the whole header is valid. Not while a
+            // trial runs: the timer handler plays the waves.
+            Byte2 = SerialReadByte(); // Index
+            Byte3 = SerialReadByte(); // Target output
+            word Repeats = SerialReadShort();
+            unsigned long EvenHoldTime = SerialReadLong();
+            unsigned long OddHoldTime = SerialReadLong();
+            word nSamples = SerialReadShort();
+            if (RunningStateMatrix || (Byte2 >= MaxWaves) || (Byte3 < 1) || (Byte3 > 10) || (nSamples > MaxWaveSamples)) {
+              for (int x = 0; x < nSamples; x++) {
+                SerialReadByte();
               }
-              break;
-            case 'B': // Virtual BNC input
-              if (BNCInputLineLastKnownStatus[VirtualEventData] == LOW) {
-                BNCInputLineValue[VirtualEventData] = HIGH;
-                BNCInputLineOverride[VirtualEventData] = true;
+              Serial1.write(0);
+            } else {
+              CurrentWave = Byte2;
+              WaveActive[CurrentWave] = false;
+              updateWaveOutputs();
+              WaveTarget[CurrentWave] = Byte3;
+              WaveRepeats[CurrentWave] = Repeats;
+              WaveHoldTime[CurrentWave][0] = EvenHoldTime;
+              WaveHoldTime[CurrentWave][1] = OddHoldTime;
+              WaveSampleCount[CurrentWave] = nSamples;
+              for (int x = 0; x < nSamples; x++) {
+                WaveSamples[CurrentWave][x] = SerialReadByte();
+              }
+              if (CurrentWave >= nWaves) {
+                nWaves = CurrentWave + 1;
+              }
+              Serial1.write(1);
+            }
+          } break;
+          case 'C': // Clear all waves
+            if (RunningStateMatrix) {
+              Serial1.write(0); // Not while a trial runs
+            } else {
+              for (int x = 0; x < MaxWaves; x++) {
+                WaveActive[x] = false;
+                WaveSampleCount[x] = 0;
+              }
+              updateWaveOutputs();
+              nWaves = 0;
+              Serial1.write(1);
+            }
+            break;
+          case 'M': // Return and reset the longest wave engine update (CPU cycles), after 'M' (not an op code 2/5 forwarded first)
+            Serial1.write('M');
+            SerialWriteLong(WaveCyclesMax);
+            WaveCyclesMax = 0;
+            break;
+        }
+        break;
+      case 'A': // Analog input sampling of the port analog lines
+        Byte1 = SerialReadByte();
+        switch (Byte1) {
+          case 'C': { // Configure: lines (bit per line, 0 = off), sample period (timer cycles averaged per sample)
+              Byte2 = SerialReadByte();
+              word SamplePeriod = SerialReadShort();
+              if (RunningStateMatrix) {
+                Serial1.write(0); // Not while a trial runs
               } else {
-                BNCInputLineValue[VirtualEventData] = LOW;
-                BNCInputLineOverride[VirtualEventData] = false;
+                AnalogInput.Configure(Byte2, SamplePeriod);
+                configureADC(Byte2);
+                Serial1.write(1);
               }
-              break;
-            case 'W': // Virtual Wire input
-              if (WireInputLineLastKnownStatus[VirtualEventData] == LOW) {
-                WireInputLineValue[VirtualEventData] = HIGH;
-                WireInputLineOverride[VirtualEventData] = true;
+            } break;
+          case 'T': { // Threshold events: line (0-7), enabled, high, low (12-bit ADC units)
+              Byte2 = SerialReadByte();
+              Byte3 = SerialReadByte();
+              word High = SerialReadShort();
+              word Low = SerialReadShort();
+              if (RunningStateMatrix) {
+                Serial1.write(0); // Not while a trial runs: the timer handler updates the thresholds' state
               } else {
-                WireInputLineValue[VirtualEventData] = LOW;
-                WireInputLineOverride[VirtualEventData] = false;
+                if (Byte2 < 8) {
+                  AnalogInput.SetThreshold(Byte2, Byte3, High, Low);
+                }
+                Serial1.write(1);
               }
-              break;
-            case 'S':  // Soft event
-              SoftEvent = VirtualEventData;
-              break;
-          }
-        } break;
-      case 'P':  // Get new state matrix from client
-        nStates = SerialReadByte();
-        // Get Input state matrix
-        for (int x = 0; x < nStates; x++) {
-          for (int y = 0; y < 40; y++) {
-            InputStateMatrix[x][y] = SerialReadByte();
-          }
-        }
-        // Get Output state matrix
-        for (int x = 0; x < nStates; x++) {
-          for (int y = 0; y < 17; y++) {
-            OutputStateMatrix[x][y] = SerialReadByte();
-          }
-        }
-        // Get global timer matrix
-        for (int x = 0; x < nStates; x++) {
-          for (int y = 0; y < 5; y++) {
-            GlobalTimerMatrix[x][y] = SerialReadByte();
-          }
-        }
-        // Get global counter matrix
-        for (int x = 0; x < nStates; x++) {
-          for (int y = 0; y < 5; y++) {
-            GlobalCounterMatrix[x][y] = SerialReadByte();
-          }
-        }
-        // Get global counter attached events
-        for (int x = 0; x < 5; x++) {
-          GlobalCounterAttachedEvents[x] = SerialReadByte();
-        }
-        // Get input channel configurtaion
-        for (int x = 0; x < 8; x++) {
-          PortInputsEnabled[x] = SerialReadByte();
-        }
-        for (int x = 0; x < 4; x++) {
-          WireInputsEnabled[x] = SerialReadByte();
-        }
-
-        // Get state timers
-        for (int x = 0; x < nStates; x++) {
-          StateTimers[x] = SerialReadLong();
-        }
-        // Get global timers
-        for (int x = 0; x < 5; x++) {
-          GlobalTimers[x] = SerialReadLong();
-        }
-        // Get global counter event count thresholds
-        for (int x = 0; x < 5; x++) {
-          GlobalCounterThresholds[x] = SerialReadLong();
+            } break;
+          case 'M': // Transitions for analog threshold events, as (column, value) pairs for each state of the loaded matrix
+            loadMatrixRows(&AnalogStateMatrix[0][0], 16, true, true);
+            Serial1.write(1);
+            break;
+          case 'R': // Return up to n stored samples
+            sendAnalogSamples(SerialReadShort());
+            break;
         }
+        break;
+      case 'P':  // Get new state matrix from client
+        loadStateMatrix(false);
+        Serial1.write(1);
+        break;
+      case 'C':  // Get new state matrix from client, rows sent as (column, value) pairs
+        loadStateMatrix(true);
         Serial1.write(1);
         break;
       case 'R':  // Run State Matrix
+        if (BlockRunning) {
+          Serial1.write(0); // Not during a block: the trial would be reported as a block trial
+          break;
+        }
         Serial1.write(1);
         if (RunningStateMatrix == 1) {
           RunningStateMatrix = 0;
           Timer3.stop();
         }
-
-        updateStatusLED(3);
-        NewState = 0;
-        CurrentState = 0;
-        nEvents = 0;
-        SoftEvent = 254; // No event
-        MatrixFinished = false;
-
-        // Reset event counters
-        for (int x = 0; x < 5; x++) {
-          GlobalCounterCounts[x] = 0;
-        }
-        // Read initial state of sensors
-        for (int x = 0; x < 8; x++) {
-          if (PortInputsEnabled[x] == 1) {
-            PortInputLineValue[x] = digitalReadDirect(PortDigitalInputLines[x]); // Read each photogate's current state into an array
-            if (PortInputLineValue[x] == HIGH) {
-              PortInputLineLastKnownStatus[x] = HIGH; // Update last known state of input line
-            } else {
-              PortInputLineLastKnownStatus[x] = LOW;
+        startStateMatrix();
+        break;
+      case 'B': // Block mode: run trials back-to-back from stored matrices
+        Byte1 = SerialReadByte();
+        switch (Byte1) {
+          case 'C': // Clear stored matrices and schedule
+            for (int x = 0; x < 8; x++) {
+              BlockMatrixLoaded[x] = 0;
             }
-          } else {
-            PortInputLineLastKnownStatus[x] = LOW; PortInputLineValue[x] = LOW;
-          }
-          PortInputLineOverride[x] = false;
-        }
-        for (int x = 0; x < 2; x++) {
-          BNCInputLineValue[x] = digitalReadDirect(BncInputLines[x]);
-          if (BNCInputLineValue[x] == HIGH) {
-            BNCInputLineLastKnownStatus[x] = true;
-          } else {
-            BNCInputLineLastKnownStatus[x] = false;
-          }
-          BNCInputLineOverride[x] = false;
-        }
-        for (int x = 0; x < 4; x++) {
-          if (WireInputsEnabled[x] == 1) {
-            WireInputLineValue[x] = digitalReadDirect(WireDigitalInputLines[x]);
-            if (WireInputLineValue[x] == HIGH) {
-              WireInputLineLastKnownStatus[x] = true;
-            } else {
-              WireInputLineLastKnownStatus[x] = false;
+            BlockPoolUsed = 0;
+            BlockTrialsScheduled = 0;
+            BlockTrialIndex = 0;
+            BlockLastType = 255;
+            BlockRepeatCount = 0;
+            Serial1.write(1);
+            break;
+          case 'M': // Store matrix image for a trial type: type, length, image (replaces the type's previous image)
+            Byte2 = SerialReadByte();
+            Num2Break = SerialReadShort();
+            Byte3 = ((Byte2 < 8) && !BlockRunning);
+            if (Byte3) {
+              LongInt = BlockPoolUsed - (BlockMatrixLoaded[Byte2] ? BlockMatrixLength[Byte2] : 0); // Pool used without the old image
+              Byte3 = (LongInt + Num2Break <= sizeof(BlockMatrixPool));
             }
-          }
-          WireInputLineOverride[x] = false;
+            if (Byte3) {
+              removeBlockMatrix(Byte2);
+            }
+            for (unsigned long x = 0; x < Num2Break; x++) {
+              Byte4 = SerialReadByte();
+              if (Byte3) {
+                BlockMatrixPool[BlockPoolUsed + x] = Byte4;
+              }
+            }
+            if (Byte3) {
+              BlockMatrixOffset[Byte2] = BlockPoolUsed;
+              BlockMatrixLength[Byte2] = Num2Break;
+              BlockMatrixLoaded[Byte2] = 1;
+              BlockPoolUsed += Num2Break;
+            }
+            Serial1.write(Byte3);
+            break;
+          case 'T': { // Append trial types to the schedule. All or nothing: op code 6, then 1, or 0 if a type has no
+              // matrix or the schedule is full
+              Num2Break = SerialReadShort();
+              uint16_t Scheduled = BlockTrialsScheduled;
+              byte LastType = BlockLastType;
+              uint16_t RepeatCount = BlockRepeatCount;
+              Byte3 = 1;
+              for (unsigned long x = 0; x < Num2Break; x++) {
+                Byte2 = SerialReadByte();
+                if (Byte3) {
+                  Byte3 = scheduleBlockTrial(Byte2);
+                }
+              }
+              if (!Byte3) { // Drop the trials appended so far
+                BlockTrialsScheduled = Scheduled;
+                BlockLastType = LastType;
+                BlockRepeatCount = RepeatCount;
+              }
+              Serial1.write(6);
+              Serial1.write(Byte3);
+            } break;
+          case 'N': // Append a seeded pseudo-random schedule: seed, nTrials, nTypes, max consecutive repeats
+            // Op code 6, then 1, or 0 (nothing appended) if a type has no matrix or the trials do not fit
+            LongInt = SerialReadLong();
+            Num2Break = SerialReadShort();
+            Byte2 = SerialReadByte();
+            Byte3 = SerialReadByte();
+            Byte4 = (Byte2 >= 1) && (Byte2 <= 8) && (Num2Break + (uint16_t)(BlockTrialsScheduled - BlockTrialIndex) <= 1024UL);
+            for (int x = 0; Byte4 && (x < Byte2); x++) {
+              Byte4 = BlockMatrixLoaded[x];
+            }
+            Serial1.write(6);
+            Serial1.write(Byte4);
+            if (Byte4) {
+              randomSeed(LongInt);
+              for (unsigned long x = 0; x < Num2Break; x++) {
+                Byte4 = random(Byte2);
+                if ((Byte3 > 0) && (Byte2 > 1) && (Byte4 == BlockLastType) && (BlockRepeatCount >= Byte3)) {
+                  Byte4 = (Byte4 + 1 + random(Byte2 - 1)) % Byte2;
+                }
+                scheduleBlockTrial(Byte4);
+              }
+            }
+            break;
+          case 'G': // Start block: inter-trial interval (units = timer cycles)
+            BlockITI = SerialReadLong() * 100;
+            BlockAborted = false;
+            BlockRunning = true;
+            BlockNextTrialTime = micros();
+            break;
+          case 'A': // Abort block
+            if (BlockRunning) {
+              if (RunningStateMatrix) {
+                BlockAborted = true;
+                RunningStateMatrix = false;
+                Sequence.Running = false;
+                Timer3.stop();
+                MatrixFinished = true;
+              } else {
+                endBlock();
+              }
+            }
+            break;
         }
-        // Reset timers
-        MatrixStartTime = 0;
-        StateStartTime = MatrixStartTime;
-        CurrentTime = MatrixStartTime;
-        MatrixStartTimeMillis = millis();
-        // Adjust outputs, scheduled waves, serial codes and sync port for first state
-        setStateOutputs(CurrentState);
-        RunningStateMatrix = 1;
-        Timer3.start(); // Runs every 100us
         break;
       case 'X':   // Exit state matrix and return data
         MatrixFinished = true;
         RunningStateMatrix = false;
+        Sequence.Running = false;
         Timer3.stop();      // stop timer
+        stopWaves();
         setStateOutputs(0); // Returns all lines to low by forcing final state
         break;
     } // End switch commandbyte
@@ -393,6 +624,8 @@ void loop() {
 
   if (MatrixFinished) {
     MatrixFinished = 0;
+    sendForwardedEvents(); // Everything forwarded during the trial arrives before its data
+    stopWaves();
     SyncRegWrite(0); // Reset the sync lines
     ValveRegWrite(0); // Reset valves
     for (int x = 0; x < 8; x++) { // Reset PWM lines
@@ -401,47 +634,81 @@ void loop() {
     UpdatePWMOutputStates();
     SetBNCOutputLines(0); // Reset BNC outputs
     SetWireOutputLines(0); // Reset wire outputs
-    Serial1.write(1); // Op Code for sending events
-    delay(10);
-    ////Serial1.write(1); // Read one event
-    ////Serial1.write(255); // Send Matrix-end code
-    // Send trial-start timestamp (in milliseconds, basically immune to microsecond 32-bit timer wrap-over)
-    ////SerialWriteLong(MatrixStartTimeMillis - SessionStartTime);
-    // Send matrix start timestamp (in microseconds)
-    ////SerialWriteLong(MatrixStartTime);
-    if (nEvents > 9999) {
-      nEvents = 10000;
-    }
-    SerialWriteShort(nEvents);
-    delayMicroseconds(100); // new
-    for (int x = 0; x < nEvents; x++) {
-      Serial1.write(Events[x]); // new
-      SerialWriteLong(TimeStamps[x]);
-      delayMicroseconds(50);
-    }
-    if (nTransition > 1023) {
-      nTransition = 1024;
-    }
-    SerialWriteShort(nTransition);// new
-    delayMicroseconds(100);// new
-    for (int x = 0; x < nTransition; x++) {
-      Serial1.write(state_visited[x]); // new
-      delayMicroseconds(50);
+    if (BlockRunning) {
+      sendBlockTrialSummary();
+    } else {
+      Serial1.write(1); // Op Code for sending events
+      delay(10);
+      ////Serial1.write(1); // Read one event
+      ////Serial1.write(255); // Send Matrix-end code
+      // Send trial-start timestamp (in milliseconds, basically immune to microsecond 32-bit timer wrap-over)
+      ////SerialWriteLong(MatrixStartTimeMillis - SessionStartTime);
+      // Send matrix start timestamp (in microseconds)
+      ////SerialWriteLong(MatrixStartTime);
+      if (nEvents > 9999) {
+        nEvents = 10000;
+      }
+      SerialWriteShort(nEvents);
+      delayMicroseconds(100); // new
+      for (int x = 0; x < nEvents; x++) {
+        Serial1.write(Events[x]); // new
+        SerialWriteLong(TimeStamps[x]);
+        delayMicroseconds(50);
+      }
+      if (nTransition > 1023) {
+        nTransition = 1024;
+      }
+      SerialWriteShort(nTransition);// new
+      delayMicroseconds(100);// new
+      for (int x = 0; x < nTransition; x++) {
+        Serial1.write(state_visited[x]); // new
+        delayMicroseconds(50);
+      }
+      for (int x = 0; x < 7; x++) {
+        SerialWriteShort(DroppedEvents[x]); // Masked events per class
+      }
+      SerialWriteShort(VirtualEvents.Overflows); // Virtual events lost because the queue was full
+      SerialWriteShort(ForwardedEvents.Overflows); // Soft codes and forwarded events lost because the queue was full
     }
-
     updateStatusLED(0);
     updateStatusLED(2);
+    Sequence.Running = false; // Stop scripted sequence
     for (int x = 0; x < 5; x++) { // Shut down active global timers
       GlobalTimersActive[x] = false;
     }
+    if (BlockAborted) {
+      endBlock();
+    }
+    BlockNextTrialTime = micros() + BlockITI;
   } // End Matrix finished
+
+  // Start the next block trial once the inter-trial interval has elapsed
+  if (BlockRunning && !RunningStateMatrix && ((long)(micros() - BlockNextTrialTime) >= 0)) {
+    if (BlockTrialIndex < BlockTrialsScheduled) {
+      MatrixReadPointer = BlockMatrixPool + BlockMatrixOffset[BlockTrialTypes[BlockTrialIndex % 1024]];
+      loadStateMatrix(*MatrixReadPointer++ == 'C'); // Op code: 'P' (dense) or 'C' (sparse)
+      MatrixReadPointer = 0;
+      BlockTrialIndex++;
+      startStateMatrix();
+    } else {
+      endBlock();
+    }
+  }
 }
 
 void handler() {
+  HandlerStartCycles = DWT->CYCCNT;
   if (RunningStateMatrix) {
     nCurrentEvents = 0;
     CurrentEvent[0] = 254; // Event 254 = No event
     CurrentTime++;
+    VirtualLines.Clear();
+    // Replay scripted sequence steps due on this cycle
+    if (Sequence.Running) {
+      runSequence();
+    }
+    // Apply virtual events queued by loop()
+    applyVirtualEvents();
     // Refresh state of sensors and inputs
     for (int x = 0; x < 8; x++) {
       if ((PortInputsEnabled[x] == 1) && (!PortInputLineOverride[x])) {
@@ -503,6 +770,18 @@ void handler() {
       CurrentEvent[nCurrentEvents] = SoftEvent + Ev - 1; nCurrentEvents++;
       SoftEvent = 254;
     }
+    // Sample the analog lines; threshold crossings are events 50-65
+    if (AnalogInput.Channels) {
+      for (int x = 0; x < 8; x++) {
+        if (bitRead(AnalogInput.Channels, x)) {
+          AnalogReadings[x] = ADC->ADC_CDR[AnalogADCChannel[x]];
+        }
+      }
+      byte nAnalogEvents = AnalogInput.Tick(AnalogReadings, AnalogEvents);
+      for (int x = 0; x < nAnalogEvents; x++) { // At most one per channel (AnalogInput.Tick)
+        CurrentEvent[nCurrentEvents] = AnalogEvents[x] + 50; nCurrentEvents++;
+      }
+    }
     Ev = 40;
     // Determine if a global timer expired
     for (int x = 0; x < 5; x++) {
@@ -548,15 +827,28 @@ void handler() {
       } else if (CurrentEvent[i] < 50) {
         CurrentColumn = CurrentEvent[i] - 45;
         NewState = GlobalCounterMatrix[CurrentState][CurrentColumn];
+      } else if (CurrentEvent[i] < 66) {
+        CurrentColumn = CurrentEvent[i] - 50;
+        NewState = AnalogStateMatrix[CurrentState][CurrentColumn];
       }
       if (NewState != CurrentState) {
         StateTransitionFound = 1;
       }
       i++;
     }
-    // Store timestamp of events captured in this cycle
-    if ((nEvents + nCurrentEvents) < MaxTimestamps) {
-      for (int x = 0; x < nCurrentEvents; x++) {
+    // Forward subscribed events to the client (sent by loop())
+    for (int x = 0; x < nCurrentEvents; x++) {
+      if (ForwardMask[CurrentEvent[x] >> 3] & (1 << (CurrentEvent[x] & 7))) {
+        ForwardedEvents.Push(5, CurrentEvent[x]);
+      }
+    }
+    // Store timestamp of events captured in this cycle. Masked events are counted even once the buffer is full.
+    boolean EventsFit = (nEvents + nCurrentEvents) < MaxTimestamps;
+    for (int x = 0; x < nCurrentEvents; x++) {
+      if ((CurrentEvent[x] < 50) && (EventMask[CurrentEvent[x] >> 3] & (1 << (CurrentEvent[x] & 7)))) { // Analog events are always recorded
+        DroppedEvents[EventClass[CurrentEvent[x]]]++;
+      } else if (EventsFit) {
+        Events[nEvents] = CurrentEvent[x];
         TimeStamps[nEvents] = CurrentTime;
         nEvents++;
       }
@@ -569,10 +861,22 @@ void handler() {
         Timer3.stop();
       } else {
         setStateOutputs(NewState);
+        HandlerStartCycles = DWT->CYCCNT - HandlerStartCycles;
+        if (HandlerStartCycles > TransitionCyclesMax) {
+          TransitionCyclesMax = HandlerStartCycles;
+        }
         StateStartTime = CurrentTime;
         CurrentState = NewState;
+        if (nTransition < 1024) {
+          state_visited[nTransition] = CurrentState;
+          nTransition++;
+        }
       }
     }
+    // Advance scheduled waves (including any triggered by this cycle's transition)
+    if (WaveOutputs) {
+      updateWaves();
+    }
 	
 	/* disable sending event during running; send them at the end together
     // Write events captured to USB (if events were captured)
@@ -587,6 +891,268 @@ void handler() {
   } // End running state matrix
 } // End timer handler
 
+boolean scheduleBlockTrial(byte TrialType) {
+  // Append a trial to the block schedule. Returns false, and appends nothing, for a type without a matrix or a full ring.
+  if ((TrialType >= 8) || !BlockMatrixLoaded[TrialType] || ((uint16_t)(BlockTrialsScheduled - BlockTrialIndex) >= 1024)) {
+    return false;
+  }
+  BlockTrialTypes[BlockTrialsScheduled % 1024] = TrialType;
+  BlockTrialsScheduled++;
+  if (TrialType != BlockLastType) {
+    BlockLastType = TrialType;
+    BlockRepeatCount = 1;
+  } else if (BlockRepeatCount < 0xFFFF) {
+    BlockRepeatCount++;
+  }
+  return true;
+}
+
+void removeBlockMatrix(byte TrialType) {
+  // Drop a trial type's matrix image and close the gap in the pool, so re-uploading a type reuses its space
+  if (!BlockMatrixLoaded[TrialType]) {
+    return;
+  }
+  uint16_t Start = BlockMatrixOffset[TrialType];
+  uint16_t Length = BlockMatrixLength[TrialType];
+  memmove(BlockMatrixPool + Start, BlockMatrixPool + Start + Length, BlockPoolUsed - Start - Length);
+  for (int x = 0; x < 8; x++) {
+    if (BlockMatrixLoaded[x] && (BlockMatrixOffset[x] > Start)) {
+      BlockMatrixOffset[x] -= Length;
+    }
+  }
+  BlockMatrixLoaded[TrialType] = 0;
+  BlockPoolUsed -= Length;
+}
+
+void sendBlockTrialSummary() {
+  Serial1.write(3); // Op Code for block trial summary
+  SerialWriteShort(BlockTrialIndex); // Trial number within the block (1 = first)
+  Serial1.write(BlockTrialTypes[(BlockTrialIndex - 1) % 1024]);
+  SerialWriteShort(nEvents);
+  SerialWriteShort(nTransition);
+  Serial1.write(CurrentState); // Last state before exit
+  SerialWriteLong(CurrentTime); // Trial duration (units = timer cycles)
+}
+
+void endBlock() {
+  BlockRunning = false;
+  BlockAborted = false;
+  Serial1.write(4); // Op Code for end of block
+  SerialWriteShort(BlockTrialIndex); // Trials run
+}
+
+void loadStateMatrix(boolean Sparse) {
+  // Reads a state matrix ('P' or 'C' payload) from Serial1, or from memory if MatrixReadPointer is set (block mode)
+  nStates = MatrixReadByte();
+  // Get Input state matrix
+  loadMatrixRows(&InputStateMatrix[0][0], 40, true, Sparse);
+  // Get Output state matrix
+  loadMatrixRows(&OutputStateMatrix[0][0], 19, false, Sparse);
+  // Get global timer matrix
+  loadMatrixRows(&GlobalTimerMatrix[0][0], 5, true, Sparse);
+  // Get global counter matrix
+  loadMatrixRows(&GlobalCounterMatrix[0][0], 5, true, Sparse);
+  // Get global counter attached events
+  for (int x = 0; x < 5; x++) {
+    GlobalCounterAttachedEvents[x] = MatrixReadByte();
+  }
+  // Get input channel configurtaion
+  for (int x = 0; x < 8; x++) {
+    PortInputsEnabled[x] = MatrixReadByte();
+  }
+  for (int x = 0; x < 4; x++) {
+    WireInputsEnabled[x] = MatrixReadByte();
+  }
+
+  // Get state timers
+  for (int x = 0; x < nStates; x++) {
+    StateTimers[x] = MatrixReadLong();
+  }
+  // Get global timers
+  for (int x = 0; x < 5; x++) {
+    GlobalTimers[x] = MatrixReadLong();
+  }
+  // Get global counter event count thresholds
+  for (int x = 0; x < 5; x++) {
+    GlobalCounterThresholds[x] = MatrixReadLong();
+  }
+  // Get event recording mask
+  for (int x = 0; x < 7; x++) {
+    EventMask[x] = MatrixReadByte();
+  }
+  // Analog threshold events cause no transitions until sent with 'A' 'M'
+  for (int x = 0; x < nStates; x++) {
+    for (int y = 0; y < 16; y++) {
+      AnalogStateMatrix[x][y] = x;
+    }
+  }
+  compileOutputPlans();
+}
+
+void initOutputPorts() {
+  // Group the BNC and wire output lines by PIO controller, so a state's lines are set with one write per controller
+  for (int x = 0; x < 6; x++) {
+    int Pin = (x < 2) ? BncOutputLines[x] : WireDigitalOutputLines[x - 2];
+    int Port = 0;
+    while ((Port < nOutputPorts) && (OutputPorts[Port] != g_APinDescription[Pin].pPort)) {
+      Port++;
+    }
+    if (Port == nOutputPorts) {
+      OutputPorts[nOutputPorts] = g_APinDescription[Pin].pPort;
+      nOutputPorts++;
+    }
+    OutputLinePort[x] = Port;
+    OutputLineMask[x] = g_APinDescription[Pin].ulPin;
+    bitSet(OutputPortLines[Port], x);
+  }
+}
+
+void compileOutputPlans() {
+  // Precompute each state's BNC and wire levels as PIO set/clear masks
+  for (int State = 0; State < nStates; State++) {
+    PlanLines[State] = (OutputStateMatrix[State][1] & 3) | ((OutputStateMatrix[State][2] & 15) << 2);
+    for (int x = 0; x < nOutputPorts; x++) {
+      PlanSetMask[State][x] = 0;
+      PlanClearMask[State][x] = 0;
+    }
+    for (int x = 0; x < 6; x++) {
+      if (bitRead(PlanLines[State], x)) {
+        PlanSetMask[State][OutputLinePort[x]] |= OutputLineMask[x];
+      } else {
+        PlanClearMask[State][OutputLinePort[x]] |= OutputLineMask[x];
+      }
+    }
+  }
+}
+
+void loadMatrixRows(byte *Matrix, byte nColumns, boolean SelfDefault, boolean Sparse) {
+  // Dense rows: every entry. Sparse rows: number of pairs, then (column, value) pairs; all other
+  // entries are the state's own number (transition matrices) or 0 (output matrix).
+  for (int x = 0; x < nStates; x++) {
+    byte *Row = Matrix + x * nColumns;
+    if (Sparse) {
+      for (int y = 0; y < nColumns; y++) {
+        Row[y] = SelfDefault ? x : 0;
+      }
+      byte nPairs = MatrixReadByte();
+      for (int i = 0; i < nPairs; i++) {
+        byte Column = MatrixReadByte();
+        byte Value = MatrixReadByte();
+        if (Column < nColumns) {
+          Row[Column] = Value;
+        }
+      }
+    } else {
+      for (int y = 0; y < nColumns; y++) {
+        Row[y] = MatrixReadByte();
+      }
+    }
+  }
+}
+
+void startStateMatrix() {
+  updateStatusLED(3);
+  NewState = 0;
+  CurrentState = 0;
+  nEvents = 0;
+  for (int x = 0; x < 7; x++) {
+    DroppedEvents[x] = 0;
+  }
+  state_visited[0] = CurrentState;
+  nTransition = 1;
+  SoftEvent = 254; // No event
+  VirtualEvents.Clear();
+  ForwardedEvents.Clear();
+  MatrixFinished = false;
+
+  // Reset event counters
+  for (int x = 0; x < 5; x++) {
+    GlobalCounterCounts[x] = 0;
+  }
+  // Read initial state of sensors
+  for (int x = 0; x < 8; x++) {
+    if (PortInputsEnabled[x] == 1) {
+      PortInputLineValue[x] = digitalReadDirect(PortDigitalInputLines[x]); // Read each photogate's current state into an array
+      if (PortInputLineValue[x] == HIGH) {
+        PortInputLineLastKnownStatus[x] = HIGH; // Update last known state of input line
+      } else {
+        PortInputLineLastKnownStatus[x] = LOW;
+      }
+    } else {
+      PortInputLineLastKnownStatus[x] = LOW; PortInputLineValue[x] = LOW;
+    }
+    PortInputLineOverride[x] = false;
+  }
+  for (int x = 0; x < 2; x++) {
+    BNCInputLineValue[x] = digitalReadDirect(BncInputLines[x]);
+    if (BNCInputLineValue[x] == HIGH) {
+      BNCInputLineLastKnownStatus[x] = true;
+    } else {
+      BNCInputLineLastKnownStatus[x] = false;
+    }
+    BNCInputLineOverride[x] = false;
+  }
+  for (int x = 0; x < 4; x++) {
+    if (WireInputsEnabled[x] == 1) {
+      WireInputLineValue[x] = digitalReadDirect(WireDigitalInputLines[x]);
+      if (WireInputLineValue[x] == HIGH) {
+        WireInputLineLastKnownStatus[x] = true;
+      } else {
+        WireInputLineLastKnownStatus[x] = false;
+      }
+    }
+    WireInputLineOverride[x] = false;
+  }
+  // Reset timers
+  MatrixStartTime = 0;
+  StateStartTime = MatrixStartTime;
+  CurrentTime = MatrixStartTime;
+  Sequence.StartTime = MatrixStartTime;
+  MatrixStartTimeMillis = millis();
+  // Adjust outputs, scheduled waves, serial codes and sync port for first state
+  stopWaves();
+  AnalogInput.Restart();
+  setStateOutputs(CurrentState);
+  RunningStateMatrix = 1;
+  Timer3.start(); // Runs every 100us
+}
+
+void configureADC(byte Channels) {
+  // Free-running conversion of the selected port analog lines (12-bit); the timer handler reads the latest result of each
+  ADC->ADC_CHDR = 0xFFFF;
+  if (Channels) {
+    unsigned long ChannelMask = 0;
+    for (int x = 0; x < 8; x++) {
+      if (bitRead(Channels, x)) {
+        bitSet(ChannelMask, AnalogADCChannel[x]);
+      }
+    }
+    ADC->ADC_MR = (ADC->ADC_MR & ~ADC_MR_LOWRES) | ADC_MR_FREERUN_ON;
+    ADC->ADC_CHER = ChannelMask;
+    ADC->ADC_CR = ADC_CR_START;
+  } else {
+    ADC->ADC_MR &= ~ADC_MR_FREERUN_ON;
+  }
+}
+
+void sendAnalogSamples(word MaxSamples) {
+  // 'A', number of samples (whole frames, at most MaxSamples), frames dropped since configured, samples
+  word nSamples = AnalogInput.Available();
+  if (nSamples > MaxSamples) {
+    nSamples = MaxSamples;
+  }
+  if (AnalogInput.nChannels > 0) {
+    nSamples = nSamples - (nSamples % AnalogInput.nChannels);
+  }
+  Serial1.write('A');
+  SerialWriteShort(nSamples);
+  SerialWriteShort(AnalogInput.Overflows);
+  for (int x = 0; x < nSamples; x++) {
+    SerialWriteShort(AnalogInput.Sample(x));
+  }
+  AnalogInput.Release(nSamples);
+}
+
 void SetBNCOutputLines(int BNCState) {
   switch (BNCState) {
     case 0: {
@@ -606,15 +1172,19 @@ void SetBNCOutputLines(int BNCState) {
         digitalWriteDirect(BncOutputLines[1], HIGH);
       } break;
   }
+  if (BNCState < 4) {
+    OutputLines = (OutputLines & ~3) | BNCState;
+  }
 }
-int ValveRegWrite(int value) {
+void ValveRegWrite(int value) {
   // Write to water chip
   SPI.transfer(value);
   digitalWriteDirect(ValveRegisterLatch, HIGH);
   digitalWriteDirect(ValveRegisterLatch, LOW);
+  OutputValves = value;
 }
 
-int SyncRegWrite(int value) {
+void SyncRegWrite(int value) {
   // Write to LED driver chip
   SPI.transfer(value);
   digitalWriteDirect(SyncRegisterLatch, HIGH);
@@ -623,13 +1193,14 @@ int SyncRegWrite(int value) {
 
 void UpdatePWMOutputStates() {
   for (int x = 0; x < 8; x++) {
-    analogWrite(PortPWMOutputLines[x], PortPWMOutputState[x]);
+    writePWMOutput(x, PortPWMOutputState[x]);
   }
 }
 void SetWireOutputLines(int WireState) {
   for (int x = 0; x < 4; x++) {
     digitalWriteDirect(WireDigitalOutputLines[x], bitRead(WireState, x));
   }
+  OutputLines = (OutputLines & 3) | ((WireState & 15) << 2);
 }
 
 void updateStatusLED(int Mode) {
@@ -681,18 +1252,62 @@ void updateStatusLED(int Mode) {
 void setStateOutputs(byte State) {
   byte CurrentTimer = 0; // Used when referring to the timer currently being triggered
   byte CurrentCounter = 0; // Used when referring to the counter currently being reset
-  ValveRegWrite(OutputStateMatrix[State][0]);
-  SetBNCOutputLines(OutputStateMatrix[State][1]);
-  SetWireOutputLines(OutputStateMatrix[State][2]);
+  // Cancel and trigger scheduled waves first, so state outputs skip the lines that waves drive
+  CurrentWave = OutputStateMatrix[State][18];
+  if ((CurrentWave > 0) && (CurrentWave <= nWaves)) {
+    WaveActive[CurrentWave - 1] = false;
+  }
+  CurrentWave = OutputStateMatrix[State][17];
+  if ((CurrentWave > 0) && (CurrentWave <= nWaves)) {
+    CurrentWave = CurrentWave - 1; // Convert to 0 index
+    if (WaveSampleCount[CurrentWave] > 0) {
+      WaveActive[CurrentWave] = true;
+      WavePosition[CurrentWave] = 0;
+      WavePasses[CurrentWave] = 0;
+      WaveNextUpdate[CurrentWave] = CurrentTime;
+    }
+  }
+  updateWaveOutputs();
+  // Write only the outputs that differ from the current ones
+  OutputChanges = 0;
+  byte WaveLines = (WaveOutputs >> 8) & 3; // BNC lines driven by waves
+  if (FullOutputWrites) { // Every output, line by line, as before output plans (for latency comparisons)
+    ValveRegWrite(OutputStateMatrix[State][0]);
+    for (int x = 0; x < 2; x++) {
+      if (!bitRead(WaveLines, x)) {
+        digitalWriteDirect(BncOutputLines[x], bitRead(OutputStateMatrix[State][1], x));
+        bitWrite(OutputLines, x, bitRead(OutputStateMatrix[State][1], x));
+      }
+    }
+    SetWireOutputLines(OutputStateMatrix[State][2]);
+    OutputChanges |= 0x7F & ~(WaveLines << 1);
+  } else {
+    if (OutputStateMatrix[State][0] != OutputValves) {
+      ValveRegWrite(OutputStateMatrix[State][0]);
+      OutputChanges |= 1;
+    }
+    byte ChangedLines = (PlanLines[State] ^ OutputLines) & ~WaveLines;
+    if (ChangedLines) {
+      setPlanLines(State, ChangedLines, WaveLines);
+      OutputChanges |= ChangedLines << 1;
+    }
+  }
   //Serial1.write(OutputStateMatrix[State][3]);
-  Serial2.write(OutputStateMatrix[State][4]);
+  if (FullOutputWrites || (OutputStateMatrix[State][4] > 0)) { // Code 0 = no message
+    Serial2.write(OutputStateMatrix[State][4]);
+    OutputChanges |= 0x8000;
+  }
   if (OutputStateMatrix[State][5] > 0) {
-    Serial1.write(2); // Code for soft-code byte
-    Serial1.write(OutputStateMatrix[State][5]); // Code for soft-code byte
+    ForwardedEvents.Push(2, OutputStateMatrix[State][5]); // Soft code, sent by loop() with op code 2
   }
   for (int x = 0; x < 8; x++) {
-    analogWrite(PortPWMOutputLines[x], OutputStateMatrix[State][x + 9]);
+    if (!bitRead(WaveOutputs, x) && (FullOutputWrites || (OutputStateMatrix[State][x + 9] != OutputPWM[x]))) {
+      writePWMOutput(x, OutputStateMatrix[State][x + 9]);
+      OutputChanges |= 1 << (x + 7);
+    }
   }
+  StateOutputCalls++;
+  OutputWriteCount += __builtin_popcount(OutputChanges);
   // Trigger global timers
   CurrentTimer = OutputStateMatrix[State][6];
   if (CurrentTimer > 0) {
@@ -720,6 +1335,94 @@ void setStateOutputs(byte State) {
   SyncRegWrite((State + 1)); // Output binary state code, corrected for zero index
 }
 
+void setPlanLines(byte State, byte ChangedLines, byte WaveLines) {
+  // One set and one clear write per controller with a changed line. Unchanged lines on that
+  // controller are rewritten at their current level, which leaves them untouched.
+  uint32_t Skip[4] = {0};
+  for (int x = 0; x < 2; x++) {
+    if (bitRead(WaveLines, x)) {
+      Skip[OutputLinePort[x]] |= OutputLineMask[x];
+    }
+  }
+  for (int x = 0; x < nOutputPorts; x++) {
+    if (ChangedLines & OutputPortLines[x]) {
+      OutputPorts[x]->PIO_SODR = PlanSetMask[State][x] & ~Skip[x];
+      OutputPorts[x]->PIO_CODR = PlanClearMask[State][x] & ~Skip[x];
+    }
+  }
+  OutputLines = (OutputLines & WaveLines) | (PlanLines[State] & ~WaveLines);
+}
+
+void writePWMOutput(byte Channel, byte Value) {
+  analogWrite(PortPWMOutputLines[Channel], Value);
+  OutputPWM[Channel] = Value;
+}
+
+void updateWaveOutputs() {
+  // Recompute which output lines are owned by active waves
+  WaveOutputs = 0;
+  for (int x = 0; x < nWaves; x++) {
+    if (WaveActive[x]) {
+      bitSet(WaveOutputs, WaveTarget[x] - 1);
+    }
+  }
+}
+
+void writeWaveOutput(byte Target, byte Value) {
+  if (Target < 9) {
+    writePWMOutput(Target - 1, Value);
+  } else {
+    digitalWriteDirect(BncOutputLines[Target - 9], Value > 0);
+    bitWrite(OutputLines, Target - 9, Value > 0);
+  }
+}
+
+byte stateOutputLevel(byte Target) {
+  // Level the current state sets on a wave target: PWM duty cycle, or 0/1 for BNC lines
+  if (Target < 9) {
+    return OutputStateMatrix[CurrentState][Target + 8];
+  }
+  return bitRead(PlanLines[CurrentState], Target - 9);
+}
+
+void updateWaves() {
+  // Called once per timer cycle while any wave is active. Cost is bounded by one compare per
+  // registered wave plus at most one output write per wave, and only when its sample changes.
+  unsigned long StartCycles = DWT->CYCCNT;
+  byte LastSample = 0;
+  for (int x = 0; x < nWaves; x++) {
+    if (WaveActive[x] && (CurrentTime >= WaveNextUpdate[x])) {
+      if (WavePosition[x] >= WaveSampleCount[x]) {
+        WavePasses[x]++;
+        WavePosition[x] = 0;
+        if ((WaveRepeats[x] > 0) && (WavePasses[x] >= WaveRepeats[x])) {
+          WaveActive[x] = false;
+          writeWaveOutput(WaveTarget[x], stateOutputLevel(WaveTarget[x])); // Back to the current state's output
+          updateWaveOutputs();
+          continue;
+        }
+      }
+      LastSample = (WavePosition[x] > 0) ? WaveSamples[x][WavePosition[x] - 1] : WaveSamples[x][WaveSampleCount[x] - 1];
+      if ((WavePasses[x] == 0 && WavePosition[x] == 0) || (WaveSamples[x][WavePosition[x]] != LastSample)) {
+        writeWaveOutput(WaveTarget[x], WaveSamples[x][WavePosition[x]]);
+      }
+      WaveNextUpdate[x] += WaveHoldTime[x][WavePosition[x] & 1];
+      WavePosition[x]++;
+    }
+  }
+  StartCycles = DWT->CYCCNT - StartCycles;
+  if (StartCycles > WaveCyclesMax) {
+    WaveCyclesMax = StartCycles;
+  }
+}
+
+void stopWaves() {
+  for (int x = 0; x < MaxWaves; x++) {
+    WaveActive[x] = false;
+  }
+  WaveOutputs = 0;
+}
+
 void manualOverrideOutputs() {
   byte OutputType = 0;
   OutputType = SerialReadByte();
@@ -753,6 +1456,82 @@ void manualOverrideOutputs() {
   }
 }
 
+void setVirtualEvent(byte Target, byte Data) {
+  switch (Target) {
+    case 'P': // Virtual poke PortInputLineLastKnownStatus
+      if (PortInputLineLastKnownStatus[Data] == LOW) {
+        PortInputLineValue[Data] = HIGH;
+        PortInputLineOverride[Data] = true;
+      } else {
+        PortInputLineValue[Data] = LOW;
+        PortInputLineOverride[Data] = false;
+      }
+      break;
+    case 'B': // Virtual BNC input
+      if (BNCInputLineLastKnownStatus[Data] == LOW) {
+        BNCInputLineValue[Data] = HIGH;
+        BNCInputLineOverride[Data] = true;
+      } else {
+        BNCInputLineValue[Data] = LOW;
+        BNCInputLineOverride[Data] = false;
+      }
+      break;
+    case 'W': // Virtual Wire input
+      if (WireInputLineLastKnownStatus[Data] == LOW) {
+        WireInputLineValue[Data] = HIGH;
+        WireInputLineOverride[Data] = true;
+      } else {
+        WireInputLineValue[Data] = LOW;
+        WireInputLineOverride[Data] = false;
+      }
+      break;
+    case 'S':  // Soft event
+      SoftEvent = Data;
+      break;
+  }
+}
+
+void sendForwardedEvents() {
+  // Write soft codes and forwarded events queued by the timer handler: op code (2 = soft code, 5 = event), code.
+  // Only loop() writes to Serial1, so these never split a reply.
+  VirtualEvent Record;
+  while (ForwardedEvents.Peek(Record)) {
+    Serial1.write(Record.Target);
+    Serial1.write(Record.Data);
+    ForwardedEvents.Pop();
+  }
+}
+
+void applyVirtualEvents() {
+  // Apply queued virtual events in order: up to VirtualEventBudget per cycle, and at most one per input line
+  // (and one soft event), since a second change in the same cycle would merge with the first. Lines already changed
+  // by a sequence step this cycle count as used. The rest wait.
+  VirtualLines.ApplyQueue(VirtualEvents, VirtualEventBudget, setVirtualEvent);
+}
+
+void runSequence() {
+  // Execute all sequence steps whose offset has elapsed. Called from the timer handler, before applyVirtualEvents.
+  // A virtual event on a line another step already changed this cycle waits for the next cycle (with the steps
+  // after it), as queued events do.
+  VirtualLines.RunSequence(Sequence, CurrentTime, executeSequenceStep);
+}
+
+void executeSequenceStep(byte Command, byte Target, byte Data) {
+  switch (Command) {
+    case 'V': // Virtual event
+      setVirtualEvent(Target, Data);
+      break;
+    case 'O': // Output override
+      switch (Target) {
+        case 'V': ValveRegWrite(Data); break;
+        case 'B': SetBNCOutputLines(Data); break;
+        case 'W': SetWireOutputLines(Data); break;
+        case 'T': Serial2.write(Data); break;
+      }
+      break;
+  }
+}
+
 void digitalWriteDirect(int pin, boolean val) {
   if (val) g_APinDescription[pin].pPort -> PIO_SODR = g_APinDescription[pin].ulPin;
   else    g_APinDescription[pin].pPort -> PIO_CODR = g_APinDescription[pin].ulPin;
@@ -787,6 +1566,30 @@ unsigned long SerialReadLong() {
   return LongInt;
 }
 
+word SerialReadShort() {
+  while (Serial1.available() == 0) {}
+  LowByte = Serial1.read();
+  while (Serial1.available() == 0) {}
+  SecondByte = Serial1.read();
+  return word(SecondByte, LowByte);
+}
+
+byte MatrixReadByte() {
+  if (MatrixReadPointer) {
+    return *MatrixReadPointer++;
+  }
+  return SerialReadByte();
+}
+
+unsigned long MatrixReadLong() {
+  if (MatrixReadPointer) {
+    LongInt = (unsigned long)MatrixReadPointer[0] | ((unsigned long)MatrixReadPointer[1] << 8) | ((unsigned long)MatrixReadPointer[2] << 16) | ((unsigned long)MatrixReadPointer[3] << 24);
+    MatrixReadPointer += 4;
+    return LongInt;
+  }
+  return SerialReadLong();
+}
+
 byte SerialReadByte() {
   while (Serial1.available() == 0) {}
   LowByte = Serial1.read();
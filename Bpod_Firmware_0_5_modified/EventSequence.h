@@ -0,0 +1,78 @@
+/*
+   EventSequence.h - Scripted sequence of virtual events and output overrides ('Q' op code), replayed by the timer
+   handler at exact cycle offsets from its start. loop() loads the steps between trials; the timer handler steps
+   through them. Steps are checked as they are loaded: offsets must not decrease (the handler stops at the first
+   step not yet due) and virtual events must name a valid line (see VirtualEventLine).
+   Plain C++: also built on the host by extras/ApodHost/apod_sequence_sim.cpp.
+   Released into the public domain.
+*/
+
+#ifndef EventSequence_h
+#define EventSequence_h
+
+#include <stdint.h>
+#include "VirtualEventQueue.h"
+
+template <int MaxSteps> // At most 255
+class EventSequence {
+  public:
+    uint32_t Time[MaxSteps];   // Step offsets (timer cycles since the sequence started)
+    uint8_t Command[MaxSteps]; // 'V' = virtual event, 'O' = output override
+    uint8_t Target[MaxSteps];  // 'P', 'B', 'W', 'S' for 'V'; 'V', 'B', 'W', 'T' for 'O'
+    uint8_t Data[MaxSteps];
+    uint8_t nSteps;            // Steps loaded
+    uint8_t Position;          // Next step to execute
+    volatile bool Running;
+    uint32_t StartTime;        // Timer cycle the sequence started on
+
+    EventSequence() : nSteps(0), Position(0), Running(false), StartTime(0) {}
+
+    // Stop and drop all steps (before loading a new sequence)
+    void Clear() {
+      Running = false;
+      nSteps = 0;
+    }
+
+    // Append a step. Returns false, and stores nothing, if the sequence is full, the offset is earlier than the
+    // previous step's, or the step is invalid.
+    bool Add(uint32_t StepTime, uint8_t StepCommand, uint8_t StepTarget, uint8_t StepData) {
+      if ((nSteps >= MaxSteps) || ((nSteps > 0) && (StepTime < Time[nSteps - 1]))) {
+        return false;
+      }
+      if (StepCommand == 'V') {
+        if (VirtualEventLine(StepTarget, StepData) == VirtualEventInvalid) {
+          return false;
+        }
+      } else if ((StepCommand != 'O') ||
+                 ((StepTarget != 'V') && (StepTarget != 'B') && (StepTarget != 'W') && (StepTarget != 'T'))) {
+        return false;
+      }
+      Time[nSteps] = StepTime;
+      Command[nSteps] = StepCommand;
+      Target[nSteps] = StepTarget;
+      Data[nSteps] = StepData;
+      nSteps++;
+      return true;
+    }
+
+    // Replay from the first step, offsets counting from Now
+    void Start(uint32_t Now) {
+      Position = 0;
+      StartTime = Now;
+      Running = (nSteps > 0);
+    }
+
+    // Timer handler: is the step at Position due on cycle Now? Execute it, then Advance().
+    bool Due(uint32_t Now) const {
+      return Running && (Now - StartTime >= Time[Position]);
+    }
+
+    void Advance() {
+      Position++;
+      if (Position >= nSteps) {
+        Running = false;
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,67 @@
+/*
+   VirtualEventLines.h - Per-cycle budget of virtual event changes in the timer handler. A line changed twice in one
+   cycle would merge both changes into one (or overwrite the soft event), so each input line (VirtualEventLine) takes
+   at most one change per cycle, shared by the sequence steps (runSequence) and the queued events
+   (applyVirtualEvents). A change on a line already used waits for the next cycle, and so does everything behind it.
+   Plain C++: also built on the host by extras/ApodHost/apod_queue_stress.cpp and apod_sequence_sim.cpp.
+   Released into the public domain.
+*/
+
+#ifndef VirtualEventLines_h
+#define VirtualEventLines_h
+
+#include <stdint.h>
+#include "VirtualEventQueue.h"
+#include "EventSequence.h"
+
+class VirtualEventLines {
+  public:
+    uint32_t Used; // Bit per VirtualEventLine changed this cycle: 0-7 = ports, 8-9 = BNC, 10-13 = wire, 14 = soft event
+
+    VirtualEventLines() : Used(0) {}
+
+    // Start of a timer cycle
+    void Clear() {
+      Used = 0;
+    }
+
+    // Take the line of a (checked) virtual event for this cycle. Returns false if it was already changed.
+    bool Claim(uint8_t Target, uint8_t Data) {
+      uint32_t Bit = 1UL << VirtualEventLine(Target, Data);
+      if (Used & Bit) {
+        return false;
+      }
+      Used |= Bit;
+      return true;
+    }
+
+    // Execute the sequence steps due on cycle Now: Execute(Command, Target, Data). Stops at a virtual event whose
+    // line is taken; it is retried on the next cycle.
+    template <int MaxSteps, class StepFunction>
+    void RunSequence(EventSequence<MaxSteps>& Sequence, uint32_t Now, StepFunction Execute) {
+      while (Sequence.Due(Now)) {
+        uint8_t Position = Sequence.Position;
+        if ((Sequence.Command[Position] == 'V') && !Claim(Sequence.Target[Position], Sequence.Data[Position])) {
+          return;
+        }
+        Execute(Sequence.Command[Position], Sequence.Target[Position], Sequence.Data[Position]);
+        Sequence.Advance();
+      }
+    }
+
+    // Apply queued virtual events in order, up to Budget this cycle: Apply(Target, Data). Stops at an event whose
+    // line is taken. Returns the number applied.
+    template <int Size, class EventFunction>
+    uint8_t ApplyQueue(VirtualEventQueue<Size>& Queue, uint8_t Budget, EventFunction Apply) {
+      VirtualEvent Record;
+      uint8_t nApplied = 0;
+      while ((nApplied < Budget) && Queue.Peek(Record) && Claim(Record.Target, Record.Data)) {
+        Apply(Record.Target, Record.Data);
+        Queue.Pop();
+        nApplied++;
+      }
+      return nApplied;
+    }
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+   VirtualEventQueue.h - Bounded lock-free single-producer/single-consumer ring carrying virtual events
+   from loop() (producer: serial commands) to the timer handler (consumer). The firmware also uses one the
+   other way round, for soft codes and forwarded events from the timer handler to loop().
+   The producer only writes Head, the consumer only writes Tail; both are free-running 8-bit counters,
+   so every access is a single byte load or store. Plain C++: also built on the host by
+   extras/ApodHost/apod_queue_stress.cpp.
+   Released into the public domain.
+*/
+
+#ifndef VirtualEventQueue_h
+#define VirtualEventQueue_h
+
+#include <stdint.h>
+
+struct VirtualEvent {
+  uint8_t Target; // 'P' (port), 'B' (BNC), 'W' (wire) or 'S' (soft event), as for the 'V' op code; op code when forwarding
+  uint8_t Data;   // Line index, or soft event number; soft code or event code when forwarding
+};
+
+const uint8_t VirtualEventInvalid = 0xFF; // VirtualEventLine() of an event with an unknown target or out-of-range data
+
+// Input line changed by a virtual event: 0-7 = ports, 8-9 = BNC, 10-13 = wire, 14 = soft event (1-10, codes 28-37).
+// The firmware indexes its line arrays with Data, so events are checked with this before they are queued or stored.
+inline uint8_t VirtualEventLine(uint8_t Target, uint8_t Data) {
+  switch (Target) {
+    case 'P': return (Data < 8) ? Data : VirtualEventInvalid;
+    case 'B': return (Data < 2) ? 8 + Data : VirtualEventInvalid;
+    case 'W': return (Data < 4) ? 10 + Data : VirtualEventInvalid;
+    case 'S': return ((Data >= 1) && (Data <= 10)) ? 14 : VirtualEventInvalid;
+    default: return VirtualEventInvalid;
+  }
+}
+
+template <int Size> // Power of 2, at most 128
+class VirtualEventQueue {
+  public:
+    volatile uint8_t Head;      // Next slot to fill (producer)
+    volatile uint8_t Tail;      // Next slot to apply (consumer)
+    volatile uint16_t Overflows; // Events refused because the ring was full (producer, saturates)
+
+    VirtualEventQueue() : Head(0), Tail(0), Overflows(0) {}
+
+    // Producer side. Returns false (and counts an overflow) if the ring is full.
+    bool Push(uint8_t Target, uint8_t Data) {
+      uint8_t h = Head;
+      if ((uint8_t)(h - Tail) >= Size) {
+        if (Overflows < 0xFFFF) {
+          Overflows++;
+        }
+        return false;
+      }
+      Records[h & (Size - 1)].Target = Target;
+      Records[h & (Size - 1)].Data = Data;
+      __sync_synchronize(); // Record is written before it is published
+      Head = h + 1;
+      return true;
+    }
+
+    // Consumer side: look at the oldest record without removing it
+    bool Peek(VirtualEvent &Record) {
+      uint8_t t = Tail;
+      if (t == Head) {
+        return false;
+      }
+      __sync_synchronize(); // Head is read before the record
+      Record.Target = Records[t & (Size - 1)].Target;
+      Record.Data = Records[t & (Size - 1)].Data;
+      return true;
+    }
+
+    // Consumer side: remove the record returned by Peek
+    void Pop() {
+      __sync_synchronize(); // Record is read before the slot is released
+      Tail = Tail + 1;
+    }
+
+    // Drop everything queued; only while the consumer is stopped
+    void Clear() {
+      Tail = Head;
+      Overflows = 0;
+    }
+
+  private:
+    VirtualEvent Records[Size];
+};
+
+#endif
@@ -0,0 +1,300 @@
+/*
+   ApodEngine.h - Host-side model of the Bpod state machine in Bpod_Firmware_0_5_modified.
+   Parses the state matrix bytes built by Apod::SendStateMatrix and steps the firmware's
+   timer handler semantics (event order, global timers/counters, Tup) one 0.1 ms cycle at a time.
+   The cycle logic is in free functions (ApodAddCycleEvents, ApodFindTransition, ApodRecordEvents,
+   ApodEnterState) shared by ApodEngine and apod_batch's structure-of-arrays stepper.
+   Used by the host tools in this folder; plain C++11, no Arduino dependencies.
+   Released into the public domain.
+*/
+
+#ifndef ApodEngine_h
+#define ApodEngine_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+const int ApodMaxStates = 128;
+const int ApodMaxEvents = 10000;      // Size of the firmware TimeStamps/Events buffers
+const int ApodMaxTransitions = 1024;  // Size of the firmware state_visited buffer
+const uint8_t ApodNoEvent = 254;
+const int ApodMaxCycleInputs = 23;    // Input events per cycle: one per port (8), BNC (2) and wire (4) line, a soft event, one per analog channel (8)
+const int ApodMaxCycleEvents = 34;    // Size of the firmware CurrentEvent buffer: inputs, 5 timers, 5 counters, Tup
+const int ApodEventClasses = 7;       // Ports, BNC, wire, soft codes, Tup, global timers, global counters
+
+// Event class of an event code (index of the firmware DroppedEvents counters)
+inline int ApodEventClass(uint8_t Code) {
+  return Code < 16 ? 0 : Code < 20 ? 1 : Code < 28 ? 2 : Code < 39 ? 3 : Code == 39 ? 4 : Code < 45 ? 5 : 6;
+}
+
+// State matrix as held by the firmware after a 'P' upload
+struct ApodMatrix {
+  int nStates;
+  uint8_t InputMatrix[ApodMaxStates][40];
+  uint8_t OutputMatrix[ApodMaxStates][19];
+  uint8_t GlobalTimerMatrix[ApodMaxStates][5];
+  uint8_t GlobalCounterMatrix[ApodMaxStates][5];
+  uint8_t GlobalCounterAttachedEvents[5];
+  uint8_t PortInputsEnabled[8];
+  uint8_t WireInputsEnabled[4];
+  uint32_t StateTimers[ApodMaxStates];
+  uint32_t GlobalTimers[5];
+  uint32_t GlobalCounterThresholds[5];
+  uint8_t EventMask[7];  // Events not recorded (bit per event code); all zero if the image has no mask
+  uint8_t AnalogMatrix[ApodMaxStates][16];  // Transitions for analog threshold events 50-65 ('A' 'M'); self after a matrix upload
+
+  bool Recorded(uint8_t Code) const {
+    return Code >= 50 || !(EventMask[Code >> 3] & (1 << (Code & 7)));
+  }
+};
+
+// Read nStates rows of a state matrix, dense ('P') or as (column, value) pairs ('C'). Returns false if Data runs out.
+inline bool ApodParseMatrixRows(const uint8_t* Data, size_t Length, size_t& Index, uint8_t* Matrix, int nColumns,
+                                int nStates, bool SelfDefault, bool Sparse) {
+  for (int x = 0; x < nStates; x++) {
+    uint8_t* Row = Matrix + x * nColumns;
+    if (!Sparse) {
+      if (Index + nColumns > Length) {
+        return false;
+      }
+      memcpy(Row, Data + Index, nColumns); Index += nColumns;
+      continue;
+    }
+    memset(Row, SelfDefault ? x : 0, nColumns);
+    if (Index + 1 > Length || Index + 1 + 2 * (size_t)Data[Index] > Length) {
+      return false;
+    }
+    int nPairs = Data[Index++];
+    for (int i = 0; i < nPairs; i++) {
+      if (Data[Index] < nColumns) {
+        Row[Data[Index]] = Data[Index + 1];
+      }
+      Index += 2;
+    }
+  }
+  return true;
+}
+
+// Parse a 'P' or 'C' image (op code included), with or without the trailing event mask.
+// Returns the number of bytes consumed, or -1 if malformed.
+inline int ApodParseStateMatrix(const uint8_t* Data, size_t Length, ApodMatrix& M) {
+  size_t Index = 0;
+  if (Length < 2 || (Data[0] != 'P' && Data[0] != 'C')) {
+    return -1;
+  }
+  bool Sparse = (Data[Index++] == 'C');
+  M.nStates = Data[Index++];
+  if (M.nStates > ApodMaxStates) {
+    return -1;
+  }
+  if (!ApodParseMatrixRows(Data, Length, Index, &M.InputMatrix[0][0], 40, M.nStates, true, Sparse) ||
+      !ApodParseMatrixRows(Data, Length, Index, &M.OutputMatrix[0][0], 19, M.nStates, false, Sparse) ||
+      !ApodParseMatrixRows(Data, Length, Index, &M.GlobalTimerMatrix[0][0], 5, M.nStates, true, Sparse) ||
+      !ApodParseMatrixRows(Data, Length, Index, &M.GlobalCounterMatrix[0][0], 5, M.nStates, true, Sparse) ||
+      Index + 17 + 4 * ((size_t)M.nStates + 10) > Length) {
+    return -1;
+  }
+  memcpy(M.GlobalCounterAttachedEvents, Data + Index, 5); Index += 5;
+  memcpy(M.PortInputsEnabled, Data + Index, 8); Index += 8;
+  memcpy(M.WireInputsEnabled, Data + Index, 4); Index += 4;
+  uint32_t* Longs[3] = {M.StateTimers, M.GlobalTimers, M.GlobalCounterThresholds};
+  int nLongs[3] = {M.nStates, 5, 5};
+  for (int i = 0; i < 3; i++) {
+    for (int x = 0; x < nLongs[i]; x++) {
+      Longs[i][x] = (uint32_t)Data[Index] | ((uint32_t)Data[Index + 1] << 8) | ((uint32_t)Data[Index + 2] << 16) | ((uint32_t)Data[Index + 3] << 24);
+      Index += 4;
+    }
+  }
+  memset(M.EventMask, 0, 7);
+  if (Index + 7 <= Length) {
+    memcpy(M.EventMask, Data + Index, 7); Index += 7;
+  }
+  for (int x = 0; x < M.nStates; x++) {
+    memset(M.AnalogMatrix[x], x, 16);
+  }
+  return (int)Index;
+}
+
+// Parse the analog threshold transitions sent after a matrix ('A' op code payload: 'M' + sparse rows for M.nStates).
+// Returns false if malformed.
+inline bool ApodParseAnalogMatrix(const uint8_t* Data, size_t Length, ApodMatrix& M) {
+  size_t Index = 1;
+  return Length >= 1 && Data[0] == 'M' &&
+         ApodParseMatrixRows(Data, Length, Index, &M.AnalogMatrix[0][0], 16, M.nStates, true, true);
+}
+
+// Global timer and counter state of one state machine. Timer x is at index x * Stride: 1 for ApodEngine, the
+// number of sessions for apod_batch's timer-major arrays.
+struct ApodTimerState {
+  uint8_t* Active;
+  uint32_t* End;
+  uint32_t* Counts;
+  size_t Stride;
+};
+
+// Append the global timer, global counter (crossing reported on the next cycle) and Tup events of cycle Now to the
+// nEvent input events already in Event, in the firmware's order. Returns the new number of events.
+inline int ApodAddCycleEvents(const ApodMatrix& M, uint32_t Now, int State, uint32_t StateStart, bool Meaningful,
+                              const ApodTimerState& T, uint8_t* Event, int nEvent) {
+  for (int x = 0; x < 5; x++) {
+    if (T.Active[x * T.Stride] && Now >= T.End[x * T.Stride]) {
+      Event[nEvent++] = 40 + x;
+      T.Active[x * T.Stride] = 0;
+    }
+  }
+  for (int x = 0; x < 5; x++) {
+    if (M.GlobalCounterAttachedEvents[x] < ApodNoEvent) {
+      if (T.Counts[x * T.Stride] == M.GlobalCounterThresholds[x]) {
+        Event[nEvent++] = 45 + x;
+      }
+      for (int i = 0; i < nEvent; i++) {
+        T.Counts[x * T.Stride] += (Event[i] == M.GlobalCounterAttachedEvents[x]);
+      }
+    }
+  }
+  if (Meaningful && (Now - StateStart >= M.StateTimers[State])) {
+    Event[nEvent++] = 39;
+  }
+  return nEvent;
+}
+
+// State entered after the events of a cycle: the first event linked to a state transition takes priority
+inline int ApodFindTransition(const ApodMatrix& M, int State, const uint8_t* Event, int nEvent) {
+  for (int i = 0; i < nEvent; i++) {
+    uint8_t Code = Event[i];
+    int NewState = State;
+    if (Code < 40) {
+      NewState = M.InputMatrix[State][Code];
+    } else if (Code < 45) {
+      NewState = M.GlobalTimerMatrix[State][Code - 40];
+    } else if (Code < 50) {
+      NewState = M.GlobalCounterMatrix[State][Code - 45];
+    } else if (Code < 66) {
+      NewState = M.AnalogMatrix[State][Code - 50];
+    }
+    if (NewState != State) {
+      return NewState;
+    }
+  }
+  return State;
+}
+
+// Add the events of cycle Now to a trial record capped like the firmware buffers: events the mask excludes are counted
+// per class in Dropped, also once the buffers are full. Events and TimeStamps may be 0 to count only. Returns false if
+// the cycle's events did not fit.
+template <class Size, class Count>
+inline bool ApodRecordEvents(const ApodMatrix& M, const uint8_t* Event, int nEvent, uint32_t Now, uint8_t* Events,
+                             uint32_t* TimeStamps, Size& nEvents, Count* Dropped) {
+  bool Fit = nEvents + nEvent < (Size)ApodMaxEvents;
+  for (int i = 0; i < nEvent; i++) {
+    if (!M.Recorded(Event[i])) {
+      Dropped[ApodEventClass(Event[i])]++;
+    } else if (Fit) {
+      if (Events) {
+        Events[nEvents] = Event[i];
+        TimeStamps[nEvents] = Now;
+      }
+      nEvents++;
+    }
+  }
+  return Fit;
+}
+
+// The timing-relevant part of the firmware setStateOutputs() on entering State at cycle Now.
+// Returns whether the state's timer can cause a transition (MeaningfulStateTimer).
+inline bool ApodEnterState(const ApodMatrix& M, int State, uint32_t Now, const ApodTimerState& T) {
+  const uint8_t* Out = M.OutputMatrix[State];
+  if (Out[6] > 0) {
+    T.Active[(Out[6] - 1) * T.Stride] = 1;
+    T.End[(Out[6] - 1) * T.Stride] = Now + M.GlobalTimers[Out[6] - 1];
+  }
+  if (Out[7] > 0) {
+    T.Active[(Out[7] - 1) * T.Stride] = 0;
+  }
+  if (Out[8] > 0) {
+    T.Counts[(Out[8] - 1) * T.Stride] = 0;
+  }
+  return M.InputMatrix[State][39] != State;
+}
+
+// One state machine, stepped like the firmware handler()
+class ApodEngine {
+  public:
+    const ApodMatrix* M;
+    uint32_t CurrentTime;
+    int CurrentState;
+    bool Finished;
+    uint8_t CurrentEvent[ApodMaxCycleEvents];  // Events of the last cycle: inputs, then timers, counters, Tup
+    int nCurrentEvents;
+    // Trial record, capped like the firmware buffers
+    uint8_t Events[ApodMaxEvents];
+    uint32_t TimeStamps[ApodMaxEvents];
+    int nEvents;
+    uint8_t StateVisited[ApodMaxTransitions];
+    int nTransition;
+    uint16_t DroppedEvents[ApodEventClasses];  // Events not recorded because of the event mask
+
+    // startStateMatrix(): enter state 0 at time 0
+    void Start(const ApodMatrix* Matrix) {
+      M = Matrix;
+      CurrentTime = 0;
+      StateStartTime = 0;
+      CurrentState = 0;
+      Finished = false;
+      nEvents = 0;
+      memset(DroppedEvents, 0, sizeof(DroppedEvents));
+      StateVisited[0] = 0;
+      nTransition = 1;
+      for (int x = 0; x < 5; x++) {
+        GlobalCounterCounts[x] = 0;
+        GlobalTimersActive[x] = 0;
+      }
+      MeaningfulStateTimer = ApodEnterState(*M, 0, CurrentTime, Timers());
+    }
+
+    // One timer cycle. Inputs are the port/BNC/wire/soft event codes (0-38) and analog threshold events (50-65)
+    // detected on this cycle, in the firmware's detection order (at most ApodMaxCycleInputs, the firmware's line
+    // count; more are ignored). Returns false once the matrix has exited.
+    bool Tick(const uint8_t* Inputs, int nInputs) {
+      if (Finished) {
+        return false;
+      }
+      CurrentTime++;
+      nCurrentEvents = 0;
+      for (int i = 0; i < nInputs && nCurrentEvents < ApodMaxCycleInputs; i++) {
+        CurrentEvent[nCurrentEvents++] = Inputs[i];
+      }
+      nCurrentEvents = ApodAddCycleEvents(*M, CurrentTime, CurrentState, StateStartTime, MeaningfulStateTimer, Timers(),
+                                          CurrentEvent, nCurrentEvents);
+      int NewState = ApodFindTransition(*M, CurrentState, CurrentEvent, nCurrentEvents);
+      ApodRecordEvents(*M, CurrentEvent, nCurrentEvents, CurrentTime, Events, TimeStamps, nEvents, DroppedEvents);
+      if (NewState != CurrentState) {
+        if (NewState == M->nStates) {
+          Finished = true;
+        } else {
+          MeaningfulStateTimer = ApodEnterState(*M, NewState, CurrentTime, Timers());
+          StateStartTime = CurrentTime;
+          CurrentState = NewState;
+          if (nTransition < ApodMaxTransitions) {
+            StateVisited[nTransition++] = CurrentState;
+          }
+        }
+      }
+      return !Finished;
+    }
+
+  private:
+    uint32_t StateStartTime;
+    bool MeaningfulStateTimer;
+    uint8_t GlobalTimersActive[5];
+    uint32_t GlobalTimerEnd[5];
+    uint32_t GlobalCounterCounts[5];
+
+    ApodTimerState Timers() {
+      ApodTimerState T = {GlobalTimersActive, GlobalTimerEnd, GlobalCounterCounts, 1};
+      return T;
+    }
+};
+
+#endif
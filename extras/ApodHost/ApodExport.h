@@ -0,0 +1,193 @@
+/*
+   ApodExport.h - Reader for columnar trial exports written by Apod::StartExport (format in Apod.cpp).
+   The file is mmap'ed read-only; trials are views into the mapping (no copies), indexed from the chunk
+   footers so any trial can be reached directly. Linux/POSIX, plain C++11.
+   Released into the public domain.
+*/
+
+#ifndef ApodExport_h
+#define ApodExport_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// One trial, pointing into the mapped file
+struct ApodTrialView {
+  uint32_t TrialNumber;      // 0 = first trial of the export
+  uint16_t nEvents;
+  uint16_t nTransition;
+  const uint8_t* Events;     // nEvents event codes
+  const uint8_t* Deltas;     // LEB128 time stamp deltas (0.1 ms ticks), DeltaBytes long
+  uint32_t DeltaBytes;
+  const uint8_t* States;     // nTransition states visited
+
+  // Decode the time stamp column into TimeStamps (nEvents entries). Returns false if the column is malformed.
+  bool TimeStamps(uint32_t* TimeStamps) const {
+    const uint8_t* p = Deltas;
+    const uint8_t* End = Deltas + DeltaBytes;
+    uint32_t Time = 0;
+    for (int i = 0; i < nEvents; i++) {
+      uint32_t Delta = 0;
+      int Shift = 0;
+      do {
+        if (p == End || Shift > 28) {
+          return false;
+        }
+        Delta |= (uint32_t)(*p & 0x7F) << Shift;
+        Shift += 7;
+      } while (*p++ & 0x80);
+      Time += Delta;
+      TimeStamps[i] = Time;
+    }
+    return true;
+  }
+};
+
+class ApodExportReader {
+  public:
+    ApodExportReader() : Data(0), Size(0), Truncated(false) {}
+    ~ApodExportReader() { Close(); }
+
+    // Map Path and index its trials. Returns false if the file cannot be opened or is not an export.
+    bool Open(const char* Path) {
+      Close();
+      int File = open(Path, O_RDONLY);
+      if (File < 0) {
+        return false;
+      }
+      struct stat Info;
+      if (fstat(File, &Info) != 0 || Info.st_size < 5) {
+        close(File);
+        return false;
+      }
+      void* Map = mmap(0, Info.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+      close(File);
+      if (Map == MAP_FAILED) {
+        return false;
+      }
+      Data = (const uint8_t*)Map;
+      Size = Info.st_size;
+      madvise(Map, Size, MADV_SEQUENTIAL);
+      if (memcmp(Data, "APDX", 4) != 0 || Data[4] != 1 || !Index()) {
+        Close();
+        return false;
+      }
+      return true;
+    }
+
+    void Close() {
+      if (Data) {
+        munmap((void*)Data, Size);
+      }
+      Data = 0;
+      Size = 0;
+      Trials.clear();
+      Truncated = false;
+    }
+
+    size_t nTrials() const { return Trials.size(); }
+    size_t FileSize() const { return Size; }
+    bool WasTruncated() const { return Truncated; } // The last chunk had no footer (export not stopped)
+    const ApodTrialView& Trial(size_t i) const { return Trials[i]; }
+    std::vector<ApodTrialView>::const_iterator begin() const { return Trials.begin(); }
+    std::vector<ApodTrialView>::const_iterator end() const { return Trials.end(); }
+
+  private:
+    const uint8_t* Data;
+    size_t Size;
+    bool Truncated;
+    std::vector<ApodTrialView> Trials;
+
+    static uint32_t Long(const uint8_t* p) {
+      return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    // Parse the trial at Offset; returns its length, or 0 if it does not fit in Limit
+    size_t ParseTrial(size_t Offset, size_t Limit, uint32_t TrialNumber, ApodTrialView& View) const {
+      if (Offset + 9 > Limit || Data[Offset] != 'T') {
+        return 0;
+      }
+      const uint8_t* p = Data + Offset;
+      View.TrialNumber = TrialNumber;
+      View.nEvents = p[1] | (p[2] << 8);
+      View.nTransition = p[3] | (p[4] << 8);
+      View.DeltaBytes = Long(p + 5);
+      size_t Length = 9 + (size_t)View.nEvents + View.DeltaBytes + View.nTransition;
+      if (Offset + Length > Limit) {
+        return 0;
+      }
+      View.Events = p + 9;
+      View.Deltas = View.Events + View.nEvents;
+      View.States = View.Deltas + View.DeltaBytes;
+      return Length;
+    }
+
+    bool Index() {
+      // Walk the chunk footers back from the end of the file
+      std::vector<size_t> Chunks;
+      size_t End = Size;
+      while (End >= 5 + 8 && memcmp(Data + End - 4, "APDF", 4) == 0) {
+        uint32_t Length = Long(Data + End - 8);
+        if (Length < 14 || Length > End - 5 || Data[End - Length] != 'C') {
+          break;
+        }
+        Chunks.push_back(End - Length);
+        End -= Length;
+      }
+      if (End != 5) {
+        return ScanForward(); // No footer at the end: the export was not stopped
+      }
+      for (size_t c = Chunks.size(); c-- > 0;) {
+        size_t Start = Chunks[c];
+        size_t ChunkEnd = (c > 0) ? Chunks[c - 1] : Size;
+        uint32_t FirstTrial = Long(Data + Start + 1);
+        int n = Data[ChunkEnd - 10] | (Data[ChunkEnd - 9] << 8);
+        size_t Footer = ChunkEnd - 10 - 4 * (size_t)n;
+        if (Footer < Start + 5 + 1 || Data[Footer - 1] != 'F') {
+          return false;
+        }
+        for (int i = 0; i < n; i++) {
+          ApodTrialView View;
+          if (!ParseTrial(Start + Long(Data + Footer + 4 * i), Footer - 1, FirstTrial + i, View)) {
+            return false;
+          }
+          Trials.push_back(View);
+        }
+      }
+      return true;
+    }
+
+    bool ScanForward() {
+      // Sequential parse from the file header, keeping every complete trial
+      Truncated = true;
+      Trials.clear();
+      size_t Pos = 5;
+      uint32_t TrialNumber = 0;
+      while (Pos + 5 <= Size && Data[Pos] == 'C') {
+        TrialNumber = Long(Data + Pos + 1);
+        size_t ChunkStart = Pos;
+        Pos += 5;
+        ApodTrialView View;
+        size_t Length;
+        while ((Length = ParseTrial(Pos, Size, TrialNumber, View)) > 0) {
+          Trials.push_back(View);
+          TrialNumber++;
+          Pos += Length;
+        }
+        if (Pos >= Size || Data[Pos] != 'F') {
+          break; // End of the written data
+        }
+        int n = (int)(TrialNumber - Long(Data + ChunkStart + 1));
+        Pos += 1 + 4 * (size_t)n + 2 + 8;
+      }
+      return true;
+    }
+};
+
+#endif
@@ -0,0 +1,95 @@
+/*
+   Arduino.h - The parts of the Arduino core that Apod.cpp uses, for building the library on a PC
+   (extras/ApodHost/apod_bench.cpp). Add this folder with -iquote so that only Apod's "Arduino.h" and
+   "String.h" includes resolve here. Streams are plain in-memory objects; SerialUSB prints to stderr.
+   Plain C++11.
+   Released into the public domain.
+*/
+
+#ifndef ArduinoHost_h
+#define ArduinoHost_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include "String.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define PROGMEM
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+template <class T> T min(T a, T b) { return a < b ? a : b; }
+template <class T> T max(T a, T b) { return a > b ? a : b; }
+
+inline unsigned long micros() {
+  static const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Start).count();
+}
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+inline void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+inline long random(long Max) {
+  return Max > 0 ? rand() % Max : 0;
+}
+inline long random(long Min, long Max) {
+  return Min + random(Max - Min);
+}
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* Buffer, size_t n) {
+      for (size_t i = 0; i < n; i++) {
+        write(Buffer[i]);
+      }
+      return n;
+    }
+    virtual void flush() {}
+    size_t print(const String& s) { return write((const uint8_t*)s.c_str(), s.length()); }
+    size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n) { return print((unsigned long)n); }
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t print(long n) { char b[24]; snprintf(b, sizeof(b), "%ld", n); return print(b); }
+    size_t print(unsigned long n) { char b[24]; snprintf(b, sizeof(b), "%lu", n); return print(b); }
+    size_t print(double n) { char b[32]; snprintf(b, sizeof(b), "%.2f", n); return print(b); }
+    size_t println() { return print("\r\n"); }
+    template <class T> size_t println(T Value) { size_t n = print(Value); return n + println(); }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// SerialUSB: Apod's error messages go to stderr
+class HostSerial : public Stream {
+  public:
+    size_t write(uint8_t b) {
+      if (b != '\r') {
+        fputc(b, stderr);
+      }
+      return 1;
+    }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+};
+static HostSerial SerialUSB;
+
+#endif
@@ -0,0 +1,37 @@
+/*
+   String.h - The parts of the Arduino String class that Apod.cpp uses, on std::string (see Arduino.h).
+   Released into the public domain.
+*/
+
+#ifndef ArduinoHostString_h
+#define ArduinoHostString_h
+
+#include <stdlib.h>
+#include <string>
+
+class String {
+  public:
+    String() {}
+    String(const char* s) : Text(s) {}
+    String(const std::string& s) : Text(s) {}
+    String(int n) : Text(std::to_string(n)) {}
+
+    unsigned int length() const { return Text.size(); }
+    const char* c_str() const { return Text.c_str(); }
+    int compareTo(const String& s) const { return Text.compare(s.Text); }
+    bool equals(const String& s) const { return Text == s.Text; }
+    bool operator==(const String& s) const { return Text == s.Text; }
+    bool operator!=(const String& s) const { return Text != s.Text; }
+    bool endsWith(const String& s) const {
+      return Text.size() >= s.Text.size() && Text.compare(Text.size() - s.Text.size(), s.Text.size(), s.Text) == 0;
+    }
+    String substring(unsigned int From, unsigned int To) const {
+      return (From < To && From < Text.size()) ? String(Text.substr(From, To - From)) : String();
+    }
+    long toInt() const { return atol(Text.c_str()); }
+
+  private:
+    std::string Text;
+};
+
+#endif
@@ -0,0 +1,160 @@
+/*
+   Arduino.h - The parts of the Arduino Due core that the Bpod firmware uses, for building it on a PC
+   (FirmwareHost.cpp). Add this folder with -I so that the firmware's <DueTimer.h> and <SPI.h> resolve here too;
+   Apod.cpp keeps ArduinoHost/ through -iquote. I/O costs nothing: PIO and ADC registers are plain memory (inputs
+   are set through PIO_PDSR and ADC_CDR), analogWrite, SPI and delays do nothing, Serial1 is an in-memory link and
+   the DWT cycle counter stays at 0. Only the Due pins the firmware uses are mapped (to their real PIO controllers).
+   Plain C++11.
+   Released into the public domain.
+*/
+
+#ifndef DueHost_h
+#define DueHost_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <vector>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define PROGMEM
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define A0 54
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+inline word makeWord(byte High, byte Low) {
+  return (word)((High << 8) | Low);
+}
+#define word(...) makeWord(__VA_ARGS__)
+
+inline unsigned long micros() {
+  static const std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - Start).count();
+}
+inline unsigned long millis() {
+  return micros() / 1000;
+}
+inline void delay(unsigned long) {}
+inline void delayMicroseconds(unsigned int) {}
+inline void randomSeed(unsigned long Seed) {
+  srand(Seed);
+}
+inline long random(long Max) {
+  return Max > 0 ? rand() % Max : 0;
+}
+inline void pinMode(int, int) {}
+inline void analogWrite(int, int) {}
+
+// PIO controller: lines driven with SODR/CODR, inputs read from PDSR
+struct Pio {
+  volatile uint32_t PIO_SODR;
+  volatile uint32_t PIO_CODR;
+  volatile uint32_t PIO_PDSR;
+};
+static Pio DuePIO[4]; // PIOA-PIOD
+
+struct PinDescription {
+  Pio* pPort;
+  uint32_t ulPin;
+  uint32_t ulADCChannelNumber;
+};
+
+// Due pins used by the firmware: PIO controller (0-3 = A-D) and line; analog inputs A0-A7: ADC channel
+static PinDescription g_APinDescription[A0 + 8];
+static struct DuePinTable {
+  DuePinTable() {
+    static const uint8_t Pins[][3] = {
+      {10, 2, 29}, {11, 3, 7}, {12, 3, 8}, {13, 1, 27}, {14, 3, 4}, {22, 1, 26}, {23, 0, 14}, {24, 0, 15},
+      {25, 3, 0}, {28, 3, 3}, {29, 3, 6}, {30, 3, 9}, {31, 0, 7}, {32, 3, 10}, {33, 2, 1}, {34, 2, 2},
+      {35, 2, 3}, {36, 2, 4}, {37, 2, 5}, {38, 2, 6}, {39, 2, 7}, {40, 2, 8}, {41, 2, 9}, {42, 0, 19},
+      {43, 0, 20}};
+    for (int x = 0; x < A0 + 8; x++) {
+      g_APinDescription[x].pPort = &DuePIO[0];
+    }
+    for (size_t x = 0; x < sizeof(Pins) / sizeof(Pins[0]); x++) {
+      g_APinDescription[Pins[x][0]].pPort = &DuePIO[Pins[x][1]];
+      g_APinDescription[Pins[x][0]].ulPin = 1UL << Pins[x][2];
+    }
+    for (int x = 0; x < 8; x++) {
+      g_APinDescription[A0 + x].ulADCChannelNumber = 7 - x;
+    }
+  }
+} DuePins;
+
+struct Adc {
+  volatile uint32_t ADC_CR;
+  volatile uint32_t ADC_MR;
+  volatile uint32_t ADC_CHER;
+  volatile uint32_t ADC_CHDR;
+  volatile uint32_t ADC_CDR[16];
+};
+static Adc DueADC;
+static Adc* const ADC = &DueADC;
+#define ADC_CR_START (1u << 1)
+#define ADC_MR_LOWRES (1u << 4)
+#define ADC_MR_FREERUN_ON (1u << 7)
+
+struct DwtRegisters {
+  volatile uint32_t CTRL;
+  volatile uint32_t CYCCNT;
+};
+static DwtRegisters DueDWT;
+static DwtRegisters* const DWT = &DueDWT;
+#define DWT_CTRL_CYCCNTENA_Msk 1UL
+
+struct CoreDebugRegisters {
+  volatile uint32_t DEMCR;
+};
+static CoreDebugRegisters DueCoreDebug;
+static CoreDebugRegisters* const CoreDebug = &DueCoreDebug;
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+// UART: bytes written to In are read by the firmware; what it writes collects in Out (unless Discard is set)
+class DueSerial {
+  public:
+    std::deque<uint8_t> In;
+    std::vector<uint8_t> Out;
+    bool Discard = false;
+    void begin(unsigned long) {}
+    int available() { return In.size(); }
+    int read() {
+      if (In.empty()) {
+        return -1;
+      }
+      uint8_t b = In.front();
+      In.pop_front();
+      return b;
+    }
+    size_t write(uint8_t b) {
+      if (!Discard) {
+        Out.push_back(b);
+      }
+      return 1;
+    }
+    size_t print(long n) {
+      char Text[24];
+      int Length = snprintf(Text, sizeof(Text), "%ld", n);
+      for (int i = 0; i < Length; i++) {
+        write(Text[i]);
+      }
+      return Length;
+    }
+    void flush() {}
+};
+static DueSerial SerialUSB, Serial1, Serial2;
+
+#endif
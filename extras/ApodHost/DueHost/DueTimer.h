@@ -0,0 +1,19 @@
+/*
+   DueTimer.h - The DueTimer calls the Bpod firmware makes, for building it on a PC (see Arduino.h). The timer never
+   fires: the host calls handler() itself.
+   Released into the public domain.
+*/
+
+#ifndef DueHostTimer_h
+#define DueHostTimer_h
+
+class DueTimer {
+  public:
+    DueTimer& attachInterrupt(void (*)()) { return *this; }
+    DueTimer& setPeriod(double) { return *this; }
+    DueTimer& start(double = -1) { return *this; }
+    DueTimer& stop() { return *this; }
+};
+static DueTimer Timer3;
+
+#endif
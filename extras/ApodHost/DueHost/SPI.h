@@ -0,0 +1,16 @@
+/*
+   SPI.h - The SPI calls the Bpod firmware makes (valve and sync registers), for building it on a PC (see Arduino.h).
+   Released into the public domain.
+*/
+
+#ifndef DueHostSPI_h
+#define DueHostSPI_h
+
+class SPIClass {
+  public:
+    void begin() {}
+    uint8_t transfer(uint8_t Data) { return Data; }
+};
+static SPIClass SPI;
+
+#endif
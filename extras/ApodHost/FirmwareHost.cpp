@@ -0,0 +1,120 @@
+/*
+   FirmwareHost.cpp - The Bpod firmware built on the PC (see FirmwareHost.h). The Arduino IDE declares a sketch's
+   functions before compiling it; the declarations below do the same, and need a line for each function added to
+   the firmware (the compiler names a missing one).
+   Build with -I DueHost (apod_bench's Build line).
+   Released into the public domain.
+*/
+
+#include "DueHost/Arduino.h"
+#include "FirmwareHost.h"
+
+void setup();
+void loop();
+void handler();
+boolean scheduleBlockTrial(byte TrialType);
+void removeBlockMatrix(byte TrialType);
+void sendBlockTrialSummary();
+void endBlock();
+void loadStateMatrix(boolean Sparse);
+void initOutputPorts();
+void compileOutputPlans();
+void loadMatrixRows(byte *Matrix, byte nColumns, boolean SelfDefault, boolean Sparse);
+void startStateMatrix();
+void configureADC(byte Channels);
+void sendAnalogSamples(word MaxSamples);
+void SetBNCOutputLines(int BNCState);
+void ValveRegWrite(int value);
+void SyncRegWrite(int value);
+void UpdatePWMOutputStates();
+void SetWireOutputLines(int WireState);
+void updateStatusLED(int Mode);
+void setStateOutputs(byte State);
+void setPlanLines(byte State, byte ChangedLines, byte WaveLines);
+void writePWMOutput(byte Channel, byte Value);
+void updateWaveOutputs();
+void writeWaveOutput(byte Target, byte Value);
+byte stateOutputLevel(byte Target);
+void updateWaves();
+void stopWaves();
+void manualOverrideOutputs();
+void setVirtualEvent(byte Target, byte Data);
+void sendForwardedEvents();
+void applyVirtualEvents();
+void runSequence();
+void executeSequenceStep(byte Command, byte Target, byte Data);
+void digitalWriteDirect(int pin, boolean val);
+byte digitalReadDirect(int pin);
+void SerialWriteLong(unsigned long num);
+void SerialWriteShort(word num);
+unsigned long SerialReadLong();
+word SerialReadShort();
+byte MatrixReadByte();
+unsigned long MatrixReadLong();
+byte SerialReadByte();
+
+#include "../../Bpod_Firmware_0_5_modified/Bpod_Firmware_0_5_modified.ino"
+
+void FirmwareSetup() {
+  setup();
+}
+
+void FirmwareReceive(const uint8_t* Bytes, size_t n) {
+  // Commands must be complete: the firmware waits for the rest of one, and nothing else would send it
+  Serial1.In.insert(Serial1.In.end(), Bytes, Bytes + n);
+  while (Serial1.available()) {
+    loop();
+  }
+  loop(); // Trial data of a trial that has just ended
+}
+
+int FirmwareAvailable() {
+  return Serial1.Out.size();
+}
+
+int FirmwareRead() {
+  if (Serial1.Out.empty()) {
+    return -1;
+  }
+  uint8_t b = Serial1.Out.front();
+  Serial1.Out.erase(Serial1.Out.begin());
+  return b;
+}
+
+int FirmwarePeek() {
+  return Serial1.Out.empty() ? -1 : Serial1.Out.front();
+}
+
+void FirmwareTick() {
+  handler();
+}
+
+void FirmwareSetPortInputs(uint8_t Levels) {
+  for (int x = 0; x < 8; x++) {
+    Pio* Port = g_APinDescription[PortDigitalInputLines[x]].pPort;
+    if (bitRead(Levels, x)) {
+      Port->PIO_PDSR |= g_APinDescription[PortDigitalInputLines[x]].ulPin;
+    } else {
+      Port->PIO_PDSR &= ~g_APinDescription[PortDigitalInputLines[x]].ulPin;
+    }
+  }
+}
+
+void FirmwareSetAnalogInput(int Line, uint16_t Value) {
+  ADC->ADC_CDR[AnalogADCChannel[Line]] = Value;
+}
+
+void FirmwareStop() {
+  Serial1.In.push_back('X');
+  loop();
+  loop();
+  Serial1.Out.clear();
+}
+
+void FirmwareKeepRunning() {
+  if (!RunningStateMatrix || (nEvents > 9000)) {
+    startStateMatrix();
+  }
+  ForwardedEvents.Clear();
+  AnalogInput.Release(AnalogInput.Available());
+}
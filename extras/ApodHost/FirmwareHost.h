@@ -0,0 +1,27 @@
+/*
+   FirmwareHost.h - The Bpod firmware (Bpod_Firmware_0_5_modified.ino) built on the PC against DueHost/, so the real
+   timer handler can be benchmarked (apod_bench's handler/ cases). FirmwareHost.cpp holds the firmware; this
+   interface keeps its globals out of the including file. I/O is stubbed (DueHost/Arduino.h): times are the
+   handler's logic on this machine, not the Due's cycles, which Apod::GetTransitionLatency measures on a rig.
+   Released into the public domain.
+*/
+
+#ifndef FirmwareHost_h
+#define FirmwareHost_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+void FirmwareSetup();                                 // setup()
+void FirmwareReceive(const uint8_t* Bytes, size_t n); // Bytes arrive on Serial1; loop() runs until all are read
+int FirmwareAvailable();                              // Bytes the firmware has written to Serial1 and not yet read
+int FirmwareRead();                                   // Next of those bytes, or -1
+int FirmwarePeek();                                   // Next of those bytes without reading it, or -1
+void FirmwareTick();                                  // One timer cycle: handler()
+void FirmwareSetPortInputs(uint8_t Levels);           // Port input lines 1-8 (bit per port), read by the next cycle
+void FirmwareSetAnalogInput(int Line, uint16_t Value); // ADC result of port analog line 0-7
+void FirmwareStop();                                  // End the trial ('X') and discard its data
+void FirmwareKeepRunning(); // Restart the trial (without its data dump) once it has ended or 9000 events are stored,
+                            // and drop forwarded events and analog samples, which loop() would have sent
+
+#endif
@@ -0,0 +1,173 @@
+/*
+   apod_analog_sim.cpp - Host test of the firmware's analog input path (Bpod_Firmware_0_5_modified/AnalogInput.h)
+   against a simulated ADC, in simulated time. Each line carries a baseline with Gaussian noise and random pulses
+   (e.g. lick contacts); every 0.1 ms timer cycle the sampler gets the latest free-running conversion of each line,
+   which lags the cycle by up to one conversion per sampled line (1 us each). Apod polls the Bpod for sample blocks
+   ('A' 'R') over the serial link at --baud.
+   Reports threshold event latency from pulse onset (mean / 99th percentile / max), missed and spurious events,
+   offered and delivered sample rates, link use, frames dropped and the deepest the ring got.
+   Build: g++ -O2 -std=c++11 -o apod_analog_sim apod_analog_sim.cpp
+   Usage: apod_analog_sim [--channels N] [--period CYCLES] [--seconds S] [--baud B] [--block N] [--poll MS]
+                          [--noise SD] [--high ADC] [--low ADC] [--rate HZ] [--width MS]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "../../Bpod_Firmware_0_5_modified/AnalogInput.h"
+
+static AnalogSampler<2048> Sampler; // As in the firmware
+
+static uint64_t Seed = 12345;
+
+static double Uniform() {
+  Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((Seed >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double Gaussian() {
+  return sqrt(-2 * log(Uniform())) * cos(2 * M_PI * Uniform());
+}
+
+struct Pulse {
+  double Start, End; // us
+};
+
+int main(int argc, char** argv) {
+  int nChannels = 2, Period = 10, Block = 512;
+  double Seconds = 60, Baud = 115200, Poll = 5, Noise = 20, Rate = 7, Width = 40;
+  int High = 2000, Low = 1500, Baseline = 500, Peak = 3500;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--channels") && HasValue) nChannels = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--period") && HasValue) Period = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--seconds") && HasValue) Seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--baud") && HasValue) Baud = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--block") && HasValue) Block = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--poll") && HasValue) Poll = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--noise") && HasValue) Noise = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--high") && HasValue) High = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--low") && HasValue) Low = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--rate") && HasValue) Rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--width") && HasValue) Width = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (nChannels < 1 || nChannels > 8 || Period < 1 || Period > 65535 || Block < 1) {
+    fprintf(stderr, "Invalid configuration\n");
+    return 2;
+  }
+
+  // Pulse trains: exponential gaps, fixed width
+  uint32_t nCycles = Seconds * 10000;
+  std::vector<std::vector<Pulse> > Pulses(nChannels);
+  for (int c = 0; c < nChannels; c++) {
+    double t = 0;
+    while (true) {
+      t += -log(Uniform()) * 1e6 / Rate + Width * 1000;
+      if (t + Width * 1000 >= nCycles * 100.0) {
+        break;
+      }
+      Pulse p = {t, t + Width * 1000};
+      Pulses[c].push_back(p);
+      t = p.End;
+    }
+  }
+
+  Sampler.Configure((1 << nChannels) - 1, Period);
+  for (int c = 0; c < nChannels; c++) {
+    Sampler.SetThreshold(c, true, High, Low);
+  }
+
+  uint16_t Readings[8] = {0};
+  uint8_t Events[16];
+  std::vector<size_t> NextPulse(nChannels, 0);
+  std::vector<double> Latencies;
+  uint64_t Spurious = 0, Detected = 0, Frames = 1, Delivered = 0, LinkBytes = 0, MaxDepth = 0;
+  std::vector<int> PulseSeen(nChannels, 0); // High event already counted for the current pulse
+  double LinkFree = 0, NextPoll = 0;        // us
+  double ByteTime = 10e6 / Baud;            // us per byte (8N1)
+  uint16_t PendingRelease = 0;
+  double ReleaseTime = -1;
+
+  for (uint32_t Cycle = 1; Cycle <= nCycles; Cycle++) {
+    double Now = Cycle * 100.0;
+    for (int c = 0; c < nChannels; c++) {
+      double SampleTime = Now - Uniform() * nChannels; // Conversion finished up to one sweep ago
+      while (NextPulse[c] < Pulses[c].size() && Pulses[c][NextPulse[c]].End < SampleTime - 200) {
+        NextPulse[c]++;
+        PulseSeen[c] = 0;
+      }
+      bool In = NextPulse[c] < Pulses[c].size() && SampleTime >= Pulses[c][NextPulse[c]].Start &&
+                SampleTime < Pulses[c][NextPulse[c]].End;
+      double Value = (In ? Peak : Baseline) + Noise * Gaussian();
+      Readings[c] = (uint16_t)std::min(4095.0, std::max(0.0, Value + 0.5));
+    }
+    uint8_t nEvents = Sampler.Tick(Readings, Events);
+    if (Cycle % Period == 0) {
+      Frames++;
+    }
+    for (int i = 0; i < nEvents; i++) {
+      int c = Events[i] / 2;
+      bool Rising = (Events[i] % 2 == 0);
+      bool InPulse = NextPulse[c] < Pulses[c].size() && Now >= Pulses[c][NextPulse[c]].Start;
+      if (Rising && InPulse && !PulseSeen[c]) {
+        Latencies.push_back(Now - Pulses[c][NextPulse[c]].Start);
+        PulseSeen[c] = 1;
+        Detected++;
+      } else if (Rising) {
+        Spurious++;
+      }
+    }
+    // Apod's poll and the Bpod's reply on the serial link
+    if (ReleaseTime >= 0 && Now >= ReleaseTime) {
+      Sampler.Release(PendingRelease);
+      ReleaseTime = -1;
+    }
+    uint64_t Depth = Sampler.Available();
+    MaxDepth = std::max(MaxDepth, Depth);
+    if (ReleaseTime < 0 && Now >= NextPoll && Now >= LinkFree) {
+      uint16_t n = std::min<uint32_t>(Sampler.Available(), Block);
+      n -= n % nChannels;
+      double Bytes = 4 + 5 + 2.0 * n;
+      LinkBytes += Bytes;
+      LinkFree = Now + Bytes * ByteTime;
+      PendingRelease = n;
+      ReleaseTime = LinkFree; // The firmware releases the block once it has been written
+      Delivered += n;
+      NextPoll = LinkFree + Poll * 1000;
+    }
+  }
+
+  uint64_t nPulses = 0;
+  for (int c = 0; c < nChannels; c++) {
+    nPulses += Pulses[c].size();
+  }
+  std::sort(Latencies.begin(), Latencies.end());
+  double Mean = 0;
+  for (size_t i = 0; i < Latencies.size(); i++) {
+    Mean += Latencies[i];
+  }
+  Mean = Latencies.empty() ? 0 : Mean / Latencies.size();
+  double P99 = Latencies.empty() ? 0 : Latencies[(size_t)(0.99 * (Latencies.size() - 1))];
+  double Max = Latencies.empty() ? 0 : Latencies.back();
+
+  double Offered = nChannels * 10000.0 / Period;
+  printf("%d lines, %d cycles/sample (%.0f samples/s offered), %.0f s, %.0f baud, %d-sample blocks every %.1f ms\n",
+         nChannels, Period, Offered, Seconds, Baud, Block, Poll);
+  printf("threshold events: %llu of %llu pulses detected, %llu missed, %llu spurious\n", (unsigned long long)Detected,
+         (unsigned long long)nPulses, (unsigned long long)(nPulses - Detected), (unsigned long long)Spurious);
+  printf("event latency from pulse onset (us): mean %.1f  p99 %.1f  max %.1f\n", Mean, P99, Max);
+  printf("samples delivered %.0f/s, link %.0f%% busy, %u frames dropped of %llu, max ring depth %llu of 2048\n",
+         Delivered / Seconds, 100.0 * LinkBytes * ByteTime / (nCycles * 100.0), (unsigned)Sampler.Overflows,
+         (unsigned long long)Frames, (unsigned long long)MaxDepth);
+  bool Ok = (Sampler.Overflows == 0) && (Spurious == 0) && (Detected == nPulses);
+  printf("%s\n", Ok ? "PASS" : "FAIL");
+  return Ok ? 0 : 1;
+}
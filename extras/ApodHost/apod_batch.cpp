@@ -0,0 +1,520 @@
+/*
+   apod_batch.cpp - Run many simulated sessions of one state matrix in parallel.
+   Input is the matrix exactly as Apod::SendStateMatrix sends it: a raw 'P'/'C' image
+   (Apod::WriteStateMatrix) or the first matrix of a session recording (Apod::StartRecording).
+   Sessions are stepped with ApodEngine.h's cycle functions (the firmware's transition semantics) and driven by
+   stochastic agent models. Reports state visit frequencies, trial durations, firmware
+   buffer overflows and the size and serial time of the end-of-trial dump, plus sessions-per-second.
+   Also estimates the gap between trials and the trials per minute when Apod runs each trial itself
+   (trial dump, matrix upload and 'R' over the serial link) and in block mode (Apod::StartBlock: the
+   Bpod starts the next stored matrix after the inter-trial interval, with no round trip). These are
+   computed from the byte counts, the link speed and the firmware's delays, not simulated.
+   Build: g++ -O2 -std=c++11 -pthread -o apod_batch apod_batch.cpp
+   Usage: apod_batch matrix.bin [--sessions N] [--trials N] [--threads N] [--agent poke|uniform]
+                     [--rate HZ] [--dwell S] [--max-trial S] [--seed N] [--scaling] [--record-all]
+                     [--baud B] [--iti S]
+          --record-all ignores the matrix's event recording mask (Apod::SetEventRecording)
+          --iti: block mode inter-trial interval (Apod::StartBlock)
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "ApodEngine.h"
+
+// Time (ms) the firmware takes to send a dump: 10 ms after the op code, 100 us after each count, and 50 us after
+// each event and state record. A record's delay overlaps the sending of its bytes.
+static double DumpMs(double Bytes, double Events, double States, double ByteMs) {
+  double Other = Bytes - 5 * Events - States;
+  return 10 + 0.2 + Events * std::max(5 * ByteMs, 0.05) + States * std::max(ByteMs, 0.05) + Other * ByteMs;
+}
+
+// Per-session random stream (splitmix64), so results do not depend on the thread count
+static inline uint64_t NextRandom(uint64_t& State) {
+  uint64_t z = (State += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+static inline double Uniform(uint64_t& State) {
+  return (NextRandom(State) >> 11) * (1.0 / 9007199254740992.0);
+}
+static inline uint32_t ExponentialCycles(uint64_t& State, double MeanCycles) {
+  double x = -log(1.0 - Uniform(State)) * MeanCycles;
+  return x < 1 ? 1 : (x > 4e9 ? 4000000000U : (uint32_t)x);
+}
+
+// Agent models choose each session's next input event (code 0-38) and its delay in cycles.
+// LineState holds per-session line levels (bit x = port x in) so entries and exits pair up.
+class ApodAgent {
+  public:
+    virtual ~ApodAgent() {}
+    virtual uint8_t Next(const ApodMatrix& M, int State, uint8_t& LineState, uint64_t& Rng, uint32_t& Delay) const = 0;
+};
+
+// Pokes a random enabled port at Rate pokes/s and withdraws after an exponential dwell time
+class PokeAgent : public ApodAgent {
+  public:
+    double Rate, Dwell;
+    PokeAgent(double PokeRate, double DwellTime) : Rate(PokeRate), Dwell(DwellTime) {}
+    uint8_t Next(const ApodMatrix& M, int, uint8_t& LineState, uint64_t& Rng, uint32_t& Delay) const {
+      for (int x = 0; x < 8; x++) {
+        if (LineState & (1 << x)) {
+          LineState &= ~(1 << x);
+          Delay = ExponentialCycles(Rng, Dwell * 10000);
+          return x * 2 + 1; // PortxOut
+        }
+      }
+      int Enabled[8], nEnabled = 0;
+      for (int x = 0; x < 8; x++) {
+        if (M.PortInputsEnabled[x]) {
+          Enabled[nEnabled++] = x;
+        }
+      }
+      if (nEnabled == 0) {
+        return ApodNoEvent;
+      }
+      int Port = Enabled[NextRandom(Rng) % nEnabled];
+      LineState |= (1 << Port);
+      Delay = ExponentialCycles(Rng, 10000 / Rate);
+      return Port * 2; // PortxIn
+    }
+};
+
+// Emits any input event code of enabled channels or soft codes, uniformly, at Rate events/s
+class UniformAgent : public ApodAgent {
+  public:
+    double Rate;
+    explicit UniformAgent(double EventRate) : Rate(EventRate) {}
+    uint8_t Next(const ApodMatrix& M, int, uint8_t&, uint64_t& Rng, uint32_t& Delay) const {
+      uint8_t Codes[38];
+      int nCodes = 0;
+      for (int x = 0; x < 8; x++) {
+        if (M.PortInputsEnabled[x]) {
+          Codes[nCodes++] = x * 2;
+          Codes[nCodes++] = x * 2 + 1;
+        }
+      }
+      for (int x = 16; x < 20; x++) {
+        Codes[nCodes++] = x;
+      }
+      for (int x = 0; x < 4; x++) {
+        if (M.WireInputsEnabled[x]) {
+          Codes[nCodes++] = 20 + x * 2;
+          Codes[nCodes++] = 21 + x * 2;
+        }
+      }
+      for (int x = 28; x < 38; x++) {
+        Codes[nCodes++] = x;
+      }
+      Delay = ExponentialCycles(Rng, 10000 / Rate);
+      return Codes[NextRandom(Rng) % nCodes];
+    }
+};
+
+struct BatchConfig {
+  int nSessions = 1000;
+  int nTrials = 100;
+  uint32_t MaxTrialCycles = 600000; // 60 s
+  uint64_t Seed = 1;
+  int BatchSize = 64; // Sessions stepped together per tick
+};
+
+struct BatchReport {
+  uint64_t StateVisits[ApodMaxStates] = {};
+  uint64_t StateReached[ApodMaxStates] = {}; // Trials in which the state was entered at least once
+  uint64_t nTrials = 0, nTimeouts = 0, TotalCycles = 0;
+  uint32_t MinTrialCycles = 0xFFFFFFFF, MaxTrialCycles = 0;
+  uint32_t MaxEvents = 0, MaxTransitions = 0;
+  uint64_t EventOverflows = 0;      // Trials exceeding Events[10000]/TimeStamps[10000]
+  uint64_t TransitionOverflows = 0; // Trials exceeding state_visited[1024]
+  uint64_t DroppedEvents[ApodEventClasses] = {}; // Events not recorded because of the event mask
+  uint64_t DumpBytes = 0;           // End-of-trial dump (op code 1) sent to Apod
+  uint64_t DumpEvents = 0, DumpStates = 0; // Event and state records in the dumps (each followed by a 50 us delay)
+  uint32_t MaxDumpBytes = 0, MaxDumpEvents = 0, MaxDumpStates = 0; // Largest dump
+  uint64_t StateEntries = 0;        // Calls to setStateOutputs
+  uint64_t FullOutputWrites = 0;    // Output writes if every output is rewritten on state entry
+  uint64_t PlanOutputWrites = 0;    // Output writes with precompiled plans (changed outputs only)
+
+  void Merge(const BatchReport& r) {
+    for (int x = 0; x < ApodMaxStates; x++) {
+      StateVisits[x] += r.StateVisits[x];
+      StateReached[x] += r.StateReached[x];
+    }
+    nTrials += r.nTrials; nTimeouts += r.nTimeouts; TotalCycles += r.TotalCycles;
+    MinTrialCycles = r.MinTrialCycles < MinTrialCycles ? r.MinTrialCycles : MinTrialCycles;
+    MaxTrialCycles = r.MaxTrialCycles > MaxTrialCycles ? r.MaxTrialCycles : MaxTrialCycles;
+    MaxEvents = r.MaxEvents > MaxEvents ? r.MaxEvents : MaxEvents;
+    MaxTransitions = r.MaxTransitions > MaxTransitions ? r.MaxTransitions : MaxTransitions;
+    EventOverflows += r.EventOverflows;
+    TransitionOverflows += r.TransitionOverflows;
+    for (int x = 0; x < ApodEventClasses; x++) {
+      DroppedEvents[x] += r.DroppedEvents[x];
+    }
+    DumpBytes += r.DumpBytes;
+    DumpEvents += r.DumpEvents;
+    DumpStates += r.DumpStates;
+    if (r.MaxDumpBytes > MaxDumpBytes) {
+      MaxDumpBytes = r.MaxDumpBytes;
+      MaxDumpEvents = r.MaxDumpEvents;
+      MaxDumpStates = r.MaxDumpStates;
+    }
+    StateEntries += r.StateEntries;
+    FullOutputWrites += r.FullOutputWrites;
+    PlanOutputWrites += r.PlanOutputWrites;
+  }
+};
+
+// A group of sessions in structure-of-arrays layout, all advanced by one cycle per step
+class SessionBatch {
+  public:
+    SessionBatch(const ApodMatrix& Matrix, const ApodAgent& Model, const BatchConfig& Config, int FirstSession, int nSessions)
+      : M(Matrix), Agent(Model), Cfg(Config), n(nSessions),
+        Rng(n), Time(n), StateStart(n), State(n), Meaningful(n), Done(n), TrialsLeft(n, Config.nTrials),
+        NextInput(n), PendingInput(n), LineState(n), nEvents(n), nTransition(n), TimerActive(5 * n), TimerEnd(5 * n),
+        CounterCounts(5 * n), Reached(2 * n), OutValves(n), OutLines(n), OutPWM(8 * n) {
+      for (int s = 0; s < n; s++) {
+        Rng[s] = Config.Seed * 0x100000001B3ULL + FirstSession + s;
+        StartTrial(s);
+      }
+    }
+
+    void Run(BatchReport& Report) {
+      Writes = &Report;
+      for (int s = 0; s < n; s++) {
+        CountOutputWrites(s, 0); // First state of the first trial, entered in the constructor
+      }
+      int Active = n;
+      while (Active > 0) {
+        Active = 0;
+        for (int s = 0; s < n; s++) {
+          if (!Done[s]) {
+            Step(s, Report);
+            Active++;
+          }
+        }
+      }
+    }
+
+  private:
+    const ApodMatrix& M;
+    const ApodAgent& Agent;
+    const BatchConfig& Cfg;
+    int n;
+    std::vector<uint64_t> Rng;
+    std::vector<uint32_t> Time, StateStart;
+    std::vector<uint8_t> State, Meaningful, Done;
+    std::vector<int> TrialsLeft;
+    std::vector<uint32_t> NextInput;
+    std::vector<uint8_t> PendingInput, LineState;
+    std::vector<uint32_t> nEvents, nTransition;
+    std::vector<uint8_t> TimerActive; // Active flags, timer-major: [x * n + s]
+    std::vector<uint32_t> TimerEnd, CounterCounts;
+    std::vector<uint64_t> Reached; // States entered this trial (128-bit set per session)
+    std::vector<uint8_t> OutValves, OutLines, OutPWM; // Outputs last written (OutPWM channel-major: [x * n + s])
+    BatchReport* Writes = 0; // Receives output write counts (set by Run)
+
+    void ScheduleInput(int s) {
+      uint32_t Delay = 0;
+      PendingInput[s] = Agent.Next(M, State[s], LineState[s], Rng[s], Delay);
+      NextInput[s] = Time[s] + Delay;
+    }
+
+    void StartTrial(int s) {
+      Time[s] = 0;
+      StateStart[s] = 0;
+      State[s] = 0;
+      nEvents[s] = 0;
+      nTransition[s] = 1;
+      LineState[s] = 0;
+      Reached[2 * s] = 1;
+      Reached[2 * s + 1] = 0;
+      for (int x = 0; x < 5; x++) {
+        TimerActive[x * n + s] = 0;
+        CounterCounts[x * n + s] = 0;
+      }
+      OutValves[s] = 0; // The firmware resets every output when a trial ends
+      OutLines[s] = 0;
+      for (int x = 0; x < 8; x++) {
+        OutPWM[x * n + s] = 0;
+      }
+      EnterState(s, 0);
+      ScheduleInput(s);
+    }
+
+    // Outputs the firmware's setStateOutputs would write, counted as it counts them for Apod::GetTransitionLatency
+    // (one per OutputChanges bit), with Apod::SetFullOutputWrites (every output: valves, 2 BNC, 4 wire, serial
+    // module, 8 PWM) and without (changed valves, lines and PWM channels, non-zero serial codes). Waves are not
+    // modelled. A model of the firmware code, not a count from it: check on a rig.
+    void CountOutputWrites(int s, int NewState) {
+      const uint8_t* Out = M.OutputMatrix[NewState];
+      Writes->StateEntries++;
+      Writes->FullOutputWrites += 16;
+      int Changes = (Out[0] != OutValves[s]) + (Out[4] > 0);
+      uint8_t Lines = (Out[1] & 3) | ((Out[2] & 15) << 2);
+      for (int x = 0; x < 6; x++) {
+        Changes += ((Lines ^ OutLines[s]) >> x) & 1;
+      }
+      for (int x = 0; x < 8; x++) {
+        Changes += (Out[x + 9] != OutPWM[x * n + s]);
+        OutPWM[x * n + s] = Out[x + 9];
+      }
+      Writes->PlanOutputWrites += Changes;
+      OutValves[s] = Out[0];
+      OutLines[s] = Lines;
+    }
+
+    // Session s's timers and counters, for the ApodEngine.h cycle functions
+    ApodTimerState Timers(int s) {
+      ApodTimerState T = {&TimerActive[s], &TimerEnd[s], &CounterCounts[s], (size_t)n};
+      return T;
+    }
+
+    void EnterState(int s, int NewState) {
+      if (Writes) {
+        CountOutputWrites(s, NewState);
+      }
+      Meaningful[s] = ApodEnterState(M, NewState, Time[s], Timers(s));
+    }
+
+    void EndTrial(int s, BatchReport& r, bool Timeout) {
+      r.nTrials++;
+      r.nTimeouts += Timeout;
+      r.TotalCycles += Time[s];
+      r.MinTrialCycles = Time[s] < r.MinTrialCycles ? Time[s] : r.MinTrialCycles;
+      r.MaxTrialCycles = Time[s] > r.MaxTrialCycles ? Time[s] : r.MaxTrialCycles;
+      r.MaxEvents = nEvents[s] > r.MaxEvents ? nEvents[s] : r.MaxEvents;
+      r.MaxTransitions = nTransition[s] > r.MaxTransitions ? nTransition[s] : r.MaxTransitions;
+      r.EventOverflows += (nEvents[s] >= (uint32_t)ApodMaxEvents);
+      r.TransitionOverflows += (nTransition[s] > (uint32_t)ApodMaxTransitions);
+      uint32_t States = nTransition[s] < (uint32_t)ApodMaxTransitions ? nTransition[s] : ApodMaxTransitions;
+      uint32_t Dump = 5 + 5 * nEvents[s] + States +
+                      2 * ApodEventClasses + 4; // Dropped event counts, virtual event and forwarded event overflows
+      r.DumpBytes += Dump;
+      r.DumpEvents += nEvents[s];
+      r.DumpStates += States;
+      if (Dump > r.MaxDumpBytes) {
+        r.MaxDumpBytes = Dump;
+        r.MaxDumpEvents = nEvents[s];
+        r.MaxDumpStates = States;
+      }
+      for (int x = 0; x < M.nStates; x++) {
+        r.StateReached[x] += (Reached[2 * s + x / 64] >> (x % 64)) & 1;
+      }
+      if (--TrialsLeft[s] > 0) {
+        StartTrial(s);
+      } else {
+        Done[s] = 1;
+      }
+    }
+
+    void Step(int s, BatchReport& r) {
+      uint8_t Event[ApodMaxCycleEvents];
+      int nEvent = 0;
+      uint32_t Now = ++Time[s];
+      if (Now >= NextInput[s]) {
+        if (PendingInput[s] != ApodNoEvent) {
+          Event[nEvent++] = PendingInput[s];
+        }
+        ScheduleInput(s);
+      }
+      int Current = State[s];
+      nEvent = ApodAddCycleEvents(M, Now, Current, StateStart[s], Meaningful[s], Timers(s), Event, nEvent);
+      if (nEvent == 0) {
+        if (Now >= Cfg.MaxTrialCycles) {
+          EndTrial(s, r, true);
+        }
+        return;
+      }
+      int NewState = ApodFindTransition(M, Current, Event, nEvent);
+      if (!ApodRecordEvents(M, Event, nEvent, Now, (uint8_t*)0, (uint32_t*)0, nEvents[s], r.DroppedEvents)) {
+        nEvents[s] = ApodMaxEvents; // Marks the overflow
+      }
+      if (NewState != Current) {
+        if (NewState == M.nStates) {
+          EndTrial(s, r, false);
+          return;
+        }
+        EnterState(s, NewState);
+        StateStart[s] = Now;
+        State[s] = NewState;
+        nTransition[s]++;
+        r.StateVisits[NewState]++;
+        Reached[2 * s + NewState / 64] |= 1ULL << (NewState % 64);
+      }
+      if (Now >= Cfg.MaxTrialCycles) {
+        EndTrial(s, r, true);
+      }
+    }
+};
+
+static BatchReport RunBatches(const ApodMatrix& M, const ApodAgent& Agent, const BatchConfig& Cfg, int nThreads) {
+  std::atomic<int> NextBatch(0);
+  int nBatches = (Cfg.nSessions + Cfg.BatchSize - 1) / Cfg.BatchSize;
+  std::vector<BatchReport> Reports(nThreads);
+  std::vector<std::thread> Pool;
+  for (int t = 0; t < nThreads; t++) {
+    Pool.push_back(std::thread([&, t]() {
+      int b;
+      while ((b = NextBatch++) < nBatches) {
+        int First = b * Cfg.BatchSize;
+        int Count = Cfg.nSessions - First < Cfg.BatchSize ? Cfg.nSessions - First : Cfg.BatchSize;
+        SessionBatch Batch(M, Agent, Cfg, First, Count);
+        Batch.Run(Reports[t]);
+      }
+    }));
+  }
+  BatchReport Total;
+  for (int t = 0; t < nThreads; t++) {
+    Pool[t].join();
+    Total.Merge(Reports[t]);
+  }
+  // Each trial's first state is entered without a transition
+  Total.StateVisits[0] += Total.nTrials;
+  return Total;
+}
+
+// Returns the length of the matrix image (as sent to the Bpod), or 0 if there is none
+static int LoadMatrix(const char* Path, ApodMatrix& M) {
+  FILE* File = fopen(Path, "rb");
+  if (!File) {
+    perror(Path);
+    return 0;
+  }
+  std::vector<uint8_t> Data;
+  uint8_t Buffer[65536];
+  size_t nRead;
+  while ((nRead = fread(Buffer, 1, sizeof(Buffer), File)) > 0) {
+    Data.insert(Data.end(), Buffer, Buffer + nRead);
+  }
+  fclose(File);
+  if (Data.size() > 5 && memcmp(Data.data(), "APOD", 4) == 0) { // Session recording: first 'M' record
+    size_t Index = 5;
+    while (Index + 9 <= Data.size()) {
+      uint32_t Length = Data[Index + 1] | (Data[Index + 2] << 8) | (Data[Index + 3] << 16) | ((uint32_t)Data[Index + 4] << 24);
+      if (Data[Index] == 'M' && Index + 9 + Length <= Data.size()) {
+        return ApodParseStateMatrix(&Data[Index + 9], Length, M) > 0 ? Length : 0;
+      }
+      Index += 9 + Length;
+    }
+    return 0;
+  }
+  int Length = ApodParseStateMatrix(Data.data(), Data.size(), M);
+  return Length > 0 ? Length : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s matrix.bin [--sessions N] [--trials N] [--threads N] [--agent poke|uniform] "
+                    "[--rate HZ] [--dwell S] [--max-trial S] [--seed N] [--scaling] [--record-all] [--baud B] [--iti S]\n",
+            argv[0]);
+    return 2;
+  }
+  static ApodMatrix M;
+  int ImageBytes = LoadMatrix(argv[1], M);
+  if (ImageBytes == 0) {
+    fprintf(stderr, "%s: no valid state matrix found\n", argv[1]);
+    return 2;
+  }
+  BatchConfig Cfg;
+  int nThreads = std::thread::hardware_concurrency();
+  nThreads = nThreads > 0 ? nThreads : 1;
+  const char* AgentName = "poke";
+  double Rate = 1.0, Dwell = 0.2, Baud = 115200, ITI = 0;
+  bool Scaling = false;
+  for (int i = 2; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--sessions") && HasValue) Cfg.nSessions = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--trials") && HasValue) Cfg.nTrials = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--threads") && HasValue) nThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--agent") && HasValue) AgentName = argv[++i];
+    else if (!strcmp(argv[i], "--rate") && HasValue) Rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--dwell") && HasValue) Dwell = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--max-trial") && HasValue) Cfg.MaxTrialCycles = atof(argv[++i]) * 10000;
+    else if (!strcmp(argv[i], "--seed") && HasValue) Cfg.Seed = strtoull(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--scaling")) Scaling = true;
+    else if (!strcmp(argv[i], "--record-all")) memset(M.EventMask, 0, sizeof(M.EventMask));
+    else if (!strcmp(argv[i], "--baud") && HasValue) Baud = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--iti") && HasValue) ITI = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  PokeAgent Poke(Rate, Dwell);
+  UniformAgent Any(Rate);
+  const ApodAgent* Agent = &Poke;
+  if (!strcmp(AgentName, "uniform")) {
+    Agent = &Any;
+  } else if (strcmp(AgentName, "poke")) {
+    fprintf(stderr, "Unknown agent: %s\n", AgentName);
+    return 2;
+  }
+
+  std::vector<int> ThreadCounts;
+  if (Scaling) {
+    for (int t = 1; t < nThreads; t *= 2) {
+      ThreadCounts.push_back(t);
+    }
+  }
+  ThreadCounts.push_back(nThreads);
+
+  BatchReport Report;
+  double BaseRate = 0;
+  for (size_t i = 0; i < ThreadCounts.size(); i++) {
+    auto Start = std::chrono::steady_clock::now();
+    Report = RunBatches(M, *Agent, Cfg, ThreadCounts[i]);
+    double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    double SessionRate = Cfg.nSessions / Seconds;
+    BaseRate = (i == 0) ? SessionRate : BaseRate;
+    printf("threads %3d: %10.1f sessions/s  %8.1f Mcycles/s  speedup %.2fx\n", ThreadCounts[i], SessionRate,
+           Report.TotalCycles / Seconds / 1e6, SessionRate / BaseRate);
+  }
+
+  printf("\n%d sessions x %d trials, agent %s, %d states\n", Cfg.nSessions, Cfg.nTrials, AgentName, M.nStates);
+  printf("trial duration (s): min %.4f  mean %.4f  max %.4f  (%llu timed out at %.1f s)\n",
+         Report.MinTrialCycles / 10000.0, Report.TotalCycles / 10000.0 / (Report.nTrials ? Report.nTrials : 1),
+         Report.MaxTrialCycles / 10000.0, (unsigned long long)Report.nTimeouts, Cfg.MaxTrialCycles / 10000.0);
+  printf("max events/trial %u (buffer 10000, %llu trials overflowed)\n", Report.MaxEvents, (unsigned long long)Report.EventOverflows);
+  printf("max states/trial %u (buffer 1024, %llu trials overflowed)\n", Report.MaxTransitions, (unsigned long long)Report.TransitionOverflows);
+  // Firmware dump at --baud (10 bits per byte)
+  double ByteMs = 10000 / Baud;
+  double nTrials = Report.nTrials ? Report.nTrials : 1;
+  double MeanDump = Report.DumpBytes / nTrials;
+  double MeanDumpMs = DumpMs(MeanDump, Report.DumpEvents / nTrials, Report.DumpStates / nTrials, ByteMs);
+  printf("trial dump at %.0f baud: mean %.0f bytes (%.1f ms)  max %u bytes (%.1f ms)\n", Baud, MeanDump, MeanDumpMs,
+         Report.MaxDumpBytes, DumpMs(Report.MaxDumpBytes, Report.MaxDumpEvents, Report.MaxDumpStates, ByteMs));
+  // Estimated gap between trials. Round trip: the dump, then SendStateMatrix (image + acknowledgement) and 'R'.
+  // Block mode: the Bpod loads the next image from its pool once ITI has elapsed; the 13-byte trial summary is sent
+  // while the next trial runs. Neither Apod's processing nor the Bpod's matrix load from the pool is included.
+  double MeanTrialMs = Report.TotalCycles / 10.0 / nTrials;
+  double RoundTripGap = MeanDumpMs + (ImageBytes + 1 + 1) * ByteMs;
+  double BlockGap = ITI * 1000;
+  printf("estimated gap between trials: round trip (dump, %d-byte matrix upload, run) %.1f ms -> %.1f trials/min; "
+         "block mode (ITI %.3f s) %.1f ms -> %.1f trials/min (%+.1f%%)\n", ImageBytes, RoundTripGap,
+         60000 / (MeanTrialMs + RoundTripGap), ITI, BlockGap, 60000 / (MeanTrialMs + BlockGap),
+         100 * ((MeanTrialMs + RoundTripGap) / (MeanTrialMs + BlockGap) - 1));
+  const char* ClassNames[ApodEventClasses] = {"Port", "BNC", "Wire", "SoftCode", "Tup", "GlobalTimer", "GlobalCounter"};
+  printf("events not recorded (event mask), per trial:");
+  for (int x = 0; x < ApodEventClasses; x++) {
+    printf("  %s %.1f", ClassNames[x], Report.DroppedEvents[x] / (double)(Report.nTrials ? Report.nTrials : 1));
+  }
+  printf("\n");
+  printf("output writes per state entry (modelled, as Apod::GetTransitionLatency counts them on the Bpod): "
+         "every output %.1f, changed only (output plans) %.2f\n",
+         Report.FullOutputWrites / (double)(Report.StateEntries ? Report.StateEntries : 1),
+         Report.PlanOutputWrites / (double)(Report.StateEntries ? Report.StateEntries : 1));
+  printf("state    visits/trial  reached in %% of trials\n");
+  for (int x = 0; x < M.nStates; x++) {
+    printf("%5d  %12.3f  %10.2f\n", x, Report.StateVisits[x] / (double)(Report.nTrials ? Report.nTrials : 1),
+           100.0 * Report.StateReached[x] / (Report.nTrials ? Report.nTrials : 1));
+  }
+  return 0;
+}
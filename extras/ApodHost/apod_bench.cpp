@@ -0,0 +1,737 @@
+/*
+   apod_bench.cpp - Benchmarks for the Apod library (built on the PC with ArduinoHost/) and the state machine model
+   (ApodEngine.h), with a stored baseline to catch regressions. Scenarios:
+     build/N       EmptyMatrix + CreateState / AddState of an N-state matrix
+     serialize/N   SendStateMatrix of that matrix into an in-memory stream (the Bpod's ack is immediate)
+     parse/N       ReceiveBpodData of a trial with N events from an in-memory stream
+     encode/example, encode/stress128
+                   Size of the matrix image with dense rows ('P', dense_bytes) and as Apod sends it (sparse 'C' rows
+                   when shorter, bytes): the task of Apod_example.ino, and 128 states with 3 pseudo-random input
+                   transitions, a timer and a PWM output each
+     model_tick/idle, model_tick/heavy
+                   ApodEngine::Tick with no input events, and with 4 port events on every cycle. This is the host
+                   model of the state machine only, not the firmware handler(): its output plans, analog sampling and
+                   event forwarding are not modelled, so handler() regressions do not show here
+     handler/idle, handler/heavy, handler/closed_loop, handler/switch, handler/switch_full
+                   The firmware's own timer handler, built on the PC with stubbed I/O (FirmwareHost.h) and set up by
+                   Apod over an in-memory link: the model_tick task and inputs; the same with 2 analog lines sampled
+                   (one crossing its threshold every cycle), a pulse train on PWM8 and Port1In forwarded; and a state
+                   change on every second cycle, writing changed outputs only (switch) and every output
+                   (switch_full, Apod::SetFullOutputWrites), with the outputs written per state entry as the
+                   firmware counts them. Register writes, analogWrite and SPI cost nothing here, so these are not Due
+                   timings (see Apod::GetTransitionLatency): they catch regressions in the handler's own logic
+     turnaround    EmptyMatrix, build, SendStateMatrix, RunStateMatrix, ReceiveBpodData of a short trial, against a
+                   simulated Bpod (ApodEngine behind an in-memory stream; the trial itself takes no time)
+   Times are the best of several repetitions, per matrix / call / tick / trial. Byte counts and the serial time they
+   take at 115200 baud (link_us) are exact. Every metric is a cost: lower is better.
+   Output is CSV (benchmark,metric,value,unit,tolerance), or JSON with --json. The CSV output can be stored as a
+   baseline; with --baseline, each result is compared against it (allowed increase: tolerance, as a fraction) and the
+   exit status is 1 if any regressed. --tolerance sets the tolerance of time results (default 0.25), and overrides
+   the baseline's in the comparison: raise it on a machine with frequency scaling or other load. Times depend on the
+   machine: keep a baseline per machine (apod_bench > apod_bench_baseline.csv); apod_bench_baseline.csv in this
+   folder is an example.
+   Build: g++ -O2 -std=c++11 -iquote ArduinoHost -I DueHost -o apod_bench apod_bench.cpp FirmwareHost.cpp ../../Apod.cpp
+   Usage: apod_bench [--json] [--baseline FILE] [--tolerance FRACTION] [--filter PREFIX] [--quick]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "../../Apod.h"
+#include "ApodEngine.h"
+#include "FirmwareHost.h"
+
+static double Now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int Repetitions = 9;
+static double MinRepetitionTime = 0.02; // s
+
+// Best of Repetitions of the time per call of Body, in ns (interference only adds time). The call count per repetition
+// is calibrated first.
+template <class F> double Measure(F Body) {
+  long Calls = 1;
+  while (true) {
+    double Start = Now();
+    for (long i = 0; i < Calls; i++) {
+      Body();
+    }
+    if (Now() - Start >= MinRepetitionTime / 4) {
+      Calls = (long)(Calls * MinRepetitionTime / (Now() - Start)) + 1;
+      break;
+    }
+    Calls *= 4;
+  }
+  std::vector<double> Times;
+  for (int r = 0; r < Repetitions; r++) {
+    double Start = Now();
+    for (long i = 0; i < Calls; i++) {
+      Body();
+    }
+    Times.push_back((Now() - Start) * 1e9 / Calls);
+  }
+  return *std::min_element(Times.begin(), Times.end());
+}
+
+// Collects what Apod writes
+class BufferStream : public Stream {
+  public:
+    std::vector<uint8_t> Data;
+    size_t write(uint8_t b) { Data.push_back(b); return 1; }
+    using Print::write;
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+};
+
+// Answers every command with the ack byte 1 as soon as Apod reads
+class AckStream : public Stream {
+  public:
+    unsigned long Written = 0;
+    bool Pending = false;
+    size_t write(uint8_t) { Written++; Pending = true; return 1; }
+    using Print::write;
+    int available() { return Pending ? 1 : 0; }
+    int read() { Pending = false; return 1; }
+    int peek() { return Pending ? 1 : -1; }
+};
+
+// Serves the same bytes again after each Rewind
+class ReplayStream : public Stream {
+  public:
+    std::vector<uint8_t> Data;
+    size_t Position = 0;
+    void Rewind() { Position = 0; }
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+    int available() { return Data.size() - Position; }
+    int read() { return Position < Data.size() ? Data[Position++] : -1; }
+    int peek() { return Position < Data.size() ? Data[Position] : -1; }
+};
+
+static void PutShort(std::vector<uint8_t>& Out, uint16_t n) {
+  Out.push_back(n & 0xFF);
+  Out.push_back(n >> 8);
+}
+static void PutLong(std::vector<uint8_t>& Out, uint32_t n) {
+  PutShort(Out, n & 0xFFFF);
+  PutShort(Out, n >> 16);
+}
+
+// End-of-trial data as the firmware sends it (op code 1 included)
+static void PutTrialData(std::vector<uint8_t>& Out, int nEvents, const uint8_t* Events, const uint32_t* TimeStamps,
+                         int nTransition, const uint8_t* States) {
+  Out.push_back(1);
+  PutShort(Out, nEvents);
+  for (int i = 0; i < nEvents; i++) {
+    Out.push_back(Events[i]);
+    PutLong(Out, TimeStamps[i]);
+  }
+  PutShort(Out, nTransition);
+  Out.insert(Out.end(), States, States + nTransition);
+  for (int i = 0; i < 7 + 2; i++) {
+    PutShort(Out, 0); // Dropped events per class, virtual event and forwarded event overflows
+  }
+}
+
+// The Bpod, with ApodEngine as its state machine. Commands are handled when Apod next reads. Trials run to the end
+// as soon as they are started, driven by a fixed list of (cycle, event code) inputs.
+class SimBpod : public Stream {
+  public:
+    std::vector<std::pair<uint32_t, uint8_t> > Inputs;
+    unsigned long BytesIn = 0, BytesOut = 0;
+
+    size_t write(uint8_t b) { In.push_back(b); BytesIn++; return 1; }
+    using Print::write;
+    int available() { Process(); return Out.size() - OutPosition; }
+    int read() { Process(); BytesOut += (OutPosition < Out.size()); return OutPosition < Out.size() ? Out[OutPosition++] : -1; }
+    int peek() { Process(); return OutPosition < Out.size() ? Out[OutPosition] : -1; }
+
+  private:
+    std::vector<uint8_t> In, Out;
+    size_t OutPosition = 0;
+    ApodMatrix Matrix;
+    ApodEngine Engine;
+
+    void Process() {
+      if (OutPosition == Out.size()) {
+        Out.clear();
+        OutPosition = 0;
+      }
+      size_t Index = 0;
+      while (Index < In.size()) {
+        uint8_t Op = In[Index];
+        if (Op == '6') {
+          Out.push_back('5');
+          Index++;
+        } else if (Op == 'K') {
+          Out.push_back('K');
+          Out.push_back(28); // Record as sent by Bpod_Firmware_0_5_modified
+          Out.push_back(6);
+          PutLong(Out, 511);
+          Out.push_back(128); Out.push_back(5); Out.push_back(5); Out.push_back(19);
+          PutShort(Out, 100); PutShort(Out, 10000); PutShort(Out, 1024);
+          Out.push_back(128); Out.push_back(4); PutShort(Out, 256);
+          PutShort(Out, 9410); PutShort(Out, 1024);
+          Out.push_back(64); Out.push_back(4); PutShort(Out, 2048); Out.push_back(64);
+          Index++;
+        } else if (Op == 'P' || Op == 'C') {
+          int Length = ApodParseStateMatrix(&In[Index], In.size() - Index, Matrix);
+          if (Length < 0) {
+            fprintf(stderr, "SimBpod: malformed state matrix\n");
+            exit(2);
+          }
+          Out.push_back(1);
+          Index += Length;
+        } else if (Op == 'R') {
+          Out.push_back(1);
+          Index++;
+          RunTrial();
+        } else {
+          fprintf(stderr, "SimBpod: unexpected op code %d\n", Op);
+          exit(2);
+        }
+      }
+      In.clear();
+    }
+
+    void RunTrial() {
+      Engine.Start(&Matrix);
+      size_t Next = 0;
+      for (uint32_t Cycle = 1; Cycle < 10000000; Cycle++) {
+        uint8_t Events[ApodMaxCycleInputs];
+        int n = 0;
+        while (Next < Inputs.size() && Inputs[Next].first == Cycle && n < ApodMaxCycleInputs) {
+          Events[n++] = Inputs[Next++].second;
+        }
+        if (!Engine.Tick(Events, n)) {
+          break;
+        }
+      }
+      PutTrialData(Out, Engine.nEvents, Engine.Events, Engine.TimeStamps, Engine.nTransition, Engine.StateVisited);
+    }
+};
+
+// N-state chain: each state moves on on Port1In or after 1 ms, opens a valve and sets BNC 1; the last one exits.
+// Conditions and outputs are prepared once, as a task would keep them in static arrays.
+struct ChainMatrix {
+  int nStates;
+  std::vector<String> Names;
+  std::vector<StateChange> Conditions; // 2 per state
+  std::vector<OutputAction> Outputs;   // 2 per state
+
+  explicit ChainMatrix(int n) : nStates(n) {
+    for (int i = 0; i < n; i++) {
+      Names.push_back(String(("State" + std::to_string(i)).c_str()));
+    }
+    for (int i = 0; i < n; i++) {
+      String Next = (i + 1 < n) ? Names[i + 1] : String("exit");
+      StateChange Poke = {"Port1In", Next};
+      StateChange Timeout = {"Tup", Next};
+      Conditions.push_back(Poke);
+      Conditions.push_back(Timeout);
+      OutputAction Valve = {"ValveState", 1 << (i % 8)};
+      OutputAction BNC = {"BNCState", 1};
+      Outputs.push_back(Valve);
+      Outputs.push_back(BNC);
+    }
+  }
+
+  void Build(Apod& apod) {
+    apod.EmptyMatrix();
+    for (int i = 0; i < nStates; i++) {
+      States s = apod.CreateState(Names[i], 0.001, 2, &Conditions[2 * i], 2, &Outputs[2 * i]);
+      apod.AddState(&s);
+    }
+  }
+};
+
+// 128 states, each with 3 input transitions to pseudo-random states, a timer moving on to the next state and one
+// PWM output; most matrix entries are still defaults, as in real tasks
+struct StressMatrix {
+  std::vector<String> Names;
+  std::vector<StateChange> Conditions; // 4 per state
+  std::vector<OutputAction> Outputs;   // 1 per state
+  std::vector<float> Timers;
+
+  StressMatrix() {
+    const int n = 128;
+    uint32_t Seed = 1;
+    auto Random = [&](uint32_t Range) {
+      Seed = Seed * 1664525 + 1013904223;
+      return (Seed >> 8) % Range;
+    };
+    for (int i = 0; i < n; i++) {
+      Names.push_back(String(("State" + std::to_string(i)).c_str()));
+    }
+    for (int i = 0; i < n; i++) {
+      int Codes[3];
+      for (int c = 0; c < 3; c++) {
+        bool Repeated;
+        do {
+          Codes[c] = Random(38); // Port, BNC, wire and soft code events
+          Repeated = false;
+          for (int k = 0; k < c; k++) {
+            Repeated = Repeated || (Codes[k] == Codes[c]);
+          }
+        } while (Repeated);
+        uint32_t Target = Random(n + 1);
+        StateChange Change = {EventNames[Codes[c]], Target < (uint32_t)n ? Names[Target] : String("exit")};
+        Conditions.push_back(Change);
+      }
+      StateChange Timeout = {"Tup", (i + 1 < n) ? Names[i + 1] : String("exit")};
+      Conditions.push_back(Timeout);
+      OutputAction PWM = {OutputActionNames[9 + Random(8)], 255};
+      Outputs.push_back(PWM);
+      Timers.push_back((1 + Random(9999)) / 10000.0);
+    }
+  }
+
+  void Build(Apod& apod) {
+    apod.EmptyMatrix();
+    for (size_t i = 0; i < Names.size(); i++) {
+      States s = apod.CreateState(Names[i], Timers[i], 4, &Conditions[4 * i], 1, &Outputs[i]);
+      apod.AddState(&s);
+    }
+  }
+};
+
+// The two-alternative task of Apod_example.ino
+struct ChoiceTask {
+  StateChange WaitForChoice[2] = {{"Port1In", "FlashPort1"}, {"Port2In", "FlashPort2"}};
+  StateChange Flash[1] = {{"Tup", "WaitForExit"}};
+  StateChange WaitForExit[3] = {{"Port1In", "exit"}, {"Port2In", "exit"}, {"Port3In", "WaitForChoice"}};
+  OutputAction FlashPort1Output[2] = {{"BNCState", 1}, {"ValveState", 1}};
+  OutputAction FlashPort2Output[2] = {{"PWM7", 255}, {"ValveState", 2}};
+
+  void Build(Apod& apod) {
+    apod.EmptyMatrix();
+    States s[4];
+    s[0] = apod.CreateState("WaitForChoice", 0, 2, WaitForChoice, 0, 0);
+    s[1] = apod.CreateState("FlashPort1", 0.1, 1, Flash, 2, FlashPort1Output);
+    s[2] = apod.CreateState("FlashPort2", 0.1, 1, Flash, 2, FlashPort2Output);
+    s[3] = apod.CreateState("WaitForExit", 0, 3, WaitForExit, 0, 0);
+    for (int i = 0; i < 4; i++) {
+      apod.AddState(&s[i]);
+    }
+  }
+};
+
+// Two states swapped by Port1In and Port1Out, with different outputs: a state change whenever port 1 changes
+struct SwitchTask {
+  StateChange ToB[1] = {{"Port1In", "B"}};
+  StateChange ToA[1] = {{"Port1Out", "A"}};
+  OutputAction AOutput[2] = {{"BNCState", 1}, {"ValveState", 1}};
+  OutputAction BOutput[2] = {{"PWM7", 255}, {"ValveState", 2}};
+
+  void Build(Apod& apod) {
+    apod.EmptyMatrix();
+    States s[2];
+    s[0] = apod.CreateState("A", 0, 1, ToB, 2, AOutput);
+    s[1] = apod.CreateState("B", 0, 1, ToA, 2, BOutput);
+    for (int i = 0; i < 2; i++) {
+      apod.AddState(&s[i]);
+    }
+  }
+};
+
+// The firmware on the PC (FirmwareHost.h): what Apod writes reaches it when Apod next looks for a reply
+class FirmwareStream : public Stream {
+  public:
+    std::vector<uint8_t> Pending;
+    size_t write(uint8_t b) { Pending.push_back(b); return 1; }
+    using Print::write;
+    int available() { Deliver(); return FirmwareAvailable(); }
+    int read() { Deliver(); return FirmwareRead(); }
+    int peek() { Deliver(); return FirmwarePeek(); }
+
+  private:
+    void Deliver() {
+      if (!Pending.empty()) {
+        FirmwareReceive(Pending.data(), Pending.size());
+        Pending.clear();
+      }
+    }
+};
+
+struct Result {
+  std::string Benchmark, Metric;
+  double Value;
+  std::string Unit;
+  double Tolerance;
+};
+
+static std::vector<Result> Results;
+static std::string Filter;
+static double TimeTolerance = 0.25;
+static bool TimeToleranceGiven = false;
+
+// Benchmark matches the filter, or is a group ("handler/") holding benchmarks that do
+static bool Selected(const std::string& Benchmark) {
+  return (Benchmark.compare(0, Filter.size(), Filter) == 0) || (Filter.compare(0, Benchmark.size(), Benchmark) == 0);
+}
+
+static void AddTime(const std::string& Benchmark, double ns) {
+  Result r = {Benchmark, "time", floor(ns * 10 + 0.5) / 10, "ns", TimeTolerance};
+  Results.push_back(r);
+}
+
+static void AddExact(const std::string& Benchmark, const std::string& Metric, double Value, const std::string& Unit) {
+  Result r = {Benchmark, Metric, Value, Unit, 0};
+  Results.push_back(r);
+}
+
+static void AddLinkTime(const std::string& Benchmark, double Bytes) {
+  AddExact(Benchmark, "link_us", (double)(long)(Bytes * 10 / 115200 * 1e6 + 0.5), "us");
+}
+
+// Image size of Task's matrix with dense rows and as sent; both must parse to the same matrix
+template <class T> static void AddEncoding(const std::string& Name, T& Task) {
+  static BufferStream Dense, Sent;
+  static ApodMatrix DenseMatrix, SentMatrix;
+  Apod* apod = new Apod(Dense);
+  Task.Build(*apod);
+  Dense.Data.clear();
+  Sent.Data.clear();
+  apod->bpod_caps.Features &= ~FeatureSparseMatrix;
+  apod->WriteStateMatrix(Dense);
+  apod->bpod_caps.Features |= FeatureSparseMatrix;
+  apod->WriteStateMatrix(Sent);
+  delete apod;
+  memset(&DenseMatrix, 0, sizeof(DenseMatrix));
+  memset(&SentMatrix, 0, sizeof(SentMatrix));
+  if (Dense.Data[0] != 'P' || ApodParseStateMatrix(Dense.Data.data(), Dense.Data.size(), DenseMatrix) != (int)Dense.Data.size() ||
+      ApodParseStateMatrix(Sent.Data.data(), Sent.Data.size(), SentMatrix) != (int)Sent.Data.size() ||
+      memcmp(&DenseMatrix, &SentMatrix, sizeof(DenseMatrix)) != 0) {
+    fprintf(stderr, "%s: dense and sent images differ\n", Name.c_str());
+    exit(2);
+  }
+  AddExact(Name, "dense_bytes", Dense.Data.size(), "B");
+  AddExact(Name, "bytes", Sent.Data.size(), "B");
+  AddLinkTime(Name, Sent.Data.size());
+}
+
+static void RunBenchmarks() {
+  static BufferStream Discard;
+  static AckStream Acks;
+  static ReplayStream Replay;
+  static SimBpod Bpod;
+
+  const int Sizes[4] = {4, 16, 64, 128};
+  for (int s = 0; s < 4; s++) {
+    std::string Name = "build/" + std::to_string(Sizes[s]);
+    if (!Selected(Name)) {
+      continue;
+    }
+    ChainMatrix Chain(Sizes[s]);
+    Apod* apod = new Apod(Discard);
+    AddTime(Name, Measure([&]() { Chain.Build(*apod); }));
+    delete apod;
+  }
+
+  for (int s = 0; s < 4; s++) {
+    std::string Name = "serialize/" + std::to_string(Sizes[s]);
+    if (!Selected(Name)) {
+      continue;
+    }
+    ChainMatrix Chain(Sizes[s]);
+    Apod* apod = new Apod(Acks);
+    Chain.Build(*apod);
+    Acks.Written = 0;
+    apod->SendStateMatrix();
+    unsigned long Bytes = Acks.Written;
+    AddTime(Name, Measure([&]() { apod->SendStateMatrix(); }));
+    AddExact(Name, "bytes", Bytes, "B");
+    AddLinkTime(Name, Bytes);
+    delete apod;
+  }
+
+  const int EventCounts[3] = {100, 1000, 10000};
+  for (int s = 0; s < 3; s++) {
+    std::string Name = "parse/" + std::to_string(EventCounts[s]);
+    if (!Selected(Name)) {
+      continue;
+    }
+    int n = EventCounts[s];
+    std::vector<uint8_t> Events(n), States(std::min(n / 4 + 1, ApodMaxTransitions));
+    std::vector<uint32_t> TimeStamps(n);
+    for (int i = 0; i < n; i++) {
+      Events[i] = i % 16; // Port1In, Port1Out, ...
+      TimeStamps[i] = 20 * i + 7;
+    }
+    for (size_t i = 0; i < States.size(); i++) {
+      States[i] = i % 4;
+    }
+    Replay.Data.clear();
+    PutTrialData(Replay.Data, n, Events.data(), TimeStamps.data(), States.size(), States.data());
+    Apod* apod = new Apod(Replay);
+    AddTime(Name, Measure([&]() {
+      Replay.Rewind();
+      apod->ReceiveBpodData();
+    }));
+    if (apod->trial_res.nEvents != n || apod->trial_res.eventTimeStamps[n - 1] != TimeStamps[n - 1]) {
+      fprintf(stderr, "%s: trial data not read back correctly\n", Name.c_str());
+      exit(2);
+    }
+    AddExact(Name, "bytes", Replay.Data.size(), "B");
+    AddLinkTime(Name, Replay.Data.size());
+    delete apod;
+  }
+
+  if (Selected("encode/example")) {
+    ChoiceTask Task;
+    AddEncoding("encode/example", Task);
+  }
+  if (Selected("encode/stress128")) {
+    StressMatrix Task;
+    AddEncoding("encode/stress128", Task);
+  }
+
+  if (Selected("model_tick/")) {
+    static ApodMatrix Matrix;
+    static ApodEngine Engine;
+    ChoiceTask Task;
+    Apod* apod = new Apod(Discard);
+    Task.Build(*apod);
+    Discard.Data.clear();
+    apod->WriteStateMatrix(Discard);
+    ApodParseStateMatrix(Discard.Data.data(), Discard.Data.size(), Matrix);
+    delete apod;
+    Engine.Start(&Matrix);
+    if (Selected("model_tick/idle")) {
+      AddTime("model_tick/idle", Measure([&]() { Engine.Tick(0, 0); })); // Waits for a choice
+    }
+    if (Selected("model_tick/heavy")) {
+      // Ports 1-4 in on one cycle, out on the next (Port3In in WaitForExit goes back to WaitForChoice, so the
+      // matrix keeps running); the trial restarts before the event buffer fills
+      const uint8_t In[4] = {0, 2, 4, 6};
+      const uint8_t Out[4] = {1, 3, 5, 7};
+      uint32_t Cycle = 0;
+      Engine.Start(&Matrix);
+      AddTime("model_tick/heavy", Measure([&]() {
+        if (Engine.nEvents > ApodMaxEvents - 100 || Engine.Finished) {
+          Engine.Start(&Matrix);
+        }
+        Engine.Tick((Cycle++ & 1) ? Out : In, 4);
+      }));
+    }
+  }
+
+  if (Selected("handler/")) {
+    static FirmwareStream Firmware;
+    static bool Connected = false;
+    static Apod* apod = new Apod(Firmware);
+    if (!Connected) {
+      FirmwareSetup();
+      apod->HandShakeBpod(1000);
+      Connected = true;
+    }
+    uint32_t Cycle = 0;
+    // One cycle with ports 1-4 in, the next with them out; the trial restarts when it ends or its event buffer fills
+    auto HeavyTick = [&]() {
+      FirmwareKeepRunning();
+      FirmwareSetPortInputs((Cycle++ & 1) ? 0 : 15);
+      FirmwareTick();
+    };
+    ChoiceTask Task;
+    Task.Build(*apod);
+    apod->SendStateMatrix();
+    if (Selected("handler/idle")) {
+      FirmwareSetPortInputs(0);
+      apod->RunStateMatrix();
+      AddTime("handler/idle", Measure([&]() { FirmwareKeepRunning(); FirmwareTick(); })); // Waits for a choice
+      FirmwareStop();
+    }
+    if (Selected("handler/heavy")) {
+      apod->RunStateMatrix();
+      AddTime("handler/heavy", Measure(HeavyTick));
+      FirmwareStop();
+    }
+    if (Selected("handler/closed_loop")) {
+      apod->StartAnalogInput(3, 0.0001);
+      apod->SetAnalogThreshold(1, 3000, 1000);
+      apod->LoadPulseTrain(1, "PWM8", 255, 0.0002, 0.0004, 0);
+      apod->SetEventHandler("Port1In", [](Apod&, byte) {});
+      StateChange WaitForChoice[2] = {{"Port1In", "FlashPort1"}, {"Port2In", "FlashPort2"}};
+      OutputAction Trigger[1] = {{"WaveTrig", 1}};
+      apod->EmptyMatrix();
+      States s[4];
+      s[0] = apod->CreateState("WaitForChoice", 0, 2, WaitForChoice, 1, Trigger);
+      s[1] = apod->CreateState("FlashPort1", 0.1, 1, Task.Flash, 2, Task.FlashPort1Output);
+      s[2] = apod->CreateState("FlashPort2", 0.1, 1, Task.Flash, 2, Task.FlashPort2Output);
+      s[3] = apod->CreateState("WaitForExit", 0, 3, Task.WaitForExit, 0, 0);
+      for (int i = 0; i < 4; i++) {
+        apod->AddState(&s[i]);
+      }
+      apod->SendStateMatrix();
+      apod->RunStateMatrix();
+      AddTime("handler/closed_loop", Measure([&]() {
+        FirmwareSetAnalogInput(0, (Cycle & 1) ? 0 : 4095);
+        HeavyTick();
+      }));
+      FirmwareStop();
+      apod->StopAnalogInput();
+      apod->ClearAnalogThreshold(1);
+      apod->ClearWaves();
+      apod->SetEventHandler("Port1In", 0);
+    }
+    SwitchTask Switch;
+    Switch.Build(*apod);
+    apod->SendStateMatrix();
+    for (int Full = 0; Full < 2; Full++) {
+      std::string Name = Full ? "handler/switch_full" : "handler/switch";
+      if (!Selected(Name)) {
+        continue;
+      }
+      apod->SetFullOutputWrites(Full);
+      apod->RunStateMatrix();
+      apod->GetTransitionLatency();
+      AddTime(Name, Measure([&]() {
+        FirmwareKeepRunning();
+        FirmwareSetPortInputs((Cycle++ & 1) ? 0 : 1);
+        FirmwareTick();
+      }));
+      unsigned long Entries = 0, Writes = 0;
+      apod->GetTransitionLatency(&Entries, &Writes);
+      AddExact(Name, "output_writes", floor(100.0 * Writes / (Entries ? Entries : 1) + 0.5) / 100, "per_entry");
+      FirmwareStop();
+    }
+    apod->SetFullOutputWrites(false);
+  }
+
+  if (Selected("turnaround")) {
+    ChoiceTask Task;
+    Bpod.Inputs.clear();
+    Bpod.Inputs.push_back(std::make_pair(50, 0));   // Port1In: FlashPort1 for 0.1 s
+    Bpod.Inputs.push_back(std::make_pair(60, 1));   // Port1Out
+    Bpod.Inputs.push_back(std::make_pair(1200, 0)); // Port1In in WaitForExit: exit
+    Bpod.Inputs.push_back(std::make_pair(1210, 1));
+    Apod* apod = new Apod(Bpod);
+    apod->HandShakeBpod(1000);
+    auto Trial = [&]() {
+      Task.Build(*apod);
+      apod->SendStateMatrix();
+      apod->RunStateMatrix();
+      while (apod->DataReceived() == 0) {}
+      apod->ReceiveBpodData();
+    };
+    Trial();
+    Bpod.BytesIn = 0;
+    Bpod.BytesOut = 0;
+    Trial();
+    unsigned long BytesIn = Bpod.BytesIn, BytesOut = Bpod.BytesOut;
+    if (apod->trial_res.nTransition != 3) {
+      fprintf(stderr, "turnaround: unexpected trial (%d states visited)\n", apod->trial_res.nTransition);
+      exit(2);
+    }
+    AddTime("turnaround", Measure(Trial));
+    AddExact("turnaround", "bytes_to_bpod", BytesIn, "B");
+    AddExact("turnaround", "bytes_from_bpod", BytesOut, "B");
+    AddLinkTime("turnaround", BytesIn + BytesOut);
+    delete apod;
+  }
+}
+
+struct BaselineEntry {
+  double Value;
+  double Tolerance;
+};
+
+static bool LoadBaseline(const char* Path, std::map<std::string, BaselineEntry>& Baseline) {
+  FILE* File = fopen(Path, "r");
+  if (!File) {
+    fprintf(stderr, "Cannot open %s\n", Path);
+    return false;
+  }
+  char Line[512];
+  while (fgets(Line, sizeof(Line), File)) {
+    char Benchmark[128], Metric[64], Unit[16];
+    BaselineEntry e;
+    if (sscanf(Line, "%127[^,],%63[^,],%lf,%15[^,],%lf", Benchmark, Metric, &e.Value, Unit, &e.Tolerance) == 5) {
+      Baseline[std::string(Benchmark) + "," + Metric] = e;
+    }
+  }
+  fclose(File);
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool Json = false;
+  const char* BaselinePath = 0;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--json")) Json = true;
+    else if (!strcmp(argv[i], "--baseline") && HasValue) BaselinePath = argv[++i];
+    else if (!strcmp(argv[i], "--tolerance") && HasValue) { TimeTolerance = atof(argv[++i]); TimeToleranceGiven = true; }
+    else if (!strcmp(argv[i], "--filter") && HasValue) Filter = argv[++i];
+    else if (!strcmp(argv[i], "--quick")) { Repetitions = 3; MinRepetitionTime = 0.005; }
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  std::map<std::string, BaselineEntry> Baseline;
+  if (BaselinePath && !LoadBaseline(BaselinePath, Baseline)) {
+    return 2;
+  }
+
+  RunBenchmarks();
+
+  // Compare: a result regresses when it exceeds the baseline by more than the baseline's tolerance
+  int nRegressed = 0;
+  std::vector<std::string> Status(Results.size());
+  std::vector<double> Reference(Results.size(), 0);
+  for (size_t i = 0; i < Results.size() && BaselinePath; i++) {
+    std::map<std::string, BaselineEntry>::const_iterator b = Baseline.find(Results[i].Benchmark + "," + Results[i].Metric);
+    if (b == Baseline.end()) {
+      Status[i] = "new";
+      continue;
+    }
+    Reference[i] = b->second.Value;
+    double Tolerance = (TimeToleranceGiven && Results[i].Metric == "time") ? TimeTolerance : b->second.Tolerance;
+    if (Results[i].Value > b->second.Value * (1 + Tolerance) + 1e-9) {
+      Status[i] = "regressed";
+      nRegressed++;
+    } else if (Results[i].Value * (1 + Tolerance) < b->second.Value - 1e-9) {
+      Status[i] = "improved";
+    } else {
+      Status[i] = "ok";
+    }
+  }
+
+  if (Json) {
+    printf("[\n");
+    for (size_t i = 0; i < Results.size(); i++) {
+      const Result& r = Results[i];
+      printf("  {\"benchmark\": \"%s\", \"metric\": \"%s\", \"value\": %.10g, \"unit\": \"%s\", \"tolerance\": %.10g",
+             r.Benchmark.c_str(), r.Metric.c_str(), r.Value, r.Unit.c_str(), r.Tolerance);
+      if (BaselinePath) {
+        printf(", \"baseline\": %.10g, \"status\": \"%s\"", Reference[i], Status[i].c_str());
+      }
+      printf("}%s\n", i + 1 < Results.size() ? "," : "");
+    }
+    printf("]\n");
+  } else {
+    printf("benchmark,metric,value,unit,tolerance%s\n", BaselinePath ? ",baseline,status" : "");
+    for (size_t i = 0; i < Results.size(); i++) {
+      const Result& r = Results[i];
+      printf("%s,%s,%.10g,%s,%.10g", r.Benchmark.c_str(), r.Metric.c_str(), r.Value, r.Unit.c_str(), r.Tolerance);
+      if (BaselinePath) {
+        printf(",%.10g,%s", Reference[i], Status[i].c_str());
+      }
+      printf("\n");
+    }
+  }
+  if (BaselinePath) {
+    fprintf(stderr, "%d of %zu results regressed against %s\n", nRegressed, Results.size(), BaselinePath);
+  }
+  return nRegressed > 0 ? 1 : 0;
+}
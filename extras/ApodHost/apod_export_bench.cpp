@@ -0,0 +1,267 @@
+/*
+   apod_export_bench.cpp - Load throughput of columnar trial exports (Apod::StartExport) read through ApodExport.h.
+   Without file arguments, writes a synthetic archive (one export per session: the trials are fed to Apod as end-of-trial
+   data and written by Apod::StartExport, so the archive is the library's own output) plus the same trials as text
+   lines ("event time", as printed over SerialUSB) and times both loaders.
+   With file arguments, times loading those exports instead.
+   Build: g++ -O2 -std=c++11 -iquote ArduinoHost -o apod_export_bench apod_export_bench.cpp ../../Apod.cpp
+   Usage: apod_export_bench [--dir DIR] [--sessions N] [--trials N] [--events N] [--chunk N]
+          apod_export_bench session1.apdx [session2.apdx ...]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../../Apod.h"
+#include "ApodExport.h"
+
+static double Now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Export destination: a file
+class FileStream : public Stream {
+  public:
+    explicit FileStream(FILE* f) : File(f) {}
+    size_t write(uint8_t b) { return fputc(b, File) == EOF ? 0 : 1; }
+    size_t write(const uint8_t* Buffer, size_t n) { return fwrite(Buffer, 1, n, File); }
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+
+  private:
+    FILE* File;
+};
+
+// The Bpod's side of the link: serves one trial's end-of-trial data per ReceiveBpodData
+class TrialStream : public Stream {
+  public:
+    std::vector<uint8_t> Data;
+    size_t Position = 0;
+    size_t write(uint8_t) { return 1; }
+    using Print::write;
+    int available() { return Data.size() - Position; }
+    int read() { return Position < Data.size() ? Data[Position++] : -1; }
+    int peek() { return Position < Data.size() ? Data[Position] : -1; }
+};
+
+static void PutShort(std::vector<uint8_t>& Out, uint16_t n) {
+  Out.push_back(n & 0xFF);
+  Out.push_back(n >> 8);
+}
+static void PutLong(std::vector<uint8_t>& Out, uint32_t n) {
+  PutShort(Out, n & 0xFFFF);
+  PutShort(Out, n >> 16);
+}
+
+// End-of-trial data as the firmware sends it (op code 1 included)
+static void PutTrialData(std::vector<uint8_t>& Out, int nEvents, const uint8_t* Events, const uint32_t* TimeStamps,
+                         int nTransition, const uint8_t* States) {
+  Out.push_back(1);
+  PutShort(Out, nEvents);
+  for (int i = 0; i < nEvents; i++) {
+    Out.push_back(Events[i]);
+    PutLong(Out, TimeStamps[i]);
+  }
+  PutShort(Out, nTransition);
+  Out.insert(Out.end(), States, States + nTransition);
+  for (int i = 0; i < 7 + 2; i++) {
+    PutShort(Out, 0); // Dropped events per class, virtual event and forwarded event overflows
+  }
+}
+
+struct LoadResult {
+  uint64_t Bytes = 0, Trials = 0, Events = 0, Checksum = 0;
+  double Seconds = 0;
+};
+
+// Map every export, decode all time stamps and touch every column
+static bool LoadExports(const std::vector<std::string>& Paths, LoadResult& R) {
+  std::vector<uint32_t> TimeStamps(65536);
+  double Start = Now();
+  ApodExportReader Reader;
+  for (size_t f = 0; f < Paths.size(); f++) {
+    if (!Reader.Open(Paths[f].c_str())) {
+      fprintf(stderr, "%s: not a valid Apod export\n", Paths[f].c_str());
+      return false;
+    }
+    R.Bytes += Reader.FileSize();
+    for (const ApodTrialView& Trial : Reader) {
+      if (!Trial.TimeStamps(TimeStamps.data())) {
+        fprintf(stderr, "%s: trial %u: bad time stamp column\n", Paths[f].c_str(), Trial.TrialNumber);
+        return false;
+      }
+      for (int i = 0; i < Trial.nEvents; i++) {
+        R.Checksum += Trial.Events[i] + TimeStamps[i];
+      }
+      for (int i = 0; i < Trial.nTransition; i++) {
+        R.Checksum += Trial.States[i];
+      }
+      R.Events += Trial.nEvents;
+      R.Trials++;
+    }
+  }
+  R.Seconds = Now() - Start;
+  return true;
+}
+
+// Baseline: the same trials as text, "nEvents nTransition", one "event time" line per event, one state per line
+static bool LoadText(const std::vector<std::string>& Paths, LoadResult& R) {
+  double Start = Now();
+  for (size_t f = 0; f < Paths.size(); f++) {
+    FILE* File = fopen(Paths[f].c_str(), "r");
+    if (!File) {
+      return false;
+    }
+    char Line[64];
+    while (fgets(Line, sizeof(Line), File)) {
+      R.Bytes += strlen(Line);
+      char* p;
+      unsigned long nEvents = strtoul(Line, &p, 10);
+      unsigned long nTransition = strtoul(p, 0, 10);
+      for (unsigned long i = 0; i < nEvents && fgets(Line, sizeof(Line), File); i++) {
+        R.Bytes += strlen(Line);
+        unsigned long Code = strtoul(Line, &p, 10);
+        R.Checksum += Code + strtoul(p, 0, 10);
+      }
+      for (unsigned long i = 0; i < nTransition && fgets(Line, sizeof(Line), File); i++) {
+        R.Bytes += strlen(Line);
+        R.Checksum += strtoul(Line, 0, 10);
+      }
+      R.Events += nEvents;
+      R.Trials++;
+    }
+    fclose(File);
+  }
+  R.Seconds = Now() - Start;
+  return true;
+}
+
+static void Report(const char* Name, const LoadResult& R) {
+  printf("%-8s %8.1f MB  %7.3f s  %8.1f MB/s  %10.0f trials/s  %8.1f M events/s\n", Name, R.Bytes / 1e6, R.Seconds,
+         R.Bytes / 1e6 / R.Seconds, R.Trials / R.Seconds, R.Events / 1e6 / R.Seconds);
+}
+
+int main(int argc, char** argv) {
+  std::string Dir = "/tmp/apod_export_bench";
+  int nSessions = 200, nTrials = 500, nEventsMean = 60, ChunkTrials = 32;
+  std::vector<std::string> Files;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--dir") && HasValue) Dir = argv[++i];
+    else if (!strcmp(argv[i], "--sessions") && HasValue) nSessions = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--trials") && HasValue) nTrials = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--events") && HasValue) nEventsMean = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--chunk") && HasValue) ChunkTrials = atoi(argv[++i]);
+    else if (argv[i][0] != '-') Files.push_back(argv[i]);
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  if (!Files.empty()) {
+    LoadResult R;
+    if (!LoadExports(Files, R)) {
+      return 1;
+    }
+    Report("export", R);
+    return 0;
+  }
+
+  if (nSessions < 1 || nTrials < 1 || nEventsMean < 0 || nEventsMean > 6000 || ChunkTrials < 1 ||
+      ChunkTrials > MaxExportChunkTrials) {
+    fprintf(stderr, "Invalid configuration (at most 6000 events per trial, %d trials per chunk)\n", MaxExportChunkTrials);
+    return 2;
+  }
+
+  // Synthetic archive: Poisson-ish inter-event intervals, a few states per trial
+  static TrialStream Bpod;
+  static Apod apod(Bpod);
+  mkdir(Dir.c_str(), 0755);
+  std::vector<std::string> ExportPaths, TextPaths;
+  uint64_t Seed = 12345;
+  std::vector<uint8_t> Events, States;
+  std::vector<uint32_t> TimeStamps;
+  for (int s = 0; s < nSessions; s++) {
+    ExportPaths.push_back(Dir + "/session" + std::to_string(s) + ".apdx");
+    TextPaths.push_back(Dir + "/session" + std::to_string(s) + ".txt");
+    FILE* ExportFile = fopen(ExportPaths.back().c_str(), "wb");
+    FILE* TextFile = fopen(TextPaths.back().c_str(), "w");
+    if (!ExportFile || !TextFile) {
+      perror(Dir.c_str());
+      return 2;
+    }
+    {
+      FileStream Export(ExportFile);
+      apod.StartExport(Export, ChunkTrials);
+      for (int t = 0; t < nTrials; t++) {
+        Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        int nEvents = nEventsMean / 2 + (int)((Seed >> 33) % (uint64_t)(nEventsMean + 1));
+        Events.resize(nEvents);
+        TimeStamps.resize(nEvents);
+        uint32_t Time = 0;
+        for (int i = 0; i < nEvents; i++) {
+          Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          Events[i] = (uint8_t)((Seed >> 40) % 50);
+          Time += 1 + (uint32_t)((Seed >> 20) % 4000);
+          TimeStamps[i] = Time;
+        }
+        int nTransition = 2 + nEvents / 8;
+        States.resize(nTransition);
+        for (int i = 0; i < nTransition; i++) {
+          States[i] = (uint8_t)(i % 16);
+        }
+        Bpod.Data.clear();
+        Bpod.Position = 0;
+        PutTrialData(Bpod.Data, nEvents, Events.data(), TimeStamps.data(), nTransition, States.data());
+        if (apod.ReceiveBpodData() != 0) {
+          fprintf(stderr, "Trial %d of session %d not received\n", t, s);
+          return 1;
+        }
+        fprintf(TextFile, "%d %d\n", nEvents, nTransition);
+        for (int i = 0; i < nEvents; i++) {
+          fprintf(TextFile, "%d %u\n", Events[i], TimeStamps[i]);
+        }
+        for (int i = 0; i < nTransition; i++) {
+          fprintf(TextFile, "%d\n", States[i]);
+        }
+      }
+      apod.StopExport();
+    }
+    fclose(ExportFile);
+    fclose(TextFile);
+  }
+  printf("%d sessions x %d trials, ~%d events/trial, %d trials/chunk in %s\n", nSessions, nTrials, nEventsMean,
+         ChunkTrials, Dir.c_str());
+
+  LoadResult Text, Export;
+  if (!LoadText(TextPaths, Text) || !LoadExports(ExportPaths, Export)) {
+    return 1;
+  }
+  Report("text", Text);
+  Report("export", Export);
+  if (Text.Checksum != Export.Checksum || Text.Events != Export.Events) {
+    printf("Checksum mismatch between text and export\n");
+    return 1;
+  }
+
+  // Random access: one trial from each session, by trial number
+  ApodExportReader Reader;
+  double Start = Now();
+  uint64_t Checksum = 0;
+  for (int s = 0; s < nSessions; s++) {
+    if (Reader.Open(ExportPaths[s].c_str()) && Reader.nTrials() > 0) {
+      const ApodTrialView& Trial = Reader.Trial((s * 7919) % Reader.nTrials());
+      Checksum += Trial.nEvents ? Trial.Events[Trial.nEvents - 1] : 0;
+    }
+  }
+  printf("random access (open + index + 1 trial): %.1f us/session (checksum %llu)\n",
+         (Now() - Start) * 1e6 / nSessions, (unsigned long long)Checksum);
+  return 0;
+}
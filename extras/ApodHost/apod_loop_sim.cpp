@@ -0,0 +1,175 @@
+/*
+   apod_loop_sim.cpp - Closed-loop round trip through event forwarding, in simulated time (1 us steps).
+   Port 1 pokes arrive at random. The Bpod timer handler (every 0.1 ms) sees each poke on its next cycle and queues it
+   for forwarding (Apod::SetEventHandler); the Bpod's loop() sends queued messages (op code 5, event code) over the
+   serial link. The Arduino polls (Apod::PollBpod) every --poll us; its handler answers with a virtual soft event
+   (ManualOverride('V', 'S', 1), 3 bytes), which the Bpod's loop() queues and the timer handler applies on its next
+   cycle. Both queues are the firmware's (Bpod_Firmware_0_5_modified/VirtualEventQueue.h).
+   Reports the round trip from poke to the soft event reaching the state machine (mean / 99th percentile / max),
+   the share answered within 1 ms, link use and queue overflows.
+   Build: g++ -O2 -std=c++11 -o apod_loop_sim apod_loop_sim.cpp
+   Usage: apod_loop_sim [--rate HZ] [--seconds S] [--baud B] [--poll US] [--handler US] [--loop US]
+          --poll: Arduino loop period (its other work between polls); --handler: time the handler runs;
+          --loop: Bpod loop() iteration time
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "../../Bpod_Firmware_0_5_modified/VirtualEventQueue.h"
+
+static VirtualEventQueue<64> VirtualEvents;   // As in the firmware
+static VirtualEventQueue<64> ForwardedEvents;
+
+static uint64_t Seed = 12345;
+
+static double Uniform() {
+  Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((Seed >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// One direction of the serial link (8N1): bytes queued by the sender arrive one byte time apart
+struct Link {
+  double ByteTime;            // us
+  double Free;                // Time the transmitter finishes the last queued byte
+  std::deque<double> Arrival; // Arrival time of each byte in flight or unread
+  std::deque<uint8_t> Bytes;
+  uint64_t Sent;
+
+  void Write(double Now, uint8_t b) {
+    Free = std::max(Free, Now) + ByteTime;
+    Arrival.push_back(Free);
+    Bytes.push_back(b);
+    Sent++;
+  }
+  int Available(double Now) const {
+    int n = 0;
+    while (n < (int)Arrival.size() && Arrival[n] <= Now) {
+      n++;
+    }
+    return n;
+  }
+  uint8_t Peek() const { return Bytes.front(); }
+  uint8_t Read() {
+    uint8_t b = Bytes.front();
+    Bytes.pop_front();
+    Arrival.pop_front();
+    return b;
+  }
+};
+
+int main(int argc, char** argv) {
+  double Rate = 20, Seconds = 60, Baud = 115200, Poll = 20, Handler = 5, LoopTime = 10;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--rate") && HasValue) Rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--seconds") && HasValue) Seconds = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--baud") && HasValue) Baud = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--poll") && HasValue) Poll = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--handler") && HasValue) Handler = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--loop") && HasValue) LoopTime = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (Rate <= 0 || Seconds <= 0 || Baud <= 0 || Poll < 1 || LoopTime < 1) {
+    fprintf(stderr, "Invalid configuration\n");
+    return 2;
+  }
+
+  Link ToArduino = {10e6 / Baud, 0, std::deque<double>(), std::deque<uint8_t>(), 0};
+  Link ToBpod = ToArduino;
+  std::deque<double> Pokes;        // Onsets not yet seen by the timer handler
+  std::deque<double> Outstanding;  // Onsets seen and not yet answered, in order
+  std::vector<double> Latencies;
+  uint64_t nPokes = 0;
+  double NextPoke = -log(Uniform()) * 1e6 / Rate;
+  double NextLoop = 0, NextPoll = 0, ArduinoBusy = 0;
+  uint64_t End = Seconds * 1e6;
+
+  for (uint64_t t = 1; t <= End; t++) {
+    double Now = t;
+    while (NextPoke <= Now) {
+      Pokes.push_back(NextPoke);
+      nPokes++;
+      NextPoke += -log(Uniform()) * 1e6 / Rate;
+    }
+    // Bpod timer handler: apply queued virtual events, then detect and forward this cycle's pokes
+    if (t % 100 == 0) {
+      VirtualEvent Record;
+      if (VirtualEvents.Peek(Record)) { // One soft event per cycle (applyVirtualEvents: one per input line)
+        VirtualEvents.Pop();
+        if (Record.Target == 'S' && !Outstanding.empty()) {
+          Latencies.push_back(Now - Outstanding.front());
+          Outstanding.pop_front();
+        }
+      }
+      if (!Pokes.empty()) { // At most one Port1In per cycle: later onsets wait for the next cycle
+        if (ForwardedEvents.Push(5, 0)) {
+          Outstanding.push_back(Pokes.front());
+        }
+        Pokes.pop_front();
+      }
+    }
+    // Bpod loop(): send forwarded events, then read a command
+    if (Now >= NextLoop) {
+      VirtualEvent Record;
+      while (ForwardedEvents.Peek(Record)) {
+        ToArduino.Write(Now, Record.Target);
+        ToArduino.Write(Now, Record.Data);
+        ForwardedEvents.Pop();
+      }
+      if (ToBpod.Available(Now) >= 3 && ToBpod.Peek() == 'V') {
+        ToBpod.Read();
+        uint8_t Target = ToBpod.Read();
+        uint8_t Data = ToBpod.Read();
+        VirtualEvents.Push(Target, Data);
+      }
+      NextLoop = Now + LoopTime;
+    }
+    // Arduino: PollBpod once per loop, handlers answer with a virtual soft event
+    if (Now >= NextPoll && Now >= ArduinoBusy) {
+      double Busy = 0;
+      while (ToArduino.Available(Now) >= 2 && ToArduino.Peek() == 5) {
+        ToArduino.Read();
+        ToArduino.Read();
+        Busy += Handler;
+        ToBpod.Write(Now + Busy, 'V');
+        ToBpod.Write(Now + Busy, 'S');
+        ToBpod.Write(Now + Busy, 1);
+      }
+      ArduinoBusy = Now + Busy;
+      NextPoll = Now + Busy + Poll;
+    }
+  }
+
+  std::sort(Latencies.begin(), Latencies.end());
+  double Mean = 0;
+  size_t Within = 0;
+  for (size_t i = 0; i < Latencies.size(); i++) {
+    Mean += Latencies[i];
+    Within += (Latencies[i] <= 1000);
+  }
+  Mean = Latencies.empty() ? 0 : Mean / Latencies.size();
+  double P99 = Latencies.empty() ? 0 : Latencies[(size_t)(0.99 * (Latencies.size() - 1))];
+  double Max = Latencies.empty() ? 0 : Latencies.back();
+  double Answered = Latencies.empty() ? 0 : 100.0 * Within / Latencies.size();
+
+  printf("%.0f pokes/s, %.0f s, %.0f baud, Arduino polls every %.0f us, handler %.0f us, Bpod loop %.0f us\n",
+         Rate, Seconds, Baud, Poll, Handler, LoopTime);
+  printf("%llu pokes, %zu answered, %u forward overflows, %u virtual event overflows\n", (unsigned long long)nPokes,
+         Latencies.size(), (unsigned)ForwardedEvents.Overflows, (unsigned)VirtualEvents.Overflows);
+  printf("round trip poke -> soft event in the state machine (us): mean %.1f  p99 %.1f  max %.1f  (%.1f%% within 1 ms)\n",
+         Mean, P99, Max, Answered);
+  printf("link busy: Bpod -> Arduino %.1f%%, Arduino -> Bpod %.1f%%\n", 100.0 * ToArduino.Sent * ToArduino.ByteTime / End,
+         100.0 * ToBpod.Sent * ToBpod.ByteTime / End);
+  bool Ok = (ForwardedEvents.Overflows == 0) && (VirtualEvents.Overflows == 0) && (Max <= 1000);
+  printf("%s\n", Ok ? "PASS" : "FAIL");
+  return Ok ? 0 : 1;
+}
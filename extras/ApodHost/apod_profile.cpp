@@ -0,0 +1,111 @@
+/*
+   apod_profile.cpp - Trial cycle timing report from an Apod session recording (Apod::StartRecording) made while
+   profiling (Apod::StartProfiling). The 'P' records are added up with the same code as on the Arduino
+   (../../ApodProfile.h), so the report matches Apod::PrintProfile. Given a second recording (e.g. after an
+   optimization), both reports are printed, followed by the change in mean time per phase.
+   Build: g++ -O2 -std=c++11 -o apod_profile apod_profile.cpp
+   Usage: apod_profile session.bin [other_session.bin]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "../../ApodProfile.h"
+
+static uint32_t ReadLong(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Adds the 'P' records of the recording at Path to Profile. Returns the number of trials recorded, or -1.
+static int LoadProfile(const char* Path, ApodProfile& Profile) {
+  FILE* File = fopen(Path, "rb");
+  if (!File) {
+    fprintf(stderr, "Cannot open %s\n", Path);
+    return -1;
+  }
+  std::vector<uint8_t> Data;
+  uint8_t Buffer[65536];
+  size_t n;
+  while ((n = fread(Buffer, 1, sizeof(Buffer), File)) > 0) {
+    Data.insert(Data.end(), Buffer, Buffer + n);
+  }
+  fclose(File);
+  if (Data.size() < 5 || memcmp(Data.data(), "APOD", 4) != 0 || Data[4] < 1 || Data[4] > 2) {
+    fprintf(stderr, "%s: not an Apod session recording (version 1 or 2)\n", Path);
+    return -1;
+  }
+
+  Profile.Clear(0);
+  int nTrials = 0;
+  size_t Index = 5;
+  while (Index + 9 <= Data.size()) {
+    uint8_t Type = Data[Index];
+    uint32_t Length = ReadLong(&Data[Index + 1]);
+    const uint8_t* Payload = &Data[Index + 9];
+    if (Index + 9 + Length > Data.size()) {
+      printf("%s: truncated record at byte %zu\n", Path, Index);
+      break;
+    }
+    if (Type == 'T') {
+      nTrials++;
+    } else if (Type == 'P' && Length == ApodPhases * 8) {
+      uint32_t Micros[ApodPhases], Bytes[ApodPhases];
+      for (int p = 0; p < ApodPhases; p++) {
+        Micros[p] = ReadLong(Payload + 8 * p);
+        Bytes[p] = ReadLong(Payload + 8 * p + 4);
+      }
+      Profile.AddCycle(Micros, Bytes);
+    }
+    Index += 9 + Length;
+  }
+  return nTrials;
+}
+
+static void PrintReport(const char* Path, const ApodProfile& Profile, int nTrials) {
+  char Line[320];
+  printf("%s: %d trials, %lu profiled\n", Path, nTrials, (unsigned long)Profile.Stats[PhaseIdle].Count);
+  for (int Row = -1; Row < ApodProfileRows; Row++) {
+    Profile.FormatLine(Row, Line, sizeof(Line));
+    printf("%s\n", Line);
+  }
+}
+
+static double Mean(const ApodPhaseStats& s) {
+  return s.Count ? (double)s.Sum / s.Count : 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s session.bin [other_session.bin]\n", argv[0]);
+    return 2;
+  }
+  static ApodProfile Profiles[2];
+  for (int f = 0; f < argc - 1; f++) {
+    int nTrials = LoadProfile(argv[f + 1], Profiles[f]);
+    if (nTrials < 0) {
+      return 2;
+    }
+    if (f > 0) {
+      printf("\n");
+    }
+    PrintReport(argv[f + 1], Profiles[f], nTrials);
+    if (Profiles[f].Stats[PhaseIdle].Count == 0) {
+      printf("No 'P' records: record the session while profiling (Apod::StartProfiling)\n");
+    }
+  }
+  if (argc == 3) {
+    printf("\n%-10s %12s %12s %9s\n", "phase", "mean_us", "mean_us", "change");
+    for (int Row = 0; Row < ApodProfileRows; Row++) {
+      double Before = Mean(Profiles[0].Stats[Row]), After = Mean(Profiles[1].Stats[Row]);
+      printf("%-10s %12.0f %12.0f ", ApodPhaseNames[Row], Before, After);
+      if (Before > 0) {
+        printf("%+8.1f%%\n", 100.0 * (After - Before) / Before);
+      } else {
+        printf("%9s\n", "-");
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+   apod_queue_stress.cpp - Stress test for the firmware's virtual event queue (Bpod_Firmware_0_5_modified/VirtualEventQueue.h).
+   A producer thread plays loop() and pushes virtual events at a given rate (default 20000/s, a 600 kbaud link
+   carrying nothing but 'V' overrides); a consumer thread plays the timer handler, ticking every 100 us and applying
+   up to --budget events per tick, at most one per input line, with the firmware's code (VirtualEventLines.h).
+   Checks that every accepted event is applied exactly once and in order, that accepted + overflows = sent, and
+   (with --retry, the producer waiting for space) that nothing is lost at all. At --rate 0 nearly everything
+   overflows: the order check then covers only the few events accepted, and the Bpod's 16-bit overflow counter
+   saturates (reported).
+   With --sequence the handler also replays a 128-step sequence (EventSequence.h, two steps every fourth tick, every
+   fourth pair on one line, restarted when it ends) on the same lines before the queue, as runSequence does. A step
+   whose line is already changed that tick waits, and so does a queued event on a line a step changed. Also checks
+   that every step is applied, in order, and that no line changes twice in one tick.
+   Build: g++ -O2 -std=c++11 -pthread -o apod_queue_stress apod_queue_stress.cpp
+   Usage: apod_queue_stress [--events N] [--rate HZ] [--budget N] [--tick US] [--retry] [--sequence]
+          --rate 0 sends as fast as possible (burst)
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../../Bpod_Firmware_0_5_modified/VirtualEventLines.h"
+
+static VirtualEventQueue<64> Queue;
+static EventSequence<128> Sequence;
+static VirtualEventLines Lines; // As VirtualLines in the firmware
+
+static double Now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Deterministic mix of port, BNC, wire and soft events
+static VirtualEvent MakeEvent(uint32_t i) {
+  uint32_t h = i * 2654435761U;
+  VirtualEvent e;
+  switch ((h >> 8) & 3) {
+    case 0: e.Target = 'P'; e.Data = (h >> 12) & 7; break;
+    case 1: e.Target = 'B'; e.Data = (h >> 12) & 1; break;
+    case 2: e.Target = 'W'; e.Data = (h >> 12) & 3; break;
+    default: e.Target = 'S'; e.Data = 1 + ((h >> 12) % 10); break;
+  }
+  return e;
+}
+
+int main(int argc, char** argv) {
+  uint32_t nEvents = 100000;
+  double Rate = 20000;
+  int Budget = 4;
+  double TickPeriod = 100e-6;
+  bool Retry = false, UseSequence = false;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--events") && HasValue) nEvents = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--rate") && HasValue) Rate = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--budget") && HasValue) Budget = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--tick") && HasValue) TickPeriod = atof(argv[++i]) * 1e-6;
+    else if (!strcmp(argv[i], "--retry")) Retry = true;
+    else if (!strcmp(argv[i], "--sequence")) UseSequence = true;
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  for (int i = 0; UseSequence && i < 128; i++) {
+    VirtualEvent e = MakeEvent(0x80000000U + ((i % 8 == 1) ? i - 1 : i)); // Line changed twice on one tick
+    Sequence.Add((i / 2) * 4, 'V', e.Target, e.Data);
+  }
+  uint64_t SequenceRuns = 0, StepsApplied = 0, StepsDelayed = 0, QueueDelayed = 0, Merged = 0;
+
+  std::vector<uint32_t> Accepted; // Indexes of the events the queue took, in push order
+  Accepted.reserve(nEvents);
+  std::atomic<bool> ProducerDone(false);
+  uint64_t Applied = 0, Ticks = 0, Mismatches = 0, MaxDepth = 0;
+  std::vector<VirtualEvent> AppliedEvents;
+  AppliedEvents.reserve(nEvents);
+
+  std::thread Consumer([&]() {
+    double NextTick = Now();
+    while (true) {
+      bool Done = ProducerDone.load();
+      if (TickPeriod > 0) {
+        while (Now() < NextTick) {
+          std::this_thread::yield();
+        }
+        NextTick += TickPeriod;
+      }
+      Ticks++;
+      uint8_t Depth = Queue.Head - Queue.Tail;
+      MaxDepth = Depth > MaxDepth ? Depth : MaxDepth;
+      uint32_t LinesChanged = 0; // Independent check: lines changed this tick
+      if (UseSequence && !Sequence.Running && (!Done || SequenceRuns == 0)) {
+        Sequence.Start((uint32_t)Ticks);
+        SequenceRuns++;
+      }
+      // handler(): runSequence, then applyVirtualEvents
+      Lines.Clear();
+      Lines.RunSequence(Sequence, (uint32_t)Ticks, [&](uint8_t, uint8_t Target, uint8_t Data) {
+        uint8_t Line = VirtualEventLine(Target, Data);
+        Merged += (LinesChanged >> Line) & 1;
+        LinesChanged |= (1U << Line);
+        if (Sequence.Position != StepsApplied % Sequence.nSteps) {
+          Mismatches++;
+        }
+        StepsDelayed += ((uint32_t)Ticks - Sequence.StartTime > Sequence.Time[Sequence.Position]);
+        StepsApplied++;
+      });
+      uint32_t SequenceLines = Lines.Used;
+      uint8_t nApplied = Lines.ApplyQueue(Queue, Budget, [&](uint8_t Target, uint8_t Data) {
+        uint8_t Line = VirtualEventLine(Target, Data);
+        Merged += (LinesChanged >> Line) & 1;
+        LinesChanged |= (1U << Line);
+        VirtualEvent Record = {Target, Data};
+        AppliedEvents.push_back(Record);
+      });
+      Applied += nApplied;
+      VirtualEvent Record;
+      if ((nApplied < Budget) && Queue.Peek(Record)) {
+        QueueDelayed += (SequenceLines >> VirtualEventLine(Record.Target, Record.Data)) & 1;
+      }
+      if (Done && Queue.Head == Queue.Tail && !Sequence.Running) {
+        break;
+      }
+    }
+  });
+
+  double Start = Now();
+  uint32_t Sent = 0;
+  for (uint32_t i = 0; i < nEvents; i++) {
+    if (Rate > 0) {
+      double Due = Start + i / Rate;
+      while (Now() < Due) {
+        std::this_thread::yield();
+      }
+    }
+    VirtualEvent e = MakeEvent(i);
+    Sent++;
+    while (Retry && (uint8_t)(Queue.Head - Queue.Tail) >= 64) {
+      std::this_thread::yield(); // Wait for space instead of overflowing
+    }
+    if (Queue.Push(e.Target, e.Data)) {
+      Accepted.push_back(i);
+    }
+  }
+  ProducerDone = true;
+  Consumer.join();
+  double Seconds = Now() - Start;
+
+  // Every accepted event applied once, in order
+  if (AppliedEvents.size() != Accepted.size()) {
+    Mismatches++;
+  }
+  for (size_t i = 0; i < AppliedEvents.size() && i < Accepted.size(); i++) {
+    VirtualEvent e = MakeEvent(Accepted[i]);
+    if (e.Target != AppliedEvents[i].Target || e.Data != AppliedEvents[i].Data) {
+      if (Mismatches++ == 0) {
+        printf("First mismatch at applied event %zu (sent #%u)\n", i, Accepted[i]);
+      }
+    }
+  }
+
+  printf("sent %u  accepted %zu  overflows %u  applied %llu  (budget %d/tick, %.0f us ticks, %llu ticks, max depth %llu)\n",
+         Sent, Accepted.size(), (unsigned)Queue.Overflows, (unsigned long long)Applied, Budget, TickPeriod * 1e6,
+         (unsigned long long)Ticks, (unsigned long long)MaxDepth);
+  printf("%.0f events/s offered over %.3f s\n", Sent / Seconds, Seconds);
+  if (Queue.Overflows == 0xFFFF) {
+    printf("overflow counter saturated at 65535: the Bpod reports no more than that; %.1f%% of the events were accepted "
+           "and checked\n", 100.0 * Accepted.size() / Sent);
+  }
+  bool StepsOk = (StepsApplied == SequenceRuns * Sequence.nSteps);
+  if (UseSequence) {
+    printf("sequence: %llu runs, %llu steps applied, %llu delayed by a line already changed that tick; "
+           "queued events held back by a step on their line %llu times\n", (unsigned long long)SequenceRuns,
+           (unsigned long long)StepsApplied, (unsigned long long)StepsDelayed, (unsigned long long)QueueDelayed);
+  }
+  uint32_t Lost = Sent - Accepted.size();
+  bool CountsOk = (Queue.Overflows == (Lost < 0xFFFF ? Lost : 0xFFFF)); // Saturating 16-bit counter, as on the Bpod
+  bool LossOk = !Retry || Accepted.size() == Sent;
+  bool Ok = Mismatches == 0 && CountsOk && LossOk && StepsOk && Merged == 0;
+  printf("%s: %s, %s%s%s\n", Ok ? "PASS" : "FAIL",
+         Mismatches == 0 ? "no event lost or reordered" : "events lost or reordered",
+         CountsOk ? "overflow count consistent" : "overflow count inconsistent",
+         Retry ? (LossOk ? ", no loss with retry" : ", LOSS with retry") : "",
+         UseSequence ? ((StepsOk && Merged == 0) ? ", no sequence step lost or merged" : ", sequence steps LOST or MERGED") : "");
+  return Ok ? 0 : 1;
+}
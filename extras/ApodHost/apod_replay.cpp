@@ -0,0 +1,217 @@
+/*
+   apod_replay.cpp - Replay an Apod session recording (Apod::StartRecording) through ApodEngine.
+   For every recorded trial, the recorded input events (ports, BNC, wire, soft codes, analog thresholds) are fed back
+   cycle-by-cycle into the matrix that was uploaded before it; the reproduced events and state
+   transitions are checked against the recorded ones.
+   Version 2 recordings also hold the Bpod's counts of events left out by the event mask and of virtual/forwarded
+   events lost to full queues; they are totalled, and a mismatching trial with masked input events is flagged.
+   Uploads that do not change what the state machine does with its inputs are checked and counted, not replayed:
+   block mode matrices ('B'; block trials come back as summaries without events), sequences ('Q'; their virtual
+   events are in the trials' recorded events) and waves ('W'; outputs only).
+   Build: g++ -O2 -std=c++11 -o apod_replay apod_replay.cpp
+   Usage: apod_replay session.bin [-v]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "ApodEngine.h"
+
+static uint32_t ReadLong(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+const int nCounters = ApodEventClasses + 2; // Masked events per class, virtual event and forwarded event overflows
+
+// Replays one 'T' record against Matrix and adds its counters (version 2) to Counters. Returns 0 if it matches,
+// 1 otherwise.
+static int ReplayTrial(const ApodMatrix& Matrix, const uint8_t* Payload, uint32_t Length, int Version, int TrialNumber,
+                       bool Verbose, uint64_t& Cycles, uint64_t* Counters) {
+  if (Length < 4) {
+    printf("Trial %d: truncated record\n", TrialNumber);
+    return 1;
+  }
+  int nEvents = Payload[0] | (Payload[1] << 8);
+  const uint8_t* EventData = Payload + 2;
+  if (Length < 4 + (uint32_t)nEvents * 5) {
+    printf("Trial %d: truncated record\n", TrialNumber);
+    return 1;
+  }
+  const uint8_t* TransitionData = EventData + nEvents * 5;
+  int nTransition = TransitionData[0] | (TransitionData[1] << 8);
+  const uint8_t* States = TransitionData + 2;
+  uint32_t CounterBytes = (Version >= 2) ? 2 * nCounters : 0;
+  if (Length < 4 + (uint32_t)nEvents * 5 + nTransition + CounterBytes) {
+    printf("Trial %d: truncated record\n", TrialNumber);
+    return 1;
+  }
+  uint32_t MaskedInputs = 0; // Port, BNC, wire and soft events left out by the event mask
+  for (uint32_t i = 0; i < CounterBytes / 2; i++) {
+    uint16_t Count = States[nTransition + 2 * i] | (States[nTransition + 2 * i + 1] << 8);
+    Counters[i] += Count;
+    MaskedInputs += (i < 4) ? Count : 0;
+  }
+
+  static ApodEngine Engine;
+  Engine.Start(&Matrix);
+  uint32_t LastTime = nEvents > 0 ? ReadLong(EventData + (nEvents - 1) * 5 + 1) : 0;
+  int Next = 0;
+  uint8_t Inputs[ApodMaxCycleInputs];
+  while (Engine.CurrentTime < LastTime && !Engine.Finished) {
+    uint32_t Time = Engine.CurrentTime + 1;
+    int nInputs = 0;
+    for (int i = Next; i < nEvents && ReadLong(EventData + i * 5 + 1) == Time; i++) {
+      uint8_t Code = EventData[i * 5];
+      if ((Code < 39 || (Code >= 50 && Code < 66)) && nInputs < ApodMaxCycleInputs) {
+        Inputs[nInputs++] = EventData[i * 5];
+      }
+    }
+    Engine.Tick(Inputs, nInputs);
+    while (Next < nEvents && ReadLong(EventData + Next * 5 + 1) <= Time) {
+      Next++;
+    }
+  }
+  Cycles += Engine.CurrentTime;
+
+  int Mismatch = 0;
+  int nCompare = Engine.nEvents < nEvents ? Engine.nEvents : nEvents;
+  for (int i = 0; i < nCompare; i++) {
+    if (Engine.Events[i] != EventData[i * 5] || Engine.TimeStamps[i] != ReadLong(EventData + i * 5 + 1)) {
+      printf("Trial %d: event %d differs (recorded %d at %u, replayed %d at %u)\n", TrialNumber, i,
+             EventData[i * 5], ReadLong(EventData + i * 5 + 1), Engine.Events[i], Engine.TimeStamps[i]);
+      Mismatch = 1;
+      break;
+    }
+  }
+  if (!Mismatch && Engine.nEvents != nEvents) {
+    printf("Trial %d: %d events recorded, %d replayed\n", TrialNumber, nEvents, Engine.nEvents);
+    Mismatch = 1;
+  }
+  if (Engine.nTransition != nTransition || memcmp(Engine.StateVisited, States, nTransition) != 0) {
+    printf("Trial %d: state sequence differs (%d recorded, %d replayed)\n", TrialNumber, nTransition, Engine.nTransition);
+    Mismatch = 1;
+  }
+  if (Mismatch && MaskedInputs > 0) {
+    printf("Trial %d: %u input events were masked on the Bpod and are not in the recording\n", TrialNumber, MaskedInputs);
+  }
+  if (!Engine.Finished && nEvents < ApodMaxEvents) {
+    printf("Trial %d: matrix did not exit on the last recorded event (aborted trial?)\n", TrialNumber);
+  }
+  if (Verbose && !Mismatch) {
+    printf("Trial %d: %d events, %d states, %u cycles OK\n", TrialNumber, nEvents, nTransition, Engine.CurrentTime);
+  }
+  return Mismatch;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s session.bin [-v]\n", argv[0]);
+    return 2;
+  }
+  bool Verbose = (argc > 2 && strcmp(argv[2], "-v") == 0);
+  FILE* File = fopen(argv[1], "rb");
+  if (!File) {
+    perror(argv[1]);
+    return 2;
+  }
+  std::vector<uint8_t> Data;
+  uint8_t Buffer[65536];
+  size_t n;
+  while ((n = fread(Buffer, 1, sizeof(Buffer), File)) > 0) {
+    Data.insert(Data.end(), Buffer, Buffer + n);
+  }
+  fclose(File);
+  if (Data.size() < 5 || memcmp(Data.data(), "APOD", 4) != 0 || Data[4] < 1 || Data[4] > 2) {
+    fprintf(stderr, "%s: not an Apod session recording (version 1 or 2)\n", argv[1]);
+    return 2;
+  }
+  int Version = Data[4];
+  uint64_t Counters[nCounters] = {};
+
+  static ApodMatrix Matrix;
+  bool HaveMatrix = false;
+  int nTrials = 0, nFailed = 0, nSkipped = 0, nOverrides = 0, nBlockMatrices = 0, nSequences = 0, nWaves = 0;
+  uint64_t Cycles = 0;
+  auto Start = std::chrono::steady_clock::now();
+  size_t Index = 5;
+  while (Index + 9 <= Data.size()) {
+    uint8_t Type = Data[Index];
+    uint32_t Length = ReadLong(&Data[Index + 1]);
+    const uint8_t* Payload = &Data[Index + 9];
+    if (Index + 9 + Length > Data.size()) {
+      printf("Truncated record at byte %zu\n", Index);
+      break;
+    }
+    switch (Type) {
+      case 'M':
+        HaveMatrix = ApodParseStateMatrix(Payload, Length, Matrix) > 0;
+        for (int Code = 0; HaveMatrix && Code < 39; Code++) {
+          if (!Matrix.Recorded(Code)) {
+            printf("Note: the matrix does not record input event %d; trials that depend on it cannot be replayed\n", Code);
+            break;
+          }
+        }
+        break;
+      case 'T':
+        nTrials++;
+        if (HaveMatrix) {
+          nFailed += ReplayTrial(Matrix, Payload, Length, Version, nTrials, Verbose, Cycles, Counters);
+        } else {
+          nSkipped++;
+        }
+        break;
+      case 'A':
+        if (HaveMatrix && !ApodParseAnalogMatrix(Payload, Length, Matrix)) {
+          printf("Malformed analog transitions at byte %zu\n", Index);
+        }
+        break;
+      case 'O':
+        nOverrides++;
+        break;
+      case 'B': { // Trial type, then a matrix image
+        static ApodMatrix BlockMatrix;
+        if (Length < 1 || Payload[0] >= 8 || ApodParseStateMatrix(Payload + 1, Length - 1, BlockMatrix) <= 0) {
+          printf("Malformed block matrix at byte %zu\n", Index);
+        }
+        nBlockMatrices++;
+      } break;
+      case 'Q':
+        if (Length < 1 || Length != 1 + 7 * (uint32_t)Payload[0]) {
+          printf("Malformed sequence at byte %zu\n", Index);
+        }
+        nSequences++;
+        break;
+      case 'W':
+        if (Length < 14 || Length != 14 + (uint32_t)(Payload[12] | (Payload[13] << 8))) {
+          printf("Malformed wave at byte %zu\n", Index);
+        }
+        nWaves++;
+        break;
+    }
+    Index += 9 + Length;
+  }
+  double Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+  printf("%d trials replayed, %d mismatched, %d skipped (no matrix), %d manual overrides\n",
+         nTrials - nSkipped, nFailed, nSkipped, nOverrides);
+  if (Version >= 2) {
+    const char* ClassNames[ApodEventClasses] = {"Port", "BNC", "Wire", "SoftCode", "Tup", "GlobalTimer", "GlobalCounter"};
+    printf("masked on the Bpod:");
+    for (int x = 0; x < ApodEventClasses; x++) {
+      printf(" %s %llu", ClassNames[x], (unsigned long long)Counters[x]);
+    }
+    printf("; lost to full queues: virtual events %llu, forwarded events %llu\n",
+           (unsigned long long)Counters[ApodEventClasses], (unsigned long long)Counters[ApodEventClasses + 1]);
+  }
+  if (nBlockMatrices + nSequences + nWaves > 0) {
+    printf("not replayed: %d block mode matrices (block trials have no recorded events), %d sequence uploads "
+           "(replayed through the recorded events), %d wave uploads (outputs only)\n", nBlockMatrices, nSequences, nWaves);
+  }
+  if (Seconds > 0 && Cycles > 0) {
+    printf("%llu Bpod cycles in %.3f s (%.0fx real-time)\n", (unsigned long long)Cycles, Seconds, Cycles / 10000.0 / Seconds);
+  }
+  return nFailed > 0 ? 1 : 0;
+}
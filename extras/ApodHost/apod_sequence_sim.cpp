@@ -0,0 +1,156 @@
+/*
+   apod_sequence_sim.cpp - Scripted pokes replayed by the Bpod ('Q' sequence, Apod::UploadSequence) versus sent one by
+   one as virtual events (ManualOverride('V', 'P', line), 3 bytes each), in simulated time.
+   A poke script (--pokes pokes on ports 1-3, exponential gaps, 50-200 ms long) is replayed in each of --trials trials.
+   The sequence is uploaded once and started with 'Q' 'G' before every trial; the timer handler steps through it with
+   the firmware's player (Bpod_Firmware_0_5_modified/EventSequence.h). For overrides the Arduino sends each step from
+   its loop (every --poll us) once the step is due, over the serial link at --baud; the Bpod's loop() (every --loop us)
+   queues it and the timer handler applies it on its next cycle (VirtualEventQueue.h, as applyVirtualEvents).
+   Reports how many steps reach the state machine on their scheduled tick, the error of the others, and the bytes sent
+   to the Bpod by each method. Also checks that uploads with steps out of tick order or lines out of range are refused.
+   Build: g++ -O2 -std=c++11 -o apod_sequence_sim apod_sequence_sim.cpp
+   Usage: apod_sequence_sim [--pokes N] [--trials N] [--gap MS] [--baud B] [--poll US] [--loop US]
+   Released into the public domain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "../../Bpod_Firmware_0_5_modified/VirtualEventLines.h"
+
+static EventSequence<128> Sequence;            // As in the firmware
+static VirtualEventQueue<64> VirtualEvents;
+static VirtualEventLines Lines;
+static const int VirtualEventBudget = 4;
+
+static uint64_t Seed = 12345;
+
+static double Uniform() {
+  Seed = Seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((Seed >> 11) + 0.5) / 9007199254740992.0;
+}
+
+struct Step {
+  uint32_t Tick; // Scheduled timer cycle
+  uint8_t Line;  // Port (0-2)
+};
+
+// Timer cycles from Tick until each step reached the state machine, for one trial
+static void RunTrial(const std::vector<Step>& Script, bool UseSequence, double PollTime, double LoopTime,
+                     double ByteTime, std::vector<uint32_t>& Errors) {
+  std::vector<double> Queued(Script.size()); // Time (us) the Bpod's loop() queues each override
+  if (!UseSequence) {
+    double LinkFree = 0;
+    double Phase = Uniform() * PollTime;
+    for (size_t i = 0; i < Script.size(); i++) {
+      double Due = Script[i].Tick * 100.0;
+      double Send = Phase + ceil((Due - Phase) / PollTime) * PollTime; // First Arduino loop at or after the step
+      LinkFree = std::max(LinkFree, Send) + 3 * ByteTime;
+      Queued[i] = LinkFree + Uniform() * LoopTime;
+    }
+  } else {
+    Sequence.Start(0); // 'Q' 'G' between trials: offsets count from the trial start
+  }
+  VirtualEvents.Clear();
+  size_t nApplied = 0, nQueued = 0;
+  for (uint32_t Cycle = 1; nApplied < Script.size(); Cycle++) {
+    // loop(): overrides that arrived since the last cycle
+    while (!UseSequence && nQueued < Script.size() && Queued[nQueued] <= Cycle * 100.0) {
+      VirtualEvents.Push('P', Script[nQueued].Line);
+      nQueued++;
+    }
+    // handler(): runSequence, then applyVirtualEvents, at most one change per line between them
+    Lines.Clear();
+    Lines.RunSequence(Sequence, Cycle, [&](uint8_t, uint8_t, uint8_t) {
+      Errors.push_back(Cycle - Script[Sequence.Position].Tick);
+      nApplied++;
+    });
+    Lines.ApplyQueue(VirtualEvents, VirtualEventBudget, [&](uint8_t, uint8_t) {
+      Errors.push_back(Cycle - Script[nApplied].Tick);
+      nApplied++;
+    });
+  }
+}
+
+int main(int argc, char** argv) {
+  int nPokes = 60, nTrials = 20;
+  double Gap = 200, Baud = 115200, Poll = 20, LoopTime = 10;
+  for (int i = 1; i < argc; i++) {
+    bool HasValue = (i + 1 < argc);
+    if (!strcmp(argv[i], "--pokes") && HasValue) nPokes = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--trials") && HasValue) nTrials = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--gap") && HasValue) Gap = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--baud") && HasValue) Baud = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--poll") && HasValue) Poll = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--loop") && HasValue) LoopTime = atof(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 2;
+    }
+  }
+  if (nPokes < 1 || nPokes > 64 || nTrials < 1 || Gap < 0 || Baud <= 0 || Poll < 1 || LoopTime < 1) {
+    fprintf(stderr, "Invalid configuration (at most 64 pokes: 128 sequence steps)\n");
+    return 2;
+  }
+
+  // Poke script: in and out of one of ports 1-3, one poke at a time
+  std::vector<Step> Script;
+  double t = 0;
+  for (int i = 0; i < nPokes; i++) {
+    t += 1 + Gap * 10 * -log(Uniform());
+    uint8_t Line = (uint8_t)(Uniform() * 3);
+    Step In = {(uint32_t)t, Line};
+    t += 500 + Uniform() * 1500;
+    Step Out = {(uint32_t)t, Line};
+    Script.push_back(In);
+    Script.push_back(Out);
+  }
+
+  // Upload checks ('Q' 'L' as the firmware handles it)
+  Sequence.Clear();
+  bool Checks = Sequence.Add(10, 'V', 'P', 0) && !Sequence.Add(9, 'V', 'P', 0) && // Out of tick order
+                !Sequence.Add(20, 'V', 'P', 8) && !Sequence.Add(20, 'V', 'B', 2) &&  // Lines out of range
+                !Sequence.Add(20, 'V', 'S', 0) && !Sequence.Add(20, 'O', 'P', 1) &&  // Soft event 0, no PWM override
+                Sequence.nSteps == 1;
+  Sequence.Clear();
+  for (size_t i = 0; i < Script.size(); i++) {
+    Checks = Sequence.Add(Script[i].Tick, 'V', 'P', Script[i].Line) && Checks;
+  }
+
+  std::vector<uint32_t> SequenceErrors, OverrideErrors;
+  double ByteTime = 10e6 / Baud;
+  for (int i = 0; i < nTrials; i++) {
+    RunTrial(Script, true, Poll, LoopTime, ByteTime, SequenceErrors);
+    RunTrial(Script, false, Poll, LoopTime, ByteTime, OverrideErrors);
+  }
+
+  uint64_t UploadBytes = 3 + 7 * Script.size(); // 'Q' 'L' n, then per step: tick (4), command, target, data
+  uint64_t SequenceBytes = UploadBytes + 2 * (uint64_t)nTrials;
+  uint64_t OverrideBytes = 3 * Script.size() * (uint64_t)nTrials;
+  printf("%d pokes (%zu steps, %.1f s) x %d trials, %.0f baud, Arduino loop %.0f us, Bpod loop %.0f us\n", nPokes,
+         Script.size(), Script.back().Tick / 10000.0, nTrials, Baud, Poll, LoopTime);
+  const char* Names[2] = {"sequence", "overrides"};
+  std::vector<uint32_t>* Errors[2] = {&SequenceErrors, &OverrideErrors};
+  for (int m = 0; m < 2; m++) {
+    std::vector<uint32_t>& E = *Errors[m];
+    std::sort(E.begin(), E.end());
+    double Mean = 0;
+    size_t OnTick = 0;
+    for (size_t i = 0; i < E.size(); i++) {
+      Mean += E[i];
+      OnTick += (E[i] == 0);
+    }
+    printf("%-9s  %5.1f%% of steps on their tick; late by mean %.2f  p99 %u  max %u cycles\n", Names[m],
+           100.0 * OnTick / E.size(), Mean / E.size(), E[(size_t)(0.99 * (E.size() - 1))], E.back());
+  }
+  printf("bytes to the Bpod: sequence %llu (upload %llu + 2 per trial), overrides %llu (3 per step, during trials); "
+         "%.1f%% saved\n", (unsigned long long)SequenceBytes, (unsigned long long)UploadBytes,
+         (unsigned long long)OverrideBytes, 100.0 * (1 - (double)SequenceBytes / OverrideBytes));
+  printf("upload checks (out of tick order, lines out of range refused): %s\n", Checks ? "OK" : "FAILED");
+  bool Ok = Checks && SequenceErrors.back() == 0 && VirtualEvents.Overflows == 0;
+  printf("%s\n", Ok ? "PASS" : "FAIL");
+  return Ok ? 0 : 1;
+}